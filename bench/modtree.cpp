@@ -0,0 +1,93 @@
+#include "modtree.h"
+
+#include <overlayfs/overlayfsmanager.h>
+
+#include <QDir>
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+using namespace std;
+namespace fs = std::filesystem;
+using namespace Qt::StringLiterals;
+
+ModTree::ModTree(const ModTreeOptions& options)
+{
+  const QString root = m_root.path();
+  m_gameDir          = root % "/game"_L1;
+  m_overwriteDir     = root % "/overwrite"_L1;
+  m_workDir          = root % "/work"_L1;
+  for (const QString& dir : {m_gameDir, m_overwriteDir, m_workDir}) {
+    QDir().mkpath(dir);
+  }
+  QDir().mkpath(root % "/plugins"_L1);
+
+  if (options.targets <= 1) {
+    m_targets << m_gameDir;
+  } else {
+    for (int target = 0; target < options.targets; ++target) {
+      m_targets << m_gameDir % "/target_"_L1 % QString::number(target);
+      QDir().mkpath(m_targets.back());
+    }
+  }
+
+  mt19937 random(options.seed);
+  bernoulli_distribution skippedSuffix(options.skippedSuffixRate);
+  bernoulli_distribution skippedDirectory(options.skippedDirectoryRate);
+  bernoulli_distribution conflict(options.conflictRate);
+  uniform_int_distribution<int> subdirectory(0, max(options.fanout, 1) - 1);
+
+  for (int mod = 0; mod < options.mods; ++mod) {
+    const QString modDir = root % "/mods/mod_"_L1 % QString::number(mod);
+    const fs::path modPath(modDir.toStdString());
+    fs::create_directories(modPath);
+
+    for (int file = 0; file < options.filesPerMod; ++file) {
+      fs::path path = modPath;
+      for (int level = 0; level < options.depth; ++level) {
+        path /= "dir_" + to_string(subdirectory(random));
+      }
+      if (skippedDirectory(random)) {
+        path /= skippedDirectory;
+      }
+      fs::create_directories(path);
+
+      const string name = conflict(random)
+                              ? "file_" + to_string(file)
+                              : "mod_" + to_string(mod) + "_file_" + to_string(file);
+      path /= name + (skippedSuffix(random) ? skippedSuffix : ".dat");
+      ofstream(path, ios::trunc);
+    }
+    m_fileCount += options.filesPerMod;
+    m_modDirs << modDir;
+
+    const QString plugin =
+        root % "/plugins/mod_"_L1 % QString::number(mod) % ".esp"_L1;
+    ofstream(plugin.toStdString(), ios::trunc);
+    m_plugins << plugin;
+  }
+}
+
+void ModTree::registerWith(OverlayFsManager& manager) const
+{
+  manager.setWorkDir(m_workDir);
+  manager.clearSkipFileSuffixes();
+  manager.clearSkipDirectories();
+  manager.addSkipFileSuffix(QString::fromLatin1(skippedSuffix));
+  manager.addSkipDirectory(QString::fromLatin1(skippedDirectory));
+  addMappings(manager);
+}
+
+void ModTree::addMappings(OverlayFsManager& manager) const
+{
+  for (qsizetype i = 0; i < m_modDirs.size(); ++i) {
+    manager.addDirectory(m_modDirs[i], m_targets[i % m_targets.size()]);
+  }
+  // the directory named overwrite becomes the upper dir, the other targets are their
+  // own upper dirs
+  manager.addDirectory(m_overwriteDir, m_targets.front());
+
+  for (const QString& plugin : m_plugins) {
+    manager.addFile(plugin, m_gameDir % "/"_L1 % QFileInfo(plugin).fileName());
+  }
+}
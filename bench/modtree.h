@@ -0,0 +1,77 @@
+#pragma once
+
+#include <QStringList>
+#include <QTemporaryDir>
+#include <cstdint>
+
+class OverlayFsManager;
+
+struct ModTreeOptions
+{
+  int mods        = 100;
+  int filesPerMod = 100;
+  // number of directories the mods are distributed over
+  int targets = 1;
+  // number of directories above every file of a mod
+  int depth = 3;
+  // number of subdirectories of every directory
+  int fanout = 8;
+  // fraction of files with a skipped file suffix
+  double skippedSuffixRate = 0.0;
+  // fraction of files in a skipped directory
+  double skippedDirectoryRate = 0.0;
+  // fraction of files that have the same path in every mod, so they conflict
+  double conflictRate = 0.25;
+  std::uint32_t seed = 1;
+};
+
+/**
+ * Synthetic mod setup in a temporary directory, removed on destruction.
+ *
+ * Every mod is a directory mapped onto one of the targets and has a plugin file that
+ * is mapped on its own. A single target is the game directory itself, multiple targets
+ * are subdirectories of it. Directory names are shared between mods, so their contents
+ * are merged. All files are empty.
+ */
+class ModTree
+{
+public:
+  static constexpr auto skippedSuffix    = ".skip";
+  static constexpr auto skippedDirectory = "skipped";
+
+  explicit ModTree(const ModTreeOptions& options);
+
+  ModTree(const ModTree&)            = delete;
+  ModTree& operator=(const ModTree&) = delete;
+
+  /**
+   * @brief Registers the game, overwrite and work directory, the skip rules and all
+   * mappings with a manager
+   */
+  void registerWith(OverlayFsManager& manager) const;
+
+  /**
+   * @brief Registers only the mappings, in the same order as registerWith()
+   */
+  void addMappings(OverlayFsManager& manager) const;
+
+  [[nodiscard]] const QString& gameDir() const noexcept { return m_gameDir; }
+  [[nodiscard]] const QStringList& targets() const noexcept { return m_targets; }
+  [[nodiscard]] qint64 fileCount() const noexcept { return m_fileCount; }
+  [[nodiscard]] qsizetype mappingCount() const noexcept
+  {
+    // the overwrite directory is mapped as well
+    return m_modDirs.size() + 1 + m_plugins.size();
+  }
+
+private:
+  QTemporaryDir m_root;
+  QString m_gameDir;
+  QString m_overwriteDir;
+  QString m_workDir;
+  QStringList m_targets;
+  // ordered from lowest to highest priority
+  QStringList m_modDirs;
+  QStringList m_plugins;
+  qint64 m_fileCount = 0;
+};
@@ -0,0 +1,246 @@
+#include "modtree.h"
+#include "overlayfsbenchmark.h"
+
+#include <overlayfs/overlayfsmanager.h>
+
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <map>
+#include <tuple>
+
+using namespace std;
+
+// generated trees are shared between benchmarks with the same arguments
+static const ModTree& modTree(int mods, int filesPerMod, int targets = 1)
+{
+  static map<tuple<int, int, int>, unique_ptr<ModTree>> trees;
+
+  auto& tree = trees[{mods, filesPerMod, targets}];
+  if (tree == nullptr) {
+    ModTreeOptions options;
+    options.mods                 = mods;
+    options.filesPerMod          = filesPerMod;
+    options.targets              = targets;
+    options.skippedSuffixRate    = 0.05;
+    options.skippedDirectoryRate = 0.05;
+    tree                         = make_unique<ModTree>(options);
+  }
+  return *tree;
+}
+
+static const ModTree& modTree(const benchmark::State& state)
+{
+  return modTree(static_cast<int>(state.range(0)), static_cast<int>(state.range(1)));
+}
+
+// uses the stub instead of fuse-overlayfs and fusermount, configured by environment
+// variables that are inherited by the stub
+static void useStub(OverlayFsManager& manager, int64_t mountDelay,
+                    int mountExitCode = 0)
+{
+  manager.setOverlayFsPrograms(QStringLiteral(OVERLAYFS_STUB_PATH),
+                               QStringLiteral(OVERLAYFS_STUB_PATH));
+  qputenv("OVERLAYFS_STUB_MOUNT_DELAY_MS", QByteArray::number(mountDelay));
+  qputenv("OVERLAYFS_STUB_MOUNT_EXIT_CODE", QByteArray::number(mountExitCode));
+}
+
+static void setCounters(benchmark::State& state, const ModTree& tree)
+{
+  state.counters["files"]    = static_cast<double>(tree.fileCount());
+  state.counters["mappings"] = static_cast<double>(tree.mappingCount());
+  state.SetItemsProcessed(state.iterations() * tree.fileCount());
+}
+
+static void BM_Register(benchmark::State& state)
+{
+  const ModTree& tree = modTree(state);
+  auto manager        = OverlayFsBenchmark::create();
+  tree.registerWith(*manager);
+
+  for (auto _ : state) {
+    manager->clearMappings();
+    tree.addMappings(*manager);
+  }
+  state.SetItemsProcessed(state.iterations() * tree.mappingCount());
+  state.counters["mappings"] = static_cast<double>(tree.mappingCount());
+}
+
+// sums the durations of all phases with the given name in milliseconds
+static double phaseMilliseconds(const OverlayFsManager::Statistics& statistics,
+                                const QString& name)
+{
+  double milliseconds = 0;
+  for (const auto& phase : statistics.phases) {
+    if (phase.name == name) {
+      milliseconds += chrono::duration<double, milli>(phase.duration).count();
+    }
+  }
+  return milliseconds;
+}
+
+// source directories are scanned once, later runs only check their stamps
+static void BM_CreateMountPlan(benchmark::State& state)
+{
+  const ModTree& tree = modTree(state);
+  auto manager        = OverlayFsBenchmark::create();
+  tree.registerWith(*manager);
+
+  for (auto _ : state) {
+    const auto plan = manager->createMountPlan();
+    if (!plan.has_value()) {
+      state.SkipWithError("creating the mount plan failed");
+      break;
+    }
+    benchmark::DoNotOptimize(plan);
+  }
+  setCounters(state, tree);
+}
+
+// mounts and unmounts a plan that is created once, so the sources are not planned
+// again, the stub exits right away and the symlink and cleanup phases are reported
+static void BM_MountPlan(benchmark::State& state)
+{
+  const ModTree& tree = modTree(state);
+  auto manager        = OverlayFsBenchmark::create();
+  tree.registerWith(*manager);
+  useStub(*manager, 0);
+
+  const auto plan = manager->createMountPlan();
+  if (!plan.has_value()) {
+    state.SkipWithError("creating the mount plan failed");
+    return;
+  }
+
+  double symlinks = 0;
+  double cleanup  = 0;
+  for (auto _ : state) {
+    if (!manager->mount(*plan)) {
+      state.SkipWithError("mounting failed");
+      break;
+    }
+    symlinks += phaseMilliseconds(manager->lastRunStatistics(),
+                                  QStringLiteral("create symlinks"));
+    if (!manager->umount()) {
+      state.SkipWithError("unmounting failed");
+      break;
+    }
+    cleanup +=
+        phaseMilliseconds(manager->lastRunStatistics(), QStringLiteral("cleanup"));
+  }
+  state.counters["symlinks_ms"] =
+      benchmark::Counter(symlinks, benchmark::Counter::kAvgIterations);
+  state.counters["cleanup_ms"] =
+      benchmark::Counter(cleanup, benchmark::Counter::kAvgIterations);
+  setCounters(state, tree);
+}
+
+// the tree is built once and reused as long as no source directory changed
+static void BM_CreateOverlayFsDump(benchmark::State& state)
+{
+  const ModTree& tree = modTree(state);
+  auto manager        = OverlayFsBenchmark::create();
+  tree.registerWith(*manager);
+
+  for (auto _ : state) {
+    const QStringList dump = manager->createOverlayFsDump();
+    if (dump.isEmpty()) {
+      state.SkipWithError("creating the dump failed");
+      break;
+    }
+    benchmark::DoNotOptimize(dump);
+  }
+  setCounters(state, tree);
+}
+
+// mounts and unmounts all targets, the stub exits after the given delay
+static void BM_MountCycle(benchmark::State& state)
+{
+  const int targets   = static_cast<int>(state.range(0));
+  const ModTree& tree = modTree(100, 100, targets);
+  auto manager        = OverlayFsBenchmark::create();
+  tree.registerWith(*manager);
+  useStub(*manager, state.range(1));
+
+  qint64 processes = 0;
+  for (auto _ : state) {
+    if (!manager->mount()) {
+      state.SkipWithError("mounting failed");
+      break;
+    }
+    processes = manager->lastRunStatistics().processes;
+    if (!manager->umount()) {
+      state.SkipWithError("unmounting failed");
+      break;
+    }
+  }
+  state.counters["processes"] = static_cast<double>(processes);
+  setCounters(state, tree);
+}
+
+// mounts while the stub takes longer than the process timeout, a failed mount is
+// rolled back so the next one starts from scratch
+static void BM_MountTimeout(benchmark::State& state)
+{
+  const chrono::milliseconds timeout(state.range(0));
+  const ModTree& tree = modTree(100, 100);
+  auto manager        = OverlayFsBenchmark::create();
+  tree.registerWith(*manager);
+  useStub(*manager, timeout.count() * 10);
+  manager->setProcessTimeout(timeout);
+
+  for (auto _ : state) {
+    if (manager->mount()) {
+      state.SkipWithError("mounting did not time out");
+      break;
+    }
+  }
+}
+
+// mounts with a stub that fails, so the error path including the rollback is measured
+static void BM_MountFailure(benchmark::State& state)
+{
+  const ModTree& tree = modTree(100, 100);
+  auto manager        = OverlayFsBenchmark::create();
+  tree.registerWith(*manager);
+  useStub(*manager, 0, 1);
+
+  for (auto _ : state) {
+    if (manager->mount()) {
+      state.SkipWithError("mounting did not fail");
+      break;
+    }
+  }
+}
+
+// number of mods and files per mod
+static void modTreeSizes(benchmark::internal::Benchmark* bench)
+{
+  bench->ArgNames({"mods", "files"})
+      ->Args({10, 100})
+      ->Args({100, 100})
+      ->Args({500, 100})
+      ->Args({100, 1000})
+      ->Unit(benchmark::kMillisecond);
+}
+
+BENCHMARK(BM_Register)->Apply(modTreeSizes);
+BENCHMARK(BM_CreateMountPlan)->Apply(modTreeSizes);
+BENCHMARK(BM_MountPlan)->Apply(modTreeSizes);
+BENCHMARK(BM_CreateOverlayFsDump)->Apply(modTreeSizes);
+
+// number of targets and startup latency of the stub in ms
+BENCHMARK(BM_MountCycle)
+    ->ArgNames({"targets", "latency"})
+    ->ArgsProduct({{1, 4, 16}, {0, 20}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// process timeout in ms
+BENCHMARK(BM_MountTimeout)
+    ->ArgName("timeout")
+    ->Arg(10)
+    ->Arg(100)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+BENCHMARK(BM_MountFailure)->Unit(benchmark::kMillisecond)->UseRealTime();
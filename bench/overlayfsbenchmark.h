@@ -0,0 +1,24 @@
+#pragma once
+
+#include <overlayfs/overlayfsmanager.h>
+
+#include <memory>
+#include <spdlog/common.h>
+
+/**
+ * Creates managers for the benchmarks, which only use the public interface of the
+ * manager
+ */
+class OverlayFsBenchmark
+{
+public:
+  using Manager = std::unique_ptr<OverlayFsManager>;
+
+  static Manager create()
+  {
+    auto manager =
+        std::make_unique<OverlayFsManager>(QStringLiteral("overlayfs_bench.log"));
+    manager->setLogLevel(spdlog::level::off);
+    return manager;
+  }
+};
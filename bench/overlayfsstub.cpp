@@ -0,0 +1,54 @@
+// Stand-in for fuse-overlayfs and fusermount that mounts nothing, so the overhead of
+// the library can be measured without FUSE. Runs starting with -u are unmounts, all
+// other runs are mounts. Configured with environment variables:
+//  - OVERLAYFS_STUB_LOG: file every run appends its arguments to, separated by tabs
+//  - OVERLAYFS_STUB_MOUNT_DELAY_MS, OVERLAYFS_STUB_UMOUNT_DELAY_MS: time to sleep
+//    before exiting
+//  - OVERLAYFS_STUB_MOUNT_EXIT_CODE, OVERLAYFS_STUB_UMOUNT_EXIT_CODE: exit code
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+static long environmentValue(const char* name)
+{
+  const char* value = getenv(name);
+  return value != nullptr ? strtol(value, nullptr, 10) : 0;
+}
+
+int main(int argc, char* argv[])
+{
+  const bool umount = argc > 1 && strcmp(argv[1], "-u") == 0;
+
+  if (const char* log = getenv("OVERLAYFS_STUB_LOG")) {
+    string line;
+    for (int i = 1; i < argc; ++i) {
+      if (i > 1) {
+        line += '\t';
+      }
+      line += argv[i];
+    }
+    line += '\n';
+    // a single append keeps lines of concurrent runs intact
+    const int fd = open(log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1 || write(fd, line.data(), line.size()) == -1) {
+      return 127;
+    }
+    close(fd);
+  }
+
+  const long delay = environmentValue(umount ? "OVERLAYFS_STUB_UMOUNT_DELAY_MS"
+                                             : "OVERLAYFS_STUB_MOUNT_DELAY_MS");
+  if (delay > 0) {
+    this_thread::sleep_for(chrono::milliseconds(delay));
+  }
+
+  return static_cast<int>(environmentValue(umount ? "OVERLAYFS_STUB_UMOUNT_EXIT_CODE"
+                                                  : "OVERLAYFS_STUB_MOUNT_EXIT_CODE"));
+}
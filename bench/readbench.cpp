@@ -0,0 +1,523 @@
+// Measures file system operations through mounted layer stacks, compared to the same
+// files in a plain directory, and through direct mounts and mounts of saved plans.
+// Needs FUSE, backends that cannot be mounted are skipped.
+
+#include "overlayfsbenchmark.h"
+
+#include <overlayfs/overlayfsmanager.h>
+
+#include <QDir>
+#include <QTemporaryDir>
+#include <array>
+#include <benchmark/benchmark.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+using namespace Qt::StringLiterals;
+
+// size of the files that are read
+static constexpr size_t fileSize = 64 * 1024;
+
+static constexpr array layerCounts = {1, 10, 100, 1000};
+
+enum class Access
+{
+  // the plain directory holding the merged files
+  Direct,
+  FuseOverlayFs,
+  Builtin
+};
+
+// layer providing the accessed file
+enum class Hit
+{
+  Top,
+  Middle,
+  Bottom,
+  // the file is in the target, which is the upper dir, and in the bottom layer
+  Upper,
+  // the file does not exist
+  Miss
+};
+
+// contents of files in lower dirs and in the upper dir
+static constexpr char lowerContents = 'x';
+static constexpr char upperContents = 'u';
+
+static void createFile(const QString& path, size_t size,
+                       char contentsChar = lowerContents)
+{
+  QDir().mkpath(QFileInfo(path).absolutePath());
+  ofstream file(path.toStdString(), ios::binary | ios::trunc);
+  const string contents(size, contentsChar);
+  file.write(contents.data(), static_cast<streamsize>(contents.size()));
+}
+
+static void setBackend(OverlayFsManager& manager, Access access)
+{
+  manager.setBackend(access == Access::Builtin
+                         ? OverlayFsManager::Backend::Builtin
+                         : OverlayFsManager::Backend::FuseOverlayFs);
+}
+
+/**
+ * Layers mounted on a target and a plain directory with the same contents. Every layer
+ * has a file of its own and an entry in a directory shared by all layers. The target
+ * has a file that is also in the bottom layer, which must be hidden by the target.
+ */
+class LayerStack
+{
+public:
+  LayerStack(int layers, Access access) : m_layers(layers)
+  {
+    const QString root = m_root.path();
+    m_target           = root % "/target"_L1;
+    QDir().mkpath(m_target);
+    QDir().mkpath(root % "/upper"_L1);
+    QDir().mkpath(root % "/work"_L1);
+
+    const QString merged = root % "/merged"_L1;
+    for (int layer = 0; layer < layers; ++layer) {
+      const QString layerDir = root % "/layers/layer_"_L1 % QString::number(layer);
+      // only the files that are accessed have contents
+      const bool accessed = layer == fileLayer(Hit::Top) ||
+                            layer == fileLayer(Hit::Middle) ||
+                            layer == fileLayer(Hit::Bottom);
+      for (const QString& dir : {layerDir, merged}) {
+        createFile(dir % "/"_L1 % fileName(layer), accessed ? fileSize : 0);
+        createFile(dir % "/shared/entry_"_L1 % QString::number(layer), 0);
+      }
+      m_layerDirs << layerDir;
+    }
+
+    createFile(m_layerDirs.front() % "/"_L1 % upperFileName, fileSize);
+    for (const QString& dir : {m_target, merged}) {
+      createFile(dir % "/"_L1 % upperFileName, fileSize, upperContents);
+    }
+
+    if (access == Access::Direct) {
+      m_accessDir = merged;
+      return;
+    }
+
+    m_manager = OverlayFsBenchmark::create();
+    setBackend(*m_manager, access);
+    m_manager->setWorkDir(root % "/work"_L1);
+    m_manager->setUpperDir(root % "/upper"_L1);
+    // later layers have a higher priority
+    for (const QString& layerDir : std::as_const(m_layerDirs)) {
+      m_manager->addDirectory(layerDir, m_target);
+    }
+    if (m_manager->mount()) {
+      m_accessDir = m_target;
+    }
+  }
+
+  ~LayerStack()
+  {
+    // unmount before the directories are removed
+    m_manager.reset();
+  }
+
+  [[nodiscard]] bool isAvailable() const noexcept { return !m_accessDir.isEmpty(); }
+
+  [[nodiscard]] string path(Hit hit) const
+  {
+    QString name;
+    switch (hit) {
+    case Hit::Upper:
+      name = upperFileName;
+      break;
+    case Hit::Miss:
+      name = u"missing.dat"_s;
+      break;
+    default:
+      name = fileName(fileLayer(hit));
+      break;
+    }
+    return (m_accessDir % "/"_L1 % name).toStdString();
+  }
+
+  [[nodiscard]] string sharedDir() const
+  {
+    return (m_accessDir % "/shared"_L1).toStdString();
+  }
+
+private:
+  static constexpr auto upperFileName = "upper.dat"_L1;
+
+  [[nodiscard]] int fileLayer(Hit hit) const noexcept
+  {
+    switch (hit) {
+    case Hit::Top:
+      return m_layers - 1;
+    case Hit::Middle:
+      return m_layers / 2;
+    default:
+      return 0;
+    }
+  }
+
+  static QString fileName(int layer)
+  {
+    return "file_"_L1 % QString::number(layer) % ".dat"_L1;
+  }
+
+  QTemporaryDir m_root;
+  int m_layers;
+  QStringList m_layerDirs;
+  QString m_target;
+  // directory the files are accessed in, empty if mounting failed
+  QString m_accessDir;
+  OverlayFsBenchmark::Manager m_manager;
+};
+
+// stacks are mounted on first use and stay mounted until all benchmarks ran
+static map<pair<Access, int>, unique_ptr<LayerStack>>& layerStacks()
+{
+  static map<pair<Access, int>, unique_ptr<LayerStack>> stacks;
+  return stacks;
+}
+
+static const LayerStack& layerStack(Access access, int layers)
+{
+  auto& stack = layerStacks()[{access, layers}];
+  if (stack == nullptr) {
+    stack = make_unique<LayerStack>(layers, access);
+  }
+  return *stack;
+}
+
+static void BM_Stat(benchmark::State& state, Access access, int layers, Hit hit)
+{
+  const LayerStack& stack = layerStack(access, layers);
+  if (!stack.isAvailable()) {
+    state.SkipWithError("mounting failed");
+    return;
+  }
+
+  const string path = stack.path(hit);
+  struct stat st;
+  for (auto _ : state) {
+    const int result = stat(path.c_str(), &st);
+    if ((result == 0) == (hit == Hit::Miss)) {
+      state.SkipWithError("unexpected stat result");
+      break;
+    }
+  }
+}
+
+static void BM_Open(benchmark::State& state, Access access, int layers, Hit hit)
+{
+  const LayerStack& stack = layerStack(access, layers);
+  if (!stack.isAvailable()) {
+    state.SkipWithError("mounting failed");
+    return;
+  }
+
+  const string path = stack.path(hit);
+  for (auto _ : state) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if ((fd != -1) == (hit == Hit::Miss)) {
+      state.SkipWithError("unexpected open result");
+      break;
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+}
+
+static void BM_Read(benchmark::State& state, Access access, int layers, Hit hit)
+{
+  const LayerStack& stack = layerStack(access, layers);
+  if (!stack.isAvailable()) {
+    state.SkipWithError("mounting failed");
+    return;
+  }
+
+  const string path = stack.path(hit);
+  vector<char> buffer(fileSize);
+  for (auto _ : state) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      state.SkipWithError("open failed");
+      break;
+    }
+    size_t total = 0;
+    ssize_t size;
+    while ((size = read(fd, buffer.data(), buffer.size())) > 0) {
+      total += static_cast<size_t>(size);
+    }
+    close(fd);
+    if (total != fileSize) {
+      state.SkipWithError("short read");
+      break;
+    }
+    // every chunk is read to the start of the buffer
+    const char expected = hit == Hit::Upper ? upperContents : lowerContents;
+    if (buffer.front() != expected) {
+      state.SkipWithError("file served from the wrong layer");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(fileSize));
+}
+
+// lists the directory every layer has an entry in
+static void BM_Readdir(benchmark::State& state, Access access, int layers)
+{
+  const LayerStack& stack = layerStack(access, layers);
+  if (!stack.isAvailable()) {
+    state.SkipWithError("mounting failed");
+    return;
+  }
+
+  const string path = stack.sharedDir();
+  for (auto _ : state) {
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) {
+      state.SkipWithError("opendir failed");
+      break;
+    }
+    int entries = 0;
+    while (readdir(dir) != nullptr) {
+      ++entries;
+    }
+    closedir(dir);
+    // including . and ..
+    if (entries != layers + 2) {
+      state.SkipWithError("unexpected number of entries");
+      break;
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * layers);
+}
+
+/**
+ * A single source mounted on its target with direct mounts enabled. A target that
+ * already has files must be mounted as an overlay, so its files stay visible.
+ */
+class DirectMount
+{
+public:
+  DirectMount(Access access, bool emptyTarget)
+  {
+    const QString root = m_root.path();
+    m_target           = root % "/target"_L1;
+    QDir().mkpath(m_target);
+    createFile(root % "/source/"_L1 % sourceFileName, fileSize);
+    if (!emptyTarget) {
+      createFile(m_target % "/"_L1 % targetFileName, fileSize, upperContents);
+    }
+
+    m_manager = OverlayFsBenchmark::create();
+    setBackend(*m_manager, access);
+    m_manager->setDirectMounts(true);
+    m_manager->addDirectory(root % "/source"_L1, m_target);
+    m_mounted = m_manager->mount();
+  }
+
+  ~DirectMount()
+  {
+    // unmount before the directories are removed
+    m_manager.reset();
+  }
+
+  [[nodiscard]] bool isMounted() const noexcept { return m_mounted; }
+
+  [[nodiscard]] string sourceFile() const
+  {
+    return (m_target % "/"_L1 % sourceFileName).toStdString();
+  }
+
+  [[nodiscard]] string targetFile() const
+  {
+    return (m_target % "/"_L1 % targetFileName).toStdString();
+  }
+
+private:
+  static constexpr auto sourceFileName = "source.dat"_L1;
+  static constexpr auto targetFileName = "target.dat"_L1;
+
+  QTemporaryDir m_root;
+  QString m_target;
+  bool m_mounted = false;
+  OverlayFsBenchmark::Manager m_manager;
+};
+
+// stats a file of the source through a direct mount, and the file that was already in
+// the target if there is one
+static void BM_DirectMount(benchmark::State& state, Access access, bool emptyTarget)
+{
+  const DirectMount mount(access, emptyTarget);
+  if (!mount.isMounted()) {
+    state.SkipWithError("mounting failed");
+    return;
+  }
+
+  const string sourceFile = mount.sourceFile();
+  const string targetFile = mount.targetFile();
+  struct stat st;
+  for (auto _ : state) {
+    if (stat(sourceFile.c_str(), &st) != 0) {
+      state.SkipWithError("file of the source is missing");
+      break;
+    }
+    if (!emptyTarget && stat(targetFile.c_str(), &st) != 0) {
+      state.SkipWithError("file of the target is hidden by the mount");
+      break;
+    }
+  }
+}
+
+/**
+ * A source with a skipped file, mounted from a plan that was saved and loaded again.
+ * The file is skipped while planning only, so it stays hidden because the plan has to
+ * be mounted with the skip rules it was created with.
+ */
+class PlannedMount
+{
+public:
+  explicit PlannedMount(Access access)
+  {
+    const QString root = m_root.path();
+    m_target           = root % "/target"_L1;
+    QDir().mkpath(m_target);
+    QDir().mkpath(root % "/upper"_L1);
+    QDir().mkpath(root % "/work"_L1);
+    createFile(root % "/source/"_L1 % keptFileName, fileSize);
+    createFile(root % "/source/"_L1 % skippedFileName, fileSize);
+
+    m_manager = OverlayFsBenchmark::create();
+    setBackend(*m_manager, access);
+    m_manager->setWorkDir(root % "/work"_L1);
+    m_manager->setUpperDir(root % "/upper"_L1);
+    m_manager->addDirectory(root % "/source"_L1, m_target);
+    m_manager->addSkipFileSuffix(skippedSuffix);
+
+    const auto plan = m_manager->createMountPlan();
+    m_manager->clearSkipFileSuffixes();
+    if (!plan.has_value()) {
+      return;
+    }
+
+    QString error;
+    const auto loaded = MountPlan::fromJson(plan->toJson(), error);
+    m_mounted         = loaded.has_value() && m_manager->mount(*loaded);
+  }
+
+  ~PlannedMount()
+  {
+    // unmount before the directories are removed
+    m_manager.reset();
+  }
+
+  [[nodiscard]] bool isMounted() const noexcept { return m_mounted; }
+
+  [[nodiscard]] string keptFile() const
+  {
+    return (m_target % "/"_L1 % keptFileName).toStdString();
+  }
+
+  [[nodiscard]] string skippedFile() const
+  {
+    return (m_target % "/"_L1 % skippedFileName).toStdString();
+  }
+
+private:
+  static constexpr auto skippedSuffix   = ".skip"_L1;
+  static constexpr auto keptFileName    = "kept.dat"_L1;
+  static constexpr auto skippedFileName = "skipped.dat.skip"_L1;
+
+  QTemporaryDir m_root;
+  QString m_target;
+  bool m_mounted = false;
+  OverlayFsBenchmark::Manager m_manager;
+};
+
+// stats the files of a mount that was created from a plan
+static void BM_PlannedMount(benchmark::State& state, Access access)
+{
+  const PlannedMount mount(access);
+  if (!mount.isMounted()) {
+    state.SkipWithError("mounting failed");
+    return;
+  }
+
+  const string keptFile    = mount.keptFile();
+  const string skippedFile = mount.skippedFile();
+  struct stat st;
+  for (auto _ : state) {
+    if (stat(keptFile.c_str(), &st) != 0) {
+      state.SkipWithError("file of the source is missing");
+      break;
+    }
+    if (stat(skippedFile.c_str(), &st) == 0) {
+      state.SkipWithError("file skipped by the plan is visible");
+      break;
+    }
+  }
+}
+
+static void registerBenchmarks()
+{
+  vector<pair<Access, const char*>> accesses = {
+      {Access::Direct, "direct"}, {Access::FuseOverlayFs, "fuse-overlayfs"}};
+  if (OverlayFsManager::isBackendAvailable(OverlayFsManager::Backend::Builtin)) {
+    accesses.emplace_back(Access::Builtin, "builtin");
+  }
+
+  constexpr array hits = {pair{Hit::Top, "top"}, pair{Hit::Middle, "middle"},
+                          pair{Hit::Bottom, "bottom"}, pair{Hit::Upper, "upper"},
+                          pair{Hit::Miss, "miss"}};
+
+  // the work happens in the file system, so the wall time is measured
+  const auto add = [](const string& name, auto function, auto... args) {
+    benchmark::RegisterBenchmark(name.c_str(), function, args...)->UseRealTime();
+  };
+
+  for (const auto& [access, accessName] : accesses) {
+    for (const int layers : layerCounts) {
+      const string suffix = "/"s + accessName + "/layers:" + to_string(layers);
+
+      for (const auto& [hit, hitName] : hits) {
+        const string name = suffix + "/hit:" + hitName;
+        add("BM_Stat" + name, BM_Stat, access, layers, hit);
+        add("BM_Open" + name, BM_Open, access, layers, hit);
+        if (hit != Hit::Miss) {
+          add("BM_Read" + name, BM_Read, access, layers, hit);
+        }
+      }
+      add("BM_Readdir" + suffix, BM_Readdir, access, layers);
+    }
+
+    if (access != Access::Direct) {
+      const string name = "BM_DirectMount/"s + accessName;
+      add(name + "/target:empty", BM_DirectMount, access, true);
+      add(name + "/target:files", BM_DirectMount, access, false);
+      add("BM_PlannedMount/"s + accessName, BM_PlannedMount, access);
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  registerBenchmarks();
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  // unmount all stacks
+  layerStacks().clear();
+  return 0;
+}
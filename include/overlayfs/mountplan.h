@@ -0,0 +1,140 @@
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <optional>
+#include <vector>
+
+#ifndef EXPORT
+#define EXPORT __attribute__((visibility("default")))
+#endif
+
+/**
+ * Describes how a set of mappings is mounted: the layers of every target, the files
+ * hidden in them and the symlinks created for mapped files.
+ *
+ * Plans are created by OverlayFsManager::createMountPlan() without changing anything on
+ * disk, and can be saved and loaded to mount them later without planning again. A plan
+ * is immutable and does not follow later changes of the mappings, settings or source
+ * directories, isCurrent() checks the source directories.
+ */
+class EXPORT MountPlan
+{
+public:
+  enum class Backend
+  {
+    // every target is mounted by a fuse-overlayfs process
+    FuseOverlayFs,
+    // every target is served from the merged file tree by this library
+    Builtin
+  };
+
+  enum class Method
+  {
+    Overlay,
+    // bind mount of the only source
+    BindMount,
+    // the target is replaced by a symlink to the only source
+    Symlink
+  };
+
+  struct Target
+  {
+    Method method = Method::Overlay;
+    QString target;
+    QString upperDir;
+    // ordered from highest to lowest priority
+    QStringList lowerDirs;
+    // all sources with this target, including the upper dir
+    QStringList sources;
+    // lower dirs left out because they do not provide any visible files
+    QStringList prunedDirs;
+    // skipped files, relative to the target
+    QStringList whiteouts;
+    // skipped directories, relative to the target
+    QStringList opaque;
+  };
+
+  struct Symlink
+  {
+    QString source;
+    QString destination;
+  };
+
+  // version 2 added the skip rules
+  static constexpr int version = 2;
+
+  [[nodiscard]] Backend backend() const noexcept { return m_backend; }
+  [[nodiscard]] const std::vector<Target>& targets() const noexcept
+  {
+    return m_targets;
+  }
+  [[nodiscard]] const std::vector<Symlink>& symlinks() const noexcept
+  {
+    return m_symlinks;
+  }
+
+  /**
+   * @brief File name suffixes that were skipped while planning, sources are scanned
+   * with them again when the plan is mounted
+   */
+  [[nodiscard]] const QStringList& skipFileSuffixes() const noexcept
+  {
+    return m_skipFileSuffixes;
+  }
+
+  /**
+   * @brief Directory names that were skipped while planning
+   */
+  [[nodiscard]] const QStringList& skipDirectories() const noexcept
+  {
+    return m_skipDirectories;
+  }
+
+  /**
+   * @brief Checks if none of the directories of the sources changed since the plan was
+   * created, by comparing their inode numbers and modification times
+   */
+  [[nodiscard]] bool isCurrent() const;
+
+  [[nodiscard]] QByteArray toJson() const;
+
+  /**
+   * @param error Receives a description of the error if the plan is invalid
+   * @return The plan or nothing on error
+   */
+  [[nodiscard]] static std::optional<MountPlan> fromJson(const QByteArray& json,
+                                                         QString& error);
+
+  /**
+   * @brief Writes the plan to a file, replacing the file atomically
+   * @param error Receives a description of the error if writing failed
+   */
+  [[nodiscard]] bool save(const QString& file, QString& error) const;
+
+  /**
+   * @param error Receives a description of the error if the file cannot be used
+   * @return The plan or nothing on error
+   */
+  [[nodiscard]] static std::optional<MountPlan> load(const QString& file,
+                                                     QString& error);
+
+private:
+  friend class OverlayFsManager;
+
+  struct stamp_t
+  {
+    // absolute path of a scanned directory
+    QString path;
+    quint64 inode;
+    qint64 mtime;
+  };
+
+  Backend m_backend = Backend::FuseOverlayFs;
+  std::vector<Target> m_targets;
+  std::vector<Symlink> m_symlinks;
+  QStringList m_skipFileSuffixes;
+  QStringList m_skipDirectories;
+  std::vector<stamp_t> m_stamps;
+};
@@ -1,7 +1,22 @@
 #pragma once
 
+#include <overlayfs/mountplan.h>
+
+#include <QSet>
 #include <QTemporaryDir>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
+#include <thread>
 #include <vector>
 
 #ifndef EXPORT
@@ -9,19 +24,159 @@
 #endif
 
 // forward declarations
+class QFile;
 class QProcess;
+class FuseBackend;
+class LayerCache;
+class LayerListing;
+class MergedIndex;
+class Tracer;
+class VirtualFileTree;
+struct LayerSource;
+struct SkipRules;
 namespace spdlog
 {
 namespace level
 {
   enum level_enum : int;
 }
+namespace details
+{
+  class periodic_worker;
+  class thread_pool;
+}  // namespace details
 class logger;
 }  // namespace spdlog
 
 class EXPORT OverlayFsManager
 {
 public:
+  using Backend = MountPlan::Backend;
+
+  enum class WhiteoutLocation
+  {
+    // whiteout files are created in the upper dir and deleted on unmount
+    UpperDir,
+    // whiteout files are created in a separate layer stacked above all lower dirs
+    SkipLayer
+  };
+
+  struct DumpEntry
+  {
+    enum class Type
+    {
+      File,
+      Directory,
+      Symlink,
+      Other
+    };
+
+    QString path;
+    Type type;
+    // file size in bytes, 0 for directories
+    qint64 size;
+  };
+
+  /**
+   * Receives a chunk of dump entries, returning false stops the dump
+   */
+  using DumpCallback = std::function<bool(std::span<const DumpEntry> entries)>;
+
+  struct DirectoryEntry
+  {
+    QString name;
+    DumpEntry::Type type;
+    // file size in bytes, 0 for directories
+    qint64 size;
+    // file backing this entry, empty if it is generated during mounting
+    QString source;
+  };
+
+  struct FileConflict
+  {
+    // path relative to the destination
+    QString path;
+    // lower dirs providing the file, ordered from highest to lowest priority
+    QStringList sources;
+  };
+
+  struct SourceConflicts
+  {
+    QString source;
+    // number of files hiding a file of a lower priority source
+    qsizetype overriding = 0;
+    // number of files hidden by a higher priority source
+    qsizetype overridden = 0;
+  };
+
+  struct ConflictReport
+  {
+    QString destination;
+    // files provided by more than one lower dir, sorted by path
+    std::vector<FileConflict> files;
+    // all lower dirs, ordered from highest to lowest priority
+    std::vector<SourceConflicts> sources;
+  };
+
+  /**
+   * Timings and counters of the last mount and the following unmount
+   */
+  struct Statistics
+  {
+    struct Phase
+    {
+      QString name;
+      std::chrono::nanoseconds duration;
+    };
+
+    // phases in the order they finished, a phase can contain other phases
+    std::vector<Phase> phases;
+    // entries of all source directories
+    qint64 layerEntries = 0;
+    // whiteout files and opaque markers, reused ones are not counted
+    qint64 whiteouts = 0;
+    // symlinks, reused ones are not counted
+    qint64 symlinks = 0;
+    // started fuse-overlayfs processes
+    qint64 processes = 0;
+    // length of all lowerdir options passed to fuse-overlayfs in bytes
+    qint64 lowerDirBytes = 0;
+  };
+
+  /**
+   * Immutable state of a manager, replaced as a whole whenever it changes
+   */
+  struct Status
+  {
+    struct Target
+    {
+      QString path;
+      bool mounted = false;
+    };
+
+    bool mounted = false;
+    // targets of the current or last mount
+    std::vector<Target> targets;
+    // processes started by createProcess() that are still running
+    std::vector<pid_t> processes;
+    // last error message that was logged, empty if there was none
+    QString lastError;
+  };
+
+  /**
+   * @brief Creates a manager with its own mappings, settings, logger and mounts.
+   * Managers do not share any state, so different managers can prepare and mount at
+   * the same time on different threads, as long as their targets and upper dirs do not
+   * overlap.
+   * @param file Log file, in addition to stdout
+   */
+  explicit OverlayFsManager(QString file = QStringLiteral("overlayfs.log")) noexcept;
+  ~OverlayFsManager() noexcept;
+
+  /**
+   * @brief Returns a manager shared by the whole process, the log file is set by the
+   * first call
+   */
   static OverlayFsManager&
   getInstance(const QString& file = QStringLiteral("overlayfs.log")) noexcept
   {
@@ -33,8 +188,26 @@ public:
   void operator=(OverlayFsManager const&)   = delete;
 
   void setLogLevel(spdlog::level::level_enum level) noexcept;
+
+  /**
+   * @brief Writes log messages on a background thread instead of the calling one,
+   * disabled by default. Messages are queued up to a limit and written at least once
+   * per second, warnings and errors are written immediately.
+   */
+  void setAsyncLogging(bool enabled) noexcept;
+
+  /**
+   * @brief Returns if the manager is mounted, without waiting for a pending mount or
+   * unmount
+   */
   [[nodiscard]] bool isMounted() noexcept;
 
+  /**
+   * @brief Returns the current status, without waiting for pending operations. The
+   * status is never modified, later changes replace it.
+   */
+  [[nodiscard]] std::shared_ptr<const Status> status() const noexcept;
+
   /**
    * @brief Sets workdir and optionally creates it if it does not exist.
    * @param directory Workdir to use. Must be on the same file system as the upper dir.
@@ -62,6 +235,57 @@ public:
    */
   QStringList createOverlayFsDump() noexcept;
 
+  /**
+   * @brief Walks the overlay fs tree and passes its entries to the callback in chunks,
+   * so the whole tree never has to be held in memory.
+   * If nothing is mounted, the tree is computed by merging the listings of all source
+   * directories without mounting. The order of the entries is unspecified.
+   * The callback must not call back into the manager.
+   * @param callback Called for every chunk, returning false stops the dump
+   * @param chunkSize Maximum number of entries per chunk
+   * @return false if the dump failed or was stopped by the callback
+   */
+  bool createOverlayFsDump(const DumpCallback& callback,
+                           qsizetype chunkSize = 1024) noexcept;
+
+  /**
+   * @brief Returns the file backing the given path of the overlay fs tree.
+   * The tree is built from the source directories without mounting and kept until the
+   * mappings or the source directories change.
+   * @param virtualPath Absolute path inside of a mapped destination
+   * @return Path of the backing file, an empty string if the path does not exist or
+   * is generated during mounting
+   */
+  [[nodiscard]] QString resolve(const QString& virtualPath) noexcept;
+
+  /**
+   * @brief Lists the contents of a directory of the overlay fs tree without mounting
+   * @param virtualPath Absolute path of the directory
+   */
+  [[nodiscard]] std::vector<DirectoryEntry>
+  listDirectory(const QString& virtualPath) noexcept;
+
+  /**
+   * @brief Reports all files provided by more than one lower dir of a destination,
+   * using the same priorities as mounting. Computed from the source directories
+   * without mounting, unchanged source directories are not rescanned.
+   */
+  [[nodiscard]] std::vector<ConflictReport> createConflictReport() noexcept;
+
+  /**
+   * @brief Returns timings and counters of the last mount, the following unmount or
+   * the last dry run
+   */
+  [[nodiscard]] Statistics lastRunStatistics() noexcept;
+
+  /**
+   * @brief Records a timeline of mapping registration, source scans, mounts, started
+   * processes and unmounts, disabled if empty. The file is written in the Chrome trace
+   * event format after every mount and unmount and can be opened in Perfetto or
+   * chrome://tracing. It holds the events since the previous unmount.
+   */
+  void setTraceFile(const QString& file) noexcept;
+
   void setLogFile(const QString& file) noexcept;
 
   /**
@@ -104,11 +328,164 @@ public:
 
   void clearMappings() noexcept;
 
+  /**
+   * @brief Keeps whiteout files, symlinks and their parent directories in place
+   * between sessions instead of deleting them on unmount.
+   * The created artifacts are recorded in the given state file, the next mount only
+   * creates or deletes the difference to the recorded set.
+   * @param stateFile File used to store the artifact set, an empty string disables
+   * persistence
+   */
+  void setPersistentArtifacts(const QString& stateFile) noexcept;
+
+  /**
+   * @brief Deletes all artifacts recorded in the persistent artifact state file.
+   * Does nothing while mounted.
+   */
+  void clearPersistentArtifacts() noexcept;
+
+  /**
+   * @brief Sets where whiteout files for skipped files and directories are created,
+   * defaults to WhiteoutLocation::SkipLayer
+   */
+  void setWhiteoutLocation(WhiteoutLocation location) noexcept;
+
+  /**
+   * @brief Sets a directory to cache generated skip layers in, so they can be reused
+   * across sessions. Skip layers are created in a temporary directory if this is empty.
+   * @param directory Cache directory to use
+   * @param create Create the directory if it does not exist
+   */
+  void setSkipLayerCacheDir(const QString& directory, bool create = false) noexcept;
+
+  /**
+   * @brief Sets a directory to store the merged file tree in, so it can be loaded
+   * without scanning the source directories as long as none of them changed. The tree
+   * is rebuilt every session if this is empty.
+   * @param directory Cache directory to use
+   * @param create Create the directory if it does not exist
+   */
+  void setIndexCacheDir(const QString& directory, bool create = false) noexcept;
+
+  /**
+   * @brief Sets a directory to cache base layers in. The lowest priority lower dirs of
+   * a target that did not change since the previous session are merged into a single
+   * directory, which is mounted instead of them. Files are hardlinked or cloned, so the
+   * directory has to be on the same filesystem as the sources. Only fuse-overlayfs
+   * mounts use base layers, disabled if empty.
+   * @param directory Cache directory to use
+   * @param create Create the directory if it does not exist
+   */
+  void setBaseLayerCacheDir(const QString& directory, bool create = false) noexcept;
+
+  /**
+   * @brief Sets the filesystem used for mounting, defaults to Backend::FuseOverlayFs.
+   * The builtin backend answers lookups from the merged file tree instead of probing
+   * every lower dir and hides skipped files without creating whiteout files.
+   * @return false if the backend is not available or something is mounted
+   */
+  bool setBackend(Backend backend) noexcept;
+
+  /**
+   * @brief Checks if the given backend was enabled at build time
+   */
+  [[nodiscard]] static bool isBackendAvailable(Backend backend) noexcept;
+
+  /**
+   * @brief Serves all targets from a single merged file tree instead of one filesystem
+   * per target, disabled by default. Only the builtin backend supports this, every
+   * target is still a mount of its own because unprivileged processes cannot create
+   * bind mounts.
+   */
+  void setMountConsolidation(bool enabled) noexcept;
+
+  /**
+   * @brief Sets the maximum number of lower dirs of a single fuse-overlayfs mount,
+   * defaults to 256. Larger stacks are split into groups that are mounted read-only
+   * in temporary directories and used as lower dirs of the target. Whiteouts in lower
+   * dirs only hide files in the same group, the skip layer is never grouped.
+   * @param count Maximum number of lower dirs including the target and the skip layer,
+   * at least 3, or 0 for no limit
+   * @return false if the count is invalid
+   */
+  bool setMaxLowerDirs(int count) noexcept;
+
+  /**
+   * @brief Mounts targets with a single source, no upper dir and no skipped files
+   * without an overlay, disabled by default. Such a target that does not exist or is
+   * empty is a bind mount of its source if the process has CAP_SYS_ADMIN. Otherwise it
+   * is replaced by a symlink to the source, unless it is inside another target. All
+   * other targets are mounted as overlays, so files in the target stay visible.
+   * Changes to direct mounts are written to the source instead of the target.
+   */
+  void setDirectMounts(bool enabled) noexcept;
+
+  /**
+   * @brief Sets the programs run to mount and unmount with the fuse-overlayfs backend,
+   * defaults to fuse-overlayfs and fusermount. Programs without a path are searched in
+   * PATH.
+   */
+  void setOverlayFsPrograms(const QString& overlayFs,
+                            const QString& fusermount) noexcept;
+
+  /**
+   * @brief Sets how long to wait for fuse-overlayfs and fusermount to exit before a
+   * mount or unmount fails, defaults to 10 seconds
+   * @param timeout Time to wait, or 0 to wait indefinitely
+   */
+  void setProcessTimeout(std::chrono::milliseconds timeout) noexcept;
+
+  /**
+   * @brief Logs how the current mappings would be mounted, without mounting
+   */
   void dryrun() noexcept;
 
+  /**
+   * @brief Computes how the current mappings would be mounted with the current
+   * settings, without changing anything on disk or in the manager. Can be called on
+   * any thread, also while mounting or unmounting.
+   * @return The plan or nothing on error
+   */
+  [[nodiscard]] std::optional<MountPlan> createMountPlan() noexcept;
+
+  /**
+   * @brief Queues a mount on the worker thread of the manager and waits for it
+   */
   bool mount() noexcept;
+
+  /**
+   * @brief Queues a mount of the given plan on the worker thread of the manager and
+   * waits for it. The mappings are ignored, the plan is not checked against the source
+   * directories, see MountPlan::isCurrent().
+   */
+  bool mount(const MountPlan& plan) noexcept;
+
+  /**
+   * @brief Queues an unmount on the worker thread of the manager and waits for it
+   */
   bool umount() noexcept;
 
+  /**
+   * @brief Queues a mount on the worker thread of the manager, mounts and unmounts run
+   * in the order they were queued. A mount that is queued after another mount that did
+   * not start yet is merged with it, both use the mappings at the time it starts.
+   * @return Becomes ready with the result of the mount
+   */
+  [[nodiscard]] std::shared_future<bool> mountAsync() noexcept;
+
+  /**
+   * @brief Queues a mount of the given plan on the worker thread of the manager, see
+   * mountAsync(). Mounts of plans are never merged with other mounts.
+   * @return Becomes ready with the result of the mount
+   */
+  [[nodiscard]] std::shared_future<bool> mountAsync(MountPlan plan) noexcept;
+
+  /**
+   * @brief Queues an unmount on the worker thread of the manager, see mountAsync()
+   * @return Becomes ready with the result of the unmount
+   */
+  [[nodiscard]] std::shared_future<bool> umountAsync() noexcept;
+
   /**
    * @brief Creates and starts a new process after ensuring that the overlay filesystem
    * is properly mounted. Automatically unmounts the filesystem when the process
@@ -123,7 +500,7 @@ public:
   void setDebugMode(bool value) noexcept;
 
   /**
-   * @brief Retrieve a list of all processes that were started
+   * @brief Retrieve a list of all processes that were started and are still running
    */
   [[nodiscard]] std::vector<pid_t> getOverlayFsProcessList() const noexcept;
 
@@ -135,41 +512,354 @@ private:
   };
   using Map = std::vector<map_t>;
 
+  /**
+   * Layers mounted on a single target
+   */
+  struct layerStack_t
+  {
+    QString target;
+    QString upperDir;
+    // ordered from highest to lowest priority
+    QStringList lowerDirs;
+    // all sources with this target, including the upper dir
+    QStringList sources;
+    // skipped files and directories of all sources, relative to the target
+    QStringList whiteouts;
+    QStringList opaque;
+  };
+
+  /**
+   * Mappings and settings mounts are planned from, copied so they can change while
+   * planning and mounting
+   */
+  struct planInput_t
+  {
+    Map map;
+    Map fileMap;
+    QString upperDir;
+    QStringList fileSuffixBlacklist;
+    QStringList directoryBlacklist;
+    Backend backend   = Backend::FuseOverlayFs;
+    bool directMounts = false;
+  };
+
+  using DumpEntryCallback =
+      std::function<bool(QString path, DumpEntry::Type type, qint64 size)>;
+
   struct forceLoadLibrary_t
   {
     QString processName;
     QString libraryPath;
   };
 
+  enum class CommandType
+  {
+    Mount,
+    Umount
+  };
+
+  struct command_t
+  {
+    CommandType type;
+    // mounted instead of the mappings if set
+    std::optional<MountPlan> plan;
+    std::promise<bool> completion;
+    std::shared_future<bool> result;
+  };
+
+  using MountMethod = MountPlan::Method;
+
   struct overlayFsData_t
   {
+    MountMethod method = MountMethod::Overlay;
     QString target;
     QString upperDir;
     QTemporaryDir workDir;
     QStringList lowerDirs;
+    // all sources with this target, including the upper dir
+    QStringList sources;
     QStringList whiteout;
+    // skipped directories, hidden by marking them as opaque
+    QStringList opaque;
+    // layer holding the whiteout files, empty if they are created in the upper dir
+    QString skipLayer;
+    // cached layer replacing the lowest priority lower dirs, empty if there is none
+    QString baseLayer;
+    // shared locks on the cached layers, so other managers do not remove them
+    std::vector<std::shared_ptr<QFile>> layerLocks;
+    // lower dirs left out because they do not provide any visible files
+    QStringList prunedDirs;
+    // read-only mounts of lower dir groups, in the order they were mounted
+    QStringList intermediateMounts;
     bool mounted = false;
+    // set if an empty target directory was replaced by a symlink
+    bool replacedTarget = false;
     std::vector<QTemporaryDir> tmpDirs;
+    // filesystem serving this mount if the builtin backend is used
+    std::shared_ptr<FuseBackend> fuseBackend;
   };
 
-  explicit OverlayFsManager(QString file) noexcept;
-  ~OverlayFsManager() noexcept;
-
   void createLogger() noexcept;
-  [[nodiscard]] bool prepareMounts() noexcept;
+
+  /**
+   * @brief Applies m_loglevel to the sinks of the logger, the logger itself always lets
+   * errors through so they are recorded in the status
+   */
+  void applyLogLevel() noexcept;
+
+  /**
+   * @brief Queues a command for the worker thread, or returns the result of the last
+   * queued command if it is of the same type
+   */
+  [[nodiscard]] std::shared_future<bool>
+  enqueue(CommandType type, std::optional<MountPlan> plan = std::nullopt) noexcept;
+
+  /**
+   * @brief Runs queued commands until a stop is requested and the queue is empty
+   */
+  void processCommands(std::stop_token stop) noexcept;
+
+  /**
+   * @brief Writes all events recorded since the last unmount to the trace file, if
+   * tracing is enabled and any were recorded
+   */
+  void writeTrace() noexcept;
+
+  /**
+   * @brief Publishes the mount state of the targets in a new status, running processes
+   * are published by createProcess() and when they finish
+   */
+  void publishStatus() noexcept;
+
+  /**
+   * @brief Replaces the status with a modified copy, retrying if it was replaced
+   * concurrently
+   */
+  void updateStatus(const std::function<void(Status&)>& update) noexcept;
+
+  /**
+   * @brief Copies the current mappings and settings, m_dataMutex has to be locked
+   */
+  [[nodiscard]] planInput_t planInput() const;
+
+  /**
+   * @brief Computes the mount plan of the given mappings, scanning the source
+   * directories that changed
+   * @param statistics Receives the timings of the planning phases
+   */
+  [[nodiscard]] bool planMounts(const planInput_t& input, MountPlan& plan,
+                                Statistics& statistics) noexcept;
+
+  /**
+   * @brief Replaces the mounts by the targets of the given plan and creates their
+   * workdirs
+   */
+  void prepareMounts(const MountPlan& plan) noexcept;
+
+  /**
+   * @brief Returns the symlinks of all file mappings
+   */
+  [[nodiscard]] static std::vector<MountPlan::Symlink>
+  fileSymlinks(const planInput_t& input);
+
+  /**
+   * @brief Groups all directory mappings by their destination
+   */
+  [[nodiscard]] bool
+  createLayerStacks(const planInput_t& input,
+                    std::vector<layerStack_t>& stacks) const noexcept;
+
+  [[nodiscard]] static SkipRules skipRules(const planInput_t& input);
+  [[nodiscard]] static SkipRules skipRules(const MountPlan& plan);
+
+  /**
+   * @brief Collects the skipped files and directories of all sources of the given
+   * stack, the sources have to be scanned with the given rules
+   */
+  void addSkippedEntries(layerStack_t& stack, const SkipRules& rules) noexcept;
+
+  /**
+   * @brief Scans all source directories of the given stacks in parallel, unchanged
+   * directories are not rescanned
+   */
+  void scanLayers(const std::vector<layerStack_t>& stacks,
+                  const SkipRules& rules) noexcept;
+
+  /**
+   * @brief Returns all layers of the given stack including the skip layer for its
+   * skipped entries and the given symlinks inside of its target, ordered from highest
+   * to lowest priority
+   */
+  [[nodiscard]] std::vector<LayerSource>
+  layerSources(const layerStack_t& stack,
+               const std::vector<MountPlan::Symlink>& symlinks,
+               const SkipRules& rules) noexcept;
+
+  /**
+   * @brief Calls the callback with the merged file tree of all mappings, see
+   * updateFileTree(). The callback receives the tree built in memory or the mapped
+   * index it was loaded from, both provide the same lookup functions.
+   * @return false if there is no file tree
+   */
+  template <class Callback>
+  [[nodiscard]] bool withFileTree(Callback&& callback) noexcept;
+
+  /**
+   * @brief Rebuilds the merged file tree of all mappings if the mappings or any source
+   * directory changed, or opens a current index of it instead
+   * @return false on error
+   */
+  [[nodiscard]] bool updateFileTree() noexcept;
+
+  /**
+   * @brief Opens the index of the file tree from the index cache dir
+   * @return false if there is no current index for the given key
+   */
+  [[nodiscard]] bool openIndex(const std::vector<layerStack_t>& stacks,
+                               std::uint64_t key) noexcept;
+
+  /**
+   * @brief Returns a hash of everything the file tree of the given stacks depends on
+   * besides the contents of the source directories
+   */
+  [[nodiscard]] std::uint64_t indexKey(const std::vector<layerStack_t>& stacks,
+                                       const planInput_t& input) const;
+  [[nodiscard]] std::string indexPath(std::uint64_t key) const;
+
+  /**
+   * @brief Removes the least recently used indices from the index cache directory
+   */
+  void trimIndexCache() noexcept;
+
+  [[nodiscard]] bool dumpMounted(const DumpEntryCallback& addEntry) noexcept;
+  [[nodiscard]] bool dumpOffline(const DumpEntryCallback& addEntry) noexcept;
   [[nodiscard]] bool createSymlinks() noexcept;
 
+  /**
+   * @brief Removes a created symlink and restores the file it replaced
+   */
+  bool removeSymlink(const QString& file) noexcept;
+
+  /**
+   * @brief Creates whiteout files for all mounts, whiteouts recorded in a previous
+   * session are reused and stale ones are deleted
+   */
+  [[nodiscard]] bool createWhiteouts() noexcept;
+
+  /**
+   * @brief Deletes whiteout files recorded in the previous session that were not
+   * reused, and directories that became empty
+   */
+  void removeRecordedWhiteouts() noexcept;
+
+  /**
+   * @brief Creates a layer holding whiteout files for the given mount, or reuses a
+   * cached one, and stacks it above all lower dirs
+   */
+  [[nodiscard]] bool createSkipLayer(overlayFsData_t& mount) noexcept;
+
+  /**
+   * @brief Removes the least recently used skip layers and base layers from their
+   * caches, except for the layers of the current mounts
+   */
+  void trimLayerCaches() noexcept;
+
   /**
    * @brief Deletes all whiteout files
    */
   void cleanup() noexcept;
 
-  // mount functions without locks for internal use
-  [[nodiscard]] bool mountInternal();
+  /**
+   * @brief Deletes all created artifacts or, if persistent artifacts are enabled,
+   * writes them to the state file and forgets about them
+   */
+  void releaseArtifacts() noexcept;
+
+  [[nodiscard]] bool loadArtifactState() noexcept;
+  [[nodiscard]] bool saveArtifactState() noexcept;
+
+  // mount functions without locks for internal use, the mappings are planned and
+  // mounted if there is no plan
+  [[nodiscard]] bool mountInternal(const MountPlan* plan = nullptr);
   [[nodiscard]] bool umountInternal();
 
+  /**
+   * @brief Creates the artifacts of the prepared mounts and mounts all targets
+   * @return false on error, the mounts and artifacts are left as they are
+   */
+  [[nodiscard]] bool createMounts(Backend backend) noexcept;
+
+  /**
+   * @brief Unmounts all targets of a failed mount and removes its artifacts, so the
+   * next mount starts from scratch
+   */
+  void rollbackMounts() noexcept;
+
+  /**
+   * @brief Mounts a single target using fuse-overlayfs
+   */
+  [[nodiscard]] bool mountOverlayFs(overlayFsData_t& mount) noexcept;
+
+  /**
+   * @brief Replaces groups of lower dirs by read-only mounts of these groups until
+   * the number of lower dirs is within m_maxLowerDirs
+   * @param lowerDirs Lower dirs of the mount without the skip layer and the target
+   */
+  [[nodiscard]] bool stackLowerDirs(overlayFsData_t& mount,
+                                    QStringList& lowerDirs) noexcept;
+
+  /**
+   * @brief Replaces the lowest priority lower dirs that did not change since the
+   * previous session by a cached base layer, creating it if needed. The lower dirs are
+   * kept if the base layer cannot be created.
+   * @param lowerDirs Lower dirs of the mount without the skip layer and the target
+   */
+  void useBaseLayer(overlayFsData_t& mount, QStringList& lowerDirs) noexcept;
+
+  /**
+   * @brief Runs fuse-overlayfs with the given arguments and logs its output
+   */
+  [[nodiscard]] bool runOverlayFs(const QStringList& args) noexcept;
+
+  /**
+   * @brief Runs fusermount to unmount a fuse-overlayfs mount
+   */
+  [[nodiscard]] bool runFusermount(const QString& target) noexcept;
+
+  /**
+   * @brief Returns the process timeout in the form QProcess expects it
+   */
+  [[nodiscard]] int processTimeout() const noexcept;
+
+  /**
+   * @brief Unmounts the intermediate mounts of a target, the target must not be
+   * mounted anymore
+   */
+  void umountIntermediate(overlayFsData_t& mount) noexcept;
+
+  /**
+   * @brief Chooses how the given target is mounted, see setDirectMounts()
+   */
+  [[nodiscard]] MountMethod mountMethod(const MountPlan::Target& mount,
+                                        const QStringList& targets,
+                                        const planInput_t& input) const;
+
+  // mount functions for bind mounts and symlinks
+  [[nodiscard]] bool mountDirect(overlayFsData_t& mount) noexcept;
+  [[nodiscard]] bool umountDirect(overlayFsData_t& mount) noexcept;
+
+  // mount functions of the builtin backend, all targets are mounted at once
+  [[nodiscard]] bool mountBuiltin() noexcept;
+  [[nodiscard]] bool umountBuiltin(overlayFsData_t& mount) noexcept;
+
   [[nodiscard]] bool isAnythingMounted() const noexcept;
 
+  /**
+   * @brief Returns the paths of the opaque markers for all skipped directories of the
+   * given mount, relative to the upper dir or skip layer
+   */
+  [[nodiscard]] static QStringList opaqueMarkers(const overlayFsData_t& mount);
+
   /**
    * @brief Creates the specified directory including parent directories and store all
    * created directories in m_createdDirectories
@@ -186,13 +876,80 @@ private:
   QStringList m_createdWhiteoutFiles;
   QStringList m_createdDirectories;
   QStringList m_createdSymlinks;
+  /** File storing the artifacts of the previous session, empty if disabled */
+  QString m_artifactStateFile;
+  /** Artifacts recorded in m_artifactStateFile that have not been reused yet */
+  QSet<QString> m_recordedWhiteoutFiles;
+  QSet<QString> m_recordedSymlinks;
+  Backend m_backend                   = Backend::FuseOverlayFs;
+  bool m_consolidateMounts            = false;
+  bool m_directMounts                 = false;
+  /** Maximum number of lower dirs of a single fuse-overlayfs mount, 0 for no limit */
+  int m_maxLowerDirs = 256;
+  WhiteoutLocation m_whiteoutLocation = WhiteoutLocation::SkipLayer;
+  /** Directory to cache skip layers in, temporary directories are used if empty */
+  QString m_skipLayerCacheDir;
+  /** Directory to store file tree indices in, disabled if empty */
+  QString m_indexCacheDir;
+  /** Directory to cache base layers in, disabled if empty */
+  QString m_baseLayerCacheDir;
+  /** Programs run to mount and unmount with the fuse-overlayfs backend */
+  QString m_overlayFsProgram  = QStringLiteral("fuse-overlayfs");
+  QString m_fusermountProgram = QStringLiteral("fusermount");
+  std::chrono::milliseconds m_processTimeout{10'000};
+  /** Processes started by createProcess() that did not finish yet */
   std::vector<std::unique_ptr<QProcess>> m_startedProcesses;
   std::vector<overlayFsData_t> m_mounts;
+  /** Symlinks of the current mount */
+  std::vector<MountPlan::Symlink> m_symlinks;
+  /** Plan of the current mount, created from the mappings unless one was given */
+  MountPlan m_mountPlan;
+  /** Listings of all source directories, shared between mounts and dumps */
+  std::unique_ptr<LayerCache> m_layerCache;
+  /** File tree built in memory, null if lookups are answered by m_treeIndex */
+  std::unique_ptr<VirtualFileTree> m_virtualFileTree;
+  /** Index the file tree was loaded from or written to */
+  std::unique_ptr<MergedIndex> m_treeIndex;
+  /** Targets and scanned listings the file tree was built from */
+  QStringList m_treeTargets;
+  std::vector<std::shared_ptr<const LayerListing>> m_treeListings;
+  /** Set when the mappings changed since the file tree was built */
+  bool m_treeOutdated = true;
+  /** Read without locking, must outlive the logger that records errors in it */
+  std::atomic<std::shared_ptr<const Status>> m_status{std::make_shared<const Status>()};
+  /** Processes the messages of the asynchronous logger, must outlive it */
+  std::shared_ptr<spdlog::details::thread_pool> m_logThreadPool;
   std::shared_ptr<spdlog::logger> m_logger;
+  /** Sink of m_logger that records errors in m_status */
+  spdlog::sink_ptr m_errorSink;
+  std::unique_ptr<spdlog::details::periodic_worker> m_logFlusher;
+  bool m_asyncLogging = false;
+  /** Statistics of the running or last mount, written by the worker thread */
+  Statistics m_statistics;
+  /** Copy of m_statistics published after every mount and unmount */
+  Statistics m_lastRunStatistics;
+  /** Records events for m_traceFile, shared with the handlers of started processes */
+  std::shared_ptr<Tracer> m_tracer;
+  QString m_traceFile;
   QString m_logFile;
   bool m_mounted = false;
+  /**
+   * Held by the worker thread for a whole mount or unmount. Guards the mounts and their
+   * artifacts, settings read while mounting are changed with both mutexes locked.
+   */
   std::mutex m_mountMutex;
+  /** Guards the mappings and settings, only held briefly while mounting */
   std::mutex m_dataMutex;
+  /**
+   * Held shared while planning without the other mutexes, and exclusively while
+   * m_logger or m_tracer are replaced
+   */
+  std::shared_mutex m_loggingMutex;
+  /** Mounts and unmounts waiting for the worker thread */
+  std::deque<command_t> m_commands;
+  std::mutex m_queueMutex;
+  std::condition_variable_any m_queueCondition;
+  std::jthread m_worker;
   /** Enable debugging mode, can be very noisy. */
   bool m_debuggingMode = false;
   /**
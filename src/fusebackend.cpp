@@ -0,0 +1,1384 @@
+#define FUSE_USE_VERSION 312
+
+#include "fusebackend.h"
+
+#include <fuse_lowlevel.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <mutex>
+#include <spawn.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+// kernel cache timeout for attributes and entries in seconds, all changes go through
+// this filesystem so the kernel is always told about them
+static inline constexpr double cacheTimeout = 60.0;
+
+// file marking a directory as opaque
+static inline constexpr string_view opaqueMarker = ".wh..wh..opq";
+
+// prefix of files that are used as whiteouts if no character device can be created
+static inline constexpr string_view whiteoutPrefix = ".wh.";
+
+// suffix of temporary files created while copying files to the upper dir
+static inline constexpr string_view copyUpSuffix = ".mo-copyup";
+
+static string joinPath(const string& parent, string_view name)
+{
+  if (parent.empty()) {
+    return string(name);
+  }
+  string result;
+  result.reserve(parent.size() + 1 + name.size());
+  result += parent;
+  result += '/';
+  result += name;
+  return result;
+}
+
+// *at() functions expect "." instead of an empty path for the directory itself
+static const char* relative(const string& path)
+{
+  return path.empty() ? "." : path.c_str();
+}
+
+// returns the file handle if it refers to the file at path in the upper dir, or -1.
+// Handles opened before the file was copied up still refer to the lower dir.
+static int upperHandle(int handle, int upperFd, const string& path, bool writable)
+{
+  struct stat handleStat{};
+  struct stat upperStat{};
+  if (fstat(handle, &handleStat) != 0 ||
+      fstatat(upperFd, relative(path), &upperStat, AT_SYMLINK_NOFOLLOW) != 0 ||
+      handleStat.st_dev != upperStat.st_dev || handleStat.st_ino != upperStat.st_ino) {
+    return -1;
+  }
+  if (writable && (fcntl(handle, F_GETFL) & O_ACCMODE) == O_RDONLY) {
+    return -1;
+  }
+  return handle;
+}
+
+// checks if path is the given directory or inside of it
+static bool isWithin(string_view path, string_view directory)
+{
+  return path.starts_with(directory) &&
+         (path.size() == directory.size() || path[directory.size()] == '/');
+}
+
+static bool isWhiteout(const struct stat& st)
+{
+  return S_ISCHR(st.st_mode) && st.st_rdev == makedev(0, 0);
+}
+
+static bool isDirectory(const VirtualFileTree::Node& node)
+{
+  return node.type == LayerListing::EntryType::Directory;
+}
+
+static mode_t fileType(LayerListing::EntryType type)
+{
+  switch (type) {
+  case LayerListing::EntryType::File:
+    return S_IFREG;
+  case LayerListing::EntryType::Directory:
+    return S_IFDIR;
+  case LayerListing::EntryType::Symlink:
+    return S_IFLNK;
+  default:
+    // unknown, the kernel asks for it if needed
+    return 0;
+  }
+}
+
+// copies size bytes from source to destination, starting at their current offsets
+static int copyData(int source, int destination, off_t size)
+{
+  vector<char> buffer;
+
+  while (size > 0) {
+    ssize_t copied = copy_file_range(source, nullptr, destination, nullptr,
+                                     static_cast<size_t>(size), 0);
+    if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                       errno == EOPNOTSUPP)) {
+      // not supported between these filesystems
+      buffer.resize(64 * 1024);
+      copied = read(source, buffer.data(), buffer.size());
+      if (copied > 0 &&
+          write(destination, buffer.data(), static_cast<size_t>(copied)) != copied) {
+        return errno != 0 ? errno : EIO;
+      }
+    }
+    if (copied < 0) {
+      return errno;
+    }
+    if (copied == 0) {
+      // the file got shorter while copying
+      break;
+    }
+    size -= copied;
+  }
+
+  return 0;
+}
+
+// buffer flags for reading from and writing to a file descriptor at a position
+static inline constexpr auto fdBufferFlags =
+    static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+
+/**
+ * Directory contents at the time the directory was opened, so offsets stay valid while
+ * it is modified
+ */
+struct directoryHandle_t
+{
+  vector<pair<string, VirtualFileTree::NodeId>> entries;
+};
+
+struct FuseBackend::Operations
+{
+  static FuseBackend& backend(fuse_req_t req)
+  {
+    return *static_cast<FuseBackend*>(fuse_req_userdata(req));
+  }
+
+  static void replyEntry(fuse_req_t req, const FuseBackend& self, NodeId id)
+  {
+    fuse_entry_param entry{};
+    if (const int error = self.statNode(id, entry.attr)) {
+      fuse_reply_err(req, error);
+      return;
+    }
+    entry.ino           = entry.attr.st_ino;
+    entry.attr_timeout  = cacheTimeout;
+    entry.entry_timeout = cacheTimeout;
+    fuse_reply_entry(req, &entry);
+  }
+
+  static void init(void* userdata, fuse_conn_info* conn)
+  {
+    // let the kernel move file data with splice instead of copying it
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+      conn->want |= FUSE_CAP_SPLICE_WRITE;
+    }
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE) {
+      conn->want |= FUSE_CAP_SPLICE_MOVE;
+    }
+
+#ifdef FUSE_CAP_PASSTHROUGH
+    // reads and writes bypass this process entirely
+    if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+      conn->want |= FUSE_CAP_PASSTHROUGH;
+      static_cast<FuseBackend*>(userdata)->m_passthrough = true;
+    }
+#else
+    (void)userdata;
+#endif
+  }
+
+  /**
+   * @brief Hands the backing file of an opened regular file to the kernel, falls back
+   * to serving reads and writes if that is not possible
+   */
+  static void openPassthrough(fuse_req_t req, FuseBackend& self, NodeId id,
+                              fuse_file_info* fi)
+  {
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (!self.m_passthrough) {
+      return;
+    }
+
+    const int fd = static_cast<int>(fi->fh);
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      return;
+    }
+
+    scoped_lock lock(self.m_passthroughMutex);
+
+    const auto it = self.m_passthroughFiles.find(id);
+    if (it != self.m_passthroughFiles.end()) {
+      passthrough_t& file = it->second;
+      if (file.device == st.st_dev && file.inode == st.st_ino) {
+        ++file.openCount;
+        fi->backing_id = file.backingId;
+        fi->keep_cache = 0;
+      } else {
+        // the file was copied to the upper dir while the lower file is passed
+        // through, the kernel only allows uncached access next to passthrough
+        fi->direct_io = 1;
+      }
+      return;
+    }
+
+    const int backingId = fuse_passthrough_open(req, fd);
+    if (backingId <= 0) {
+      // not permitted without CAP_SYS_ADMIN, no need to try again
+      if (errno == EPERM) {
+        self.m_passthrough = false;
+      }
+      return;
+    }
+
+    self.m_passthroughFiles.emplace(id,
+                                    passthrough_t{backingId, st.st_dev, st.st_ino, 1});
+    fi->backing_id = backingId;
+    fi->keep_cache = 0;
+#else
+    (void)req;
+    (void)self;
+    (void)id;
+    (void)fi;
+#endif
+  }
+
+  static void releasePassthrough(fuse_req_t req, FuseBackend& self, NodeId id,
+                                 const fuse_file_info* fi)
+  {
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (fi->backing_id <= 0) {
+      return;
+    }
+
+    scoped_lock lock(self.m_passthroughMutex);
+
+    const auto it = self.m_passthroughFiles.find(id);
+    if (it != self.m_passthroughFiles.end() && --it->second.openCount == 0) {
+      fuse_passthrough_close(req, it->second.backingId);
+      self.m_passthroughFiles.erase(it);
+    }
+#else
+    (void)req;
+    (void)self;
+    (void)id;
+    (void)fi;
+#endif
+  }
+
+  static void lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+  {
+    auto& self = backend(req);
+    shared_lock lock(self.m_treeMutex);
+
+    const NodeId id = self.m_tree->child(self.toNode(parent), name);
+    if (id == VirtualFileTree::invalidNode) {
+      // missing entries are cached as well
+      fuse_entry_param entry{};
+      entry.entry_timeout = cacheTimeout;
+      fuse_reply_entry(req, &entry);
+      return;
+    }
+    replyEntry(req, self, id);
+  }
+
+  static void getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info*)
+  {
+    auto& self = backend(req);
+    shared_lock lock(self.m_treeMutex);
+
+    struct stat st{};
+    if (const int error = self.statNode(self.toNode(ino), st)) {
+      fuse_reply_err(req, error);
+      return;
+    }
+    fuse_reply_attr(req, &st, cacheTimeout);
+  }
+
+  static void setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int toSet,
+                      fuse_file_info* fi)
+  {
+    auto& self = backend(req);
+    unique_lock lock(self.m_treeMutex);
+
+    const NodeId id   = self.toNode(ino);
+    int error         = self.copyUp(id);
+    const string path = self.targetPath(id);
+    const int fd      = self.m_upperFd;
+
+    // handles of directories are not file descriptors
+    const bool hasHandle =
+        fi != nullptr && self.m_tree->node(id).type == LayerListing::EntryType::File;
+
+    if (error == 0 && (toSet & FUSE_SET_ATTR_MODE)) {
+      const int handle =
+          hasHandle ? upperHandle(static_cast<int>(fi->fh), fd, path, false) : -1;
+      const int result = handle >= 0 ? fchmod(handle, attr->st_mode)
+                                     : fchmodat(fd, relative(path), attr->st_mode, 0);
+      error = result != 0 ? errno : 0;
+    }
+
+    if (error == 0 && (toSet & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+      const uid_t uid =
+          toSet & FUSE_SET_ATTR_UID ? attr->st_uid : static_cast<uid_t>(-1);
+      const gid_t gid =
+          toSet & FUSE_SET_ATTR_GID ? attr->st_gid : static_cast<gid_t>(-1);
+      if (fchownat(fd, relative(path), uid, gid, AT_SYMLINK_NOFOLLOW) != 0) {
+        error = errno;
+      }
+    }
+
+    if (error == 0 && (toSet & FUSE_SET_ATTR_SIZE)) {
+      const int handle =
+          hasHandle ? upperHandle(static_cast<int>(fi->fh), fd, path, true) : -1;
+      if (handle >= 0) {
+        error = ftruncate(handle, attr->st_size) != 0 ? errno : 0;
+      } else {
+        const int file = openat(fd, relative(path), O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (file < 0 || ftruncate(file, attr->st_size) != 0) {
+          error = errno;
+        }
+        if (file >= 0) {
+          close(file);
+        }
+      }
+    }
+
+    if (error == 0 &&
+        (toSet & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME |
+                  FUSE_SET_ATTR_MTIME_NOW))) {
+      timespec times[2] = {{0, UTIME_OMIT}, {0, UTIME_OMIT}};
+      if (toSet & FUSE_SET_ATTR_ATIME_NOW) {
+        times[0].tv_nsec = UTIME_NOW;
+      } else if (toSet & FUSE_SET_ATTR_ATIME) {
+        times[0] = attr->st_atim;
+      }
+      if (toSet & FUSE_SET_ATTR_MTIME_NOW) {
+        times[1].tv_nsec = UTIME_NOW;
+      } else if (toSet & FUSE_SET_ATTR_MTIME) {
+        times[1] = attr->st_mtim;
+      }
+      if (utimensat(fd, relative(path), times, AT_SYMLINK_NOFOLLOW) != 0) {
+        error = errno;
+      }
+    }
+
+    struct stat st{};
+    if (error == 0) {
+      error = self.statNode(id, st);
+    }
+    if (error != 0) {
+      fuse_reply_err(req, error);
+      return;
+    }
+    fuse_reply_attr(req, &st, cacheTimeout);
+  }
+
+  static void readlink(fuse_req_t req, fuse_ino_t ino)
+  {
+    auto& self = backend(req);
+    shared_lock lock(self.m_treeMutex);
+
+    string target;
+    if (const int error = self.readLink(self.toNode(ino), target)) {
+      fuse_reply_err(req, error);
+      return;
+    }
+    fuse_reply_readlink(req, target.c_str());
+  }
+
+  static void mknod(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode,
+                    dev_t rdev)
+  {
+    auto& self = backend(req);
+    unique_lock lock(self.m_treeMutex);
+
+    const NodeId parentId = self.toNode(parent);
+    string path;
+    bool replacedWhiteout = false;
+    if (const int error = self.prepareEntry(parentId, name, path, replacedWhiteout)) {
+      fuse_reply_err(req, error);
+      return;
+    }
+    if (mknodat(self.m_upperFd, path.c_str(), mode, rdev) != 0) {
+      fuse_reply_err(req, errno);
+      return;
+    }
+
+    const auto type =
+        S_ISREG(mode) ? LayerListing::EntryType::File : LayerListing::EntryType::Other;
+    replyEntry(req, self,
+               self.m_tree->insert(parentId, name, type, 0, self.m_upperLayer));
+  }
+
+  static void mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode)
+  {
+    auto& self = backend(req);
+    unique_lock lock(self.m_treeMutex);
+
+    const NodeId parentId = self.toNode(parent);
+    string path;
+    bool replacedWhiteout = false;
+    if (const int error = self.prepareEntry(parentId, name, path, replacedWhiteout)) {
+      fuse_reply_err(req, error);
+      return;
+    }
+    if (mkdirat(self.m_upperFd, path.c_str(), mode) != 0) {
+      fuse_reply_err(req, errno);
+      return;
+    }
+
+    // a lower directory with the same name was deleted, its contents must stay hidden
+    if (replacedWhiteout || self.existsInLowerLayers(path)) {
+      const string marker = joinPath(path, opaqueMarker);
+      const int fd        = openat(self.m_upperFd, marker.c_str(),
+                                   O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+
+    replyEntry(req, self,
+               self.m_tree->insert(parentId, name, LayerListing::EntryType::Directory,
+                                   0, self.m_upperLayer));
+  }
+
+  static void unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+  {
+    remove(req, parent, name, false);
+  }
+
+  static void rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+  {
+    remove(req, parent, name, true);
+  }
+
+  static void remove(fuse_req_t req, fuse_ino_t parent, const char* name,
+                     bool directory)
+  {
+    auto& self = backend(req);
+    unique_lock lock(self.m_treeMutex);
+
+    const NodeId parentId = self.toNode(parent);
+    const NodeId id       = self.m_tree->child(parentId, name);
+    if (id == VirtualFileTree::invalidNode) {
+      fuse_reply_err(req, ENOENT);
+      return;
+    }
+
+    const VirtualFileTree::Node& node = self.m_tree->node(id);
+    if (isDirectory(node) != directory) {
+      fuse_reply_err(req, directory ? ENOTDIR : EISDIR);
+      return;
+    }
+    if (directory && node.firstChild != VirtualFileTree::invalidNode) {
+      fuse_reply_err(req, ENOTEMPTY);
+      return;
+    }
+
+    const string path = self.targetPath(id);
+    int error         = 0;
+    if (node.layer == self.m_upperLayer) {
+      if (directory) {
+        error = self.removeUpperDirectory(path);
+      } else if (unlinkat(self.m_upperFd, path.c_str(), 0) != 0) {
+        error = errno;
+      }
+    }
+
+    if (error == 0 && self.existsInLowerLayers(path)) {
+      error = self.copyUp(parentId);
+      if (error == 0) {
+        error = self.createWhiteout(path);
+      }
+    }
+
+    if (error != 0) {
+      fuse_reply_err(req, error);
+      return;
+    }
+
+    self.m_tree->remove(id);
+    fuse_reply_err(req, 0);
+  }
+
+  static void symlink(fuse_req_t req, const char* link, fuse_ino_t parent,
+                      const char* name)
+  {
+    auto& self = backend(req);
+    unique_lock lock(self.m_treeMutex);
+
+    const NodeId parentId = self.toNode(parent);
+    string path;
+    bool replacedWhiteout = false;
+    if (const int error = self.prepareEntry(parentId, name, path, replacedWhiteout)) {
+      fuse_reply_err(req, error);
+      return;
+    }
+    if (symlinkat(link, self.m_upperFd, path.c_str()) != 0) {
+      fuse_reply_err(req, errno);
+      return;
+    }
+
+    replyEntry(req, self,
+               self.m_tree->insert(parentId, name, LayerListing::EntryType::Symlink, 0,
+                                   self.m_upperLayer));
+  }
+
+  static void rename(fuse_req_t req, fuse_ino_t parent, const char* name,
+                     fuse_ino_t newParent, const char* newName, unsigned int flags)
+  {
+    // exchanging entries is not supported
+    if ((flags & ~RENAME_NOREPLACE) != 0) {
+      fuse_reply_err(req, EINVAL);
+      return;
+    }
+
+    auto& self = backend(req);
+    unique_lock lock(self.m_treeMutex);
+
+    const NodeId parentId    = self.toNode(parent);
+    const NodeId newParentId = self.toNode(newParent);
+    const NodeId source      = self.m_tree->child(parentId, name);
+    const NodeId destination = self.m_tree->child(newParentId, newName);
+
+    if (source == VirtualFileTree::invalidNode) {
+      fuse_reply_err(req, ENOENT);
+      return;
+    }
+    if (source == destination) {
+      fuse_reply_err(req, 0);
+      return;
+    }
+
+    const bool directory = isDirectory(self.m_tree->node(source));
+    if (destination != VirtualFileTree::invalidNode) {
+      const VirtualFileTree::Node& node = self.m_tree->node(destination);
+      if (flags & RENAME_NOREPLACE) {
+        fuse_reply_err(req, EEXIST);
+        return;
+      }
+      if (isDirectory(node) != directory) {
+        fuse_reply_err(req, directory ? ENOTDIR : EISDIR);
+        return;
+      }
+      if (node.firstChild != VirtualFileTree::invalidNode) {
+        fuse_reply_err(req, ENOTEMPTY);
+        return;
+      }
+    }
+
+    const string sourcePath = self.targetPath(source);
+
+    // like overlayfs without redirects, only directories that exist in the upper dir
+    // alone can be renamed, applications fall back to copying on EXDEV
+    if (directory) {
+      bool upperOnly = !self.existsInLowerLayers(sourcePath);
+      self.m_tree->walk(source, [&](NodeId id, const string&) {
+        upperOnly = upperOnly && self.m_tree->node(id).layer == self.m_upperLayer;
+        return upperOnly;
+      });
+      if (!upperOnly || self.m_tree->node(source).layer != self.m_upperLayer) {
+        fuse_reply_err(req, EXDEV);
+        return;
+      }
+    }
+
+    int error = self.copyUp(source);
+    if (error == 0) {
+      error = self.copyUp(newParentId);
+    }
+
+    const string destinationPath = joinPath(self.targetPath(newParentId), newName);
+    if (error == 0 && destination != VirtualFileTree::invalidNode && directory &&
+        self.m_tree->node(destination).layer == self.m_upperLayer) {
+      error = self.removeUpperDirectory(destinationPath);
+    }
+
+    if (error == 0) {
+      self.removeWhiteout(destinationPath);
+      if (renameat(self.m_upperFd, sourcePath.c_str(), self.m_upperFd,
+                   destinationPath.c_str()) != 0) {
+        error = errno;
+      }
+    }
+
+    if (error != 0) {
+      fuse_reply_err(req, error);
+      return;
+    }
+
+    // the rename already happened, failing to hide the lower entries only affects the
+    // following sessions
+    if (self.existsInLowerLayers(sourcePath)) {
+      (void)self.createWhiteout(sourcePath);
+    }
+    if (directory && self.existsInLowerLayers(destinationPath)) {
+      const string marker = joinPath(destinationPath, opaqueMarker);
+      const int fd        = openat(self.m_upperFd, marker.c_str(),
+                                   O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+
+    if (destination != VirtualFileTree::invalidNode) {
+      self.m_tree->remove(destination);
+    }
+    self.m_tree->move(source, newParentId, newName);
+    fuse_reply_err(req, 0);
+  }
+
+  static void open(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+  {
+    auto& self       = backend(req);
+    const NodeId id  = self.toNode(ino);
+    const int flags  = fi->flags & ~(O_CREAT | O_EXCL | O_NOCTTY);
+    const bool write = (flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC) != 0;
+
+    int fd    = -1;
+    int error = 0;
+    if (write) {
+      unique_lock lock(self.m_treeMutex);
+      error = self.copyUp(id);
+      if (error == 0) {
+        error = self.openNode(id, flags, fd);
+      }
+    } else {
+      shared_lock lock(self.m_treeMutex);
+      error = self.openNode(id, flags, fd);
+    }
+
+    if (error != 0) {
+      fuse_reply_err(req, error);
+      return;
+    }
+
+    fi->fh = static_cast<uint64_t>(fd);
+    // files are only changed through this filesystem, so cached data stays valid
+    fi->keep_cache = 1;
+    openPassthrough(req, self, id, fi);
+    fuse_reply_open(req, fi);
+  }
+
+  static void create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode,
+                     fuse_file_info* fi)
+  {
+    auto& self = backend(req);
+    unique_lock lock(self.m_treeMutex);
+
+    const NodeId parentId = self.toNode(parent);
+    string path;
+    bool replacedWhiteout = false;
+    if (const int error = self.prepareEntry(parentId, name, path, replacedWhiteout)) {
+      fuse_reply_err(req, error);
+      return;
+    }
+
+    const int flags = (fi->flags & ~O_NOCTTY) | O_CREAT | O_NOFOLLOW | O_CLOEXEC;
+    const int fd    = openat(self.m_upperFd, path.c_str(), flags, mode);
+    if (fd < 0) {
+      fuse_reply_err(req, errno);
+      return;
+    }
+
+    const NodeId id = self.m_tree->insert(parentId, name, LayerListing::EntryType::File,
+                                          0, self.m_upperLayer);
+
+    fuse_entry_param entry{};
+    if (const int error = self.statNode(id, entry.attr)) {
+      close(fd);
+      fuse_reply_err(req, error);
+      return;
+    }
+    entry.ino           = entry.attr.st_ino;
+    entry.attr_timeout  = cacheTimeout;
+    entry.entry_timeout = cacheTimeout;
+
+    fi->fh         = static_cast<uint64_t>(fd);
+    fi->keep_cache = 1;
+    openPassthrough(req, self, id, fi);
+    fuse_reply_create(req, &entry, fi);
+  }
+
+  static void read(fuse_req_t req, fuse_ino_t, size_t size, off_t offset,
+                   fuse_file_info* fi)
+  {
+    // the data is spliced from the backing file if possible
+    fuse_bufvec buffer{};
+    buffer.count        = 1;
+    buffer.buf[0].size  = size;
+    buffer.buf[0].flags = fdBufferFlags;
+    buffer.buf[0].fd    = static_cast<int>(fi->fh);
+    buffer.buf[0].pos   = offset;
+    fuse_reply_data(req, &buffer, FUSE_BUF_SPLICE_MOVE);
+  }
+
+  static void writeBuf(fuse_req_t req, fuse_ino_t, fuse_bufvec* in, off_t offset,
+                       fuse_file_info* fi)
+  {
+    fuse_bufvec out{};
+    out.count        = 1;
+    out.buf[0].size  = fuse_buf_size(in);
+    out.buf[0].flags = fdBufferFlags;
+    out.buf[0].fd    = static_cast<int>(fi->fh);
+    out.buf[0].pos   = offset;
+
+    const ssize_t written =
+        fuse_buf_copy(&out, in, static_cast<fuse_buf_copy_flags>(0));
+    if (written < 0) {
+      fuse_reply_err(req, static_cast<int>(-written));
+      return;
+    }
+    fuse_reply_write(req, static_cast<size_t>(written));
+  }
+
+  static void flush(fuse_req_t req, fuse_ino_t, fuse_file_info* fi)
+  {
+    // closing a duplicate reports errors of delayed writes like close() would
+    const int fd = dup(static_cast<int>(fi->fh));
+    fuse_reply_err(req, fd < 0 || close(fd) != 0 ? errno : 0);
+  }
+
+  static void release(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+  {
+    auto& self = backend(req);
+    releasePassthrough(req, self, self.toNode(ino), fi);
+    close(static_cast<int>(fi->fh));
+    fuse_reply_err(req, 0);
+  }
+
+  static void fsync(fuse_req_t req, fuse_ino_t, int datasync, fuse_file_info* fi)
+  {
+    const int fd     = static_cast<int>(fi->fh);
+    const int result = datasync != 0 ? fdatasync(fd) : ::fsync(fd);
+    fuse_reply_err(req, result != 0 ? errno : 0);
+  }
+
+  static void opendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+  {
+    auto& self  = backend(req);
+    auto handle = make_unique<directoryHandle_t>();
+
+    {
+      shared_lock lock(self.m_treeMutex);
+
+      const NodeId id = self.toNode(ino);
+      if (!isDirectory(self.m_tree->node(id))) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+      }
+
+      const NodeId parent = id == self.m_targetNode ? id : self.m_tree->node(id).parent;
+      handle->entries.emplace_back(".", id);
+      handle->entries.emplace_back("..", parent);
+      self.m_tree->forEachChild(id, [&](NodeId child) {
+        handle->entries.emplace_back(string(self.m_tree->name(child)), child);
+        return true;
+      });
+    }
+
+    fi->fh            = reinterpret_cast<uint64_t>(handle.release());
+    fi->keep_cache    = 1;
+    fi->cache_readdir = 1;
+    fuse_reply_open(req, fi);
+  }
+
+  static void readdir(fuse_req_t req, size_t size, off_t offset, fuse_file_info* fi,
+                      bool plus)
+  {
+    auto& self         = backend(req);
+    const auto* handle = reinterpret_cast<const directoryHandle_t*>(fi->fh);
+
+    vector<char> buffer(size);
+    size_t used = 0;
+
+    shared_lock lock(self.m_treeMutex);
+    for (size_t i = static_cast<size_t>(offset); i < handle->entries.size(); ++i) {
+      const auto& [name, id] = handle->entries[i];
+      const auto next        = static_cast<off_t>(i + 1);
+      char* entryBuffer      = buffer.data() + used;
+      size_t entrySize       = 0;
+
+      if (plus) {
+        fuse_entry_param entry{};
+        if (i < 2) {
+          // "." and ".." are not looked up
+          entry.attr.st_ino  = self.toInode(id);
+          entry.attr.st_mode = S_IFDIR;
+        } else if (self.statNode(id, entry.attr) == 0) {
+          entry.ino           = entry.attr.st_ino;
+          entry.attr_timeout  = cacheTimeout;
+          entry.entry_timeout = cacheTimeout;
+        } else {
+          // removed since the directory was opened
+          continue;
+        }
+        entrySize = fuse_add_direntry_plus(req, entryBuffer, size - used, name.c_str(),
+                                           &entry, next);
+      } else {
+        struct stat st{};
+        st.st_ino  = self.toInode(id);
+        st.st_mode = fileType(self.m_tree->node(id).type);
+        entrySize =
+            fuse_add_direntry(req, entryBuffer, size - used, name.c_str(), &st, next);
+      }
+
+      if (entrySize > size - used) {
+        break;
+      }
+      used += entrySize;
+    }
+    lock.unlock();
+
+    fuse_reply_buf(req, buffer.data(), used);
+  }
+
+  static void readdir(fuse_req_t req, fuse_ino_t, size_t size, off_t offset,
+                      fuse_file_info* fi)
+  {
+    readdir(req, size, offset, fi, false);
+  }
+
+  static void readdirplus(fuse_req_t req, fuse_ino_t, size_t size, off_t offset,
+                          fuse_file_info* fi)
+  {
+    readdir(req, size, offset, fi, true);
+  }
+
+  static void releasedir(fuse_req_t req, fuse_ino_t, fuse_file_info* fi)
+  {
+    delete reinterpret_cast<directoryHandle_t*>(fi->fh);
+    fuse_reply_err(req, 0);
+  }
+
+  static void statfs(fuse_req_t req, fuse_ino_t)
+  {
+    struct statvfs st{};
+    if (fstatvfs(backend(req).m_upperFd, &st) != 0) {
+      fuse_reply_err(req, errno);
+      return;
+    }
+    fuse_reply_statfs(req, &st);
+  }
+
+  static fuse_lowlevel_ops operations()
+  {
+    fuse_lowlevel_ops operations{};
+    operations.init        = init;
+    operations.lookup      = lookup;
+    operations.getattr     = getattr;
+    operations.setattr     = setattr;
+    operations.readlink    = readlink;
+    operations.mknod       = mknod;
+    operations.mkdir       = mkdir;
+    operations.unlink      = unlink;
+    operations.rmdir       = rmdir;
+    operations.symlink     = symlink;
+    operations.rename      = rename;
+    operations.open        = open;
+    operations.read        = read;
+    operations.flush       = flush;
+    operations.release     = release;
+    operations.fsync       = fsync;
+    operations.opendir     = opendir;
+    operations.readdir     = readdir;
+    operations.releasedir  = releasedir;
+    operations.statfs      = statfs;
+    operations.create      = create;
+    operations.write_buf   = writeBuf;
+    operations.readdirplus = readdirplus;
+    return operations;
+  }
+};
+
+shared_ptr<FuseBackend> FuseBackend::create(unique_ptr<VirtualFileTree> tree,
+                                            string target, string upperDir)
+{
+  return create(make_shared<SharedTree>(std::move(tree)), std::move(target),
+                std::move(upperDir));
+}
+
+shared_ptr<FuseBackend> FuseBackend::create(shared_ptr<SharedTree> tree, string target,
+                                            string upperDir)
+{
+  return shared_ptr<FuseBackend>(
+      new FuseBackend(std::move(tree), std::move(target), std::move(upperDir)),
+      &FuseBackend::release);
+}
+
+FuseBackend::FuseBackend(shared_ptr<SharedTree> tree, string target, string upperDir)
+    : m_sharedTree(std::move(tree)), m_tree(m_sharedTree->tree.get()),
+      m_treeMutex(m_sharedTree->mutex), m_target(std::move(target)),
+      m_upperDir(std::move(upperDir)), m_targetNode(m_tree->resolve(m_target))
+{}
+
+FuseBackend::~FuseBackend()
+{
+  // release() unmounts before deleting
+  closeLayers();
+}
+
+void FuseBackend::release(FuseBackend* backend) noexcept
+{
+  string error;
+  if (backend->unmount(error)) {
+    delete backend;
+    return;
+  }
+
+  // detach the mount, the session loop ends when the kernel closes the connection
+  // after the last open file was closed, which can take as long as the game runs
+  fuse_session_unmount(backend->m_session);
+  thread([backend] {
+    backend->m_thread.join();
+    fuse_session_destroy(backend->m_session);
+    backend->m_session = nullptr;
+    delete backend;
+  }).detach();
+}
+
+bool FuseBackend::mount(string& error)
+{
+  if (m_session != nullptr) {
+    return true;
+  }
+
+  if (m_targetNode == VirtualFileTree::invalidNode) {
+    error = "target is not part of the file tree";
+    return false;
+  }
+
+  // layers have to be opened before mounting, the target is hidden afterwards
+  m_layers.assign(m_tree->layerCount(), {});
+  for (LayerId id = 0; id < m_layers.size(); ++id) {
+    const VirtualFileTree::Layer& layer = m_tree->layer(id);
+    if (layer.root.empty() || !isWithin(layer.destination, m_target)) {
+      continue;
+    }
+
+    // sources that do not exist do not provide anything
+    const int fd = open(layer.root.c_str(), O_PATH | O_CLOEXEC);
+    struct stat st{};
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      continue;
+    }
+
+    m_layers[id] = {fd, !S_ISDIR(st.st_mode)};
+    if (m_upperLayer == VirtualFileTree::noLayer && !m_layers[id].isFile &&
+        layer.root == m_upperDir && layer.destination == m_target) {
+      m_upperLayer = id;
+    }
+  }
+
+  if (m_upperLayer == VirtualFileTree::noLayer) {
+    error = "upper dir '" + m_upperDir + "' is not a layer of the target";
+    closeLayers();
+    return false;
+  }
+  m_upperFd = m_layers[m_upperLayer].fd;
+
+  // generated directories look like the upper dir
+  if (fstat(m_upperFd, &m_generatedStat) != 0) {
+    error = "could not access upper dir '" + m_upperDir + "'";
+    closeLayers();
+    return false;
+  }
+
+  // the kernel checks permissions using the attributes of the backing files
+  fuse_args args = FUSE_ARGS_INIT(0, nullptr);
+  if (fuse_opt_add_arg(&args, "mo2-overlayfs") != 0 ||
+      fuse_opt_add_arg(&args, "-o") != 0 ||
+      fuse_opt_add_arg(&args, "default_permissions,fsname=mo2-overlayfs") != 0) {
+    fuse_opt_free_args(&args);
+    error = "out of memory";
+    closeLayers();
+    return false;
+  }
+
+  const fuse_lowlevel_ops operations = Operations::operations();
+  m_session = fuse_session_new(&args, &operations, sizeof(operations), this);
+  fuse_opt_free_args(&args);
+
+  if (m_session == nullptr) {
+    error = "could not create fuse session";
+    closeLayers();
+    return false;
+  }
+
+  if (fuse_session_mount(m_session, m_target.c_str()) != 0) {
+    fuse_session_destroy(m_session);
+    m_session = nullptr;
+    error     = "could not mount on '" + m_target + "'";
+    closeLayers();
+    return false;
+  }
+
+  m_thread = thread([session = m_session] {
+    fuse_loop_config* config = fuse_loop_cfg_create();
+    fuse_session_loop_mt(session, config);
+    fuse_loop_cfg_destroy(config);
+  });
+
+  return true;
+}
+
+bool FuseBackend::unmount(string& error)
+{
+  if (m_session == nullptr) {
+    return true;
+  }
+
+  // fuse_session_unmount() unmounts lazily, which keeps serving busy files after it
+  // returned, so the regular unmount is done first
+  const char* argv[] = {"fusermount3", "-u", "-q", m_target.c_str(), nullptr};
+  pid_t pid          = 0;
+  if (posix_spawnp(&pid, argv[0], nullptr, nullptr, const_cast<char* const*>(argv),
+                   environ) != 0) {
+    error = "could not run fusermount3";
+    return false;
+  }
+
+  int status = 0;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    error = "could not unmount '" + m_target + "', it may be busy";
+    return false;
+  }
+
+  // the session loop ends when the kernel closes the connection
+  fuse_session_exit(m_session);
+  m_thread.join();
+  fuse_session_unmount(m_session);
+  fuse_session_destroy(m_session);
+  m_session = nullptr;
+
+  closeLayers();
+  return true;
+}
+
+void FuseBackend::closeLayers() noexcept
+{
+  for (layer_t& layer : m_layers) {
+    if (layer.fd >= 0) {
+      close(layer.fd);
+    }
+  }
+  m_layers.clear();
+  m_upperLayer = VirtualFileTree::noLayer;
+  m_upperFd    = -1;
+}
+
+uint64_t FuseBackend::toInode(NodeId id) const noexcept
+{
+  // FUSE_ROOT_ID is reserved for the target, 0 is invalid
+  return id == m_targetNode ? FUSE_ROOT_ID : static_cast<uint64_t>(id) + 2;
+}
+
+FuseBackend::NodeId FuseBackend::toNode(uint64_t inode) const noexcept
+{
+  return inode == FUSE_ROOT_ID ? m_targetNode : static_cast<NodeId>(inode - 2);
+}
+
+string FuseBackend::layerPath(NodeId id, LayerId layer) const
+{
+  const string path         = m_tree->path(id);
+  const string& destination = m_tree->layer(layer).destination;
+  return path.size() <= destination.size() ? string()
+                                           : path.substr(destination.size() + 1);
+}
+
+string FuseBackend::targetPath(NodeId id) const
+{
+  const string path = m_tree->path(id);
+  return path.size() <= m_target.size() ? string() : path.substr(m_target.size() + 1);
+}
+
+int FuseBackend::statNode(NodeId id, struct stat& st) const
+{
+  const VirtualFileTree::Node& node = m_tree->node(id);
+
+  if (node.layer == VirtualFileTree::noLayer || m_layers[node.layer].fd < 0) {
+    // directories without a backing directory, for example from skip layers
+    st = m_generatedStat;
+  } else if (m_layers[node.layer].isFile) {
+    st          = m_generatedStat;
+    st.st_mode  = S_IFLNK | 0777;
+    st.st_nlink = 1;
+    st.st_size  = static_cast<off_t>(m_tree->layer(node.layer).root.size());
+  } else {
+    const string path = layerPath(id, node.layer);
+    if (fstatat(m_layers[node.layer].fd, relative(path), &st, AT_SYMLINK_NOFOLLOW) !=
+        0) {
+      return errno;
+    }
+  }
+
+  st.st_ino = toInode(id);
+  return 0;
+}
+
+int FuseBackend::readLink(NodeId id, string& target) const
+{
+  const VirtualFileTree::Node& node = m_tree->node(id);
+  if (node.layer == VirtualFileTree::noLayer || m_layers[node.layer].fd < 0) {
+    return EINVAL;
+  }
+
+  if (m_layers[node.layer].isFile) {
+    target = m_tree->layer(node.layer).root;
+    return 0;
+  }
+
+  char buffer[PATH_MAX];
+  const string path  = layerPath(id, node.layer);
+  const ssize_t size = readlinkat(m_layers[node.layer].fd, relative(path), buffer,
+                                  sizeof(buffer));
+  if (size < 0) {
+    return errno;
+  }
+  target.assign(buffer, static_cast<size_t>(size));
+  return 0;
+}
+
+int FuseBackend::openNode(NodeId id, int flags, int& fd) const
+{
+  const VirtualFileTree::Node& node = m_tree->node(id);
+  if (node.layer == VirtualFileTree::noLayer || m_layers[node.layer].fd < 0 ||
+      m_layers[node.layer].isFile) {
+    return EIO;
+  }
+
+  const string path = layerPath(id, node.layer);
+  fd = openat(m_layers[node.layer].fd, relative(path), flags | O_NOFOLLOW | O_CLOEXEC);
+  return fd < 0 ? errno : 0;
+}
+
+int FuseBackend::prepareEntry(NodeId parent, string_view name, string& path,
+                              bool& replacedWhiteout)
+{
+  if (m_tree->child(parent, name) != VirtualFileTree::invalidNode) {
+    return EEXIST;
+  }
+  if (const int error = copyUp(parent)) {
+    return error;
+  }
+
+  path             = joinPath(targetPath(parent), name);
+  replacedWhiteout = removeWhiteout(path);
+  return 0;
+}
+
+int FuseBackend::copyUp(NodeId id)
+{
+  const VirtualFileTree::Node node = m_tree->node(id);
+  if (node.layer == m_upperLayer) {
+    return 0;
+  }
+
+  if (id != m_targetNode) {
+    if (const int error = copyUp(node.parent)) {
+      return error;
+    }
+  }
+
+  const string path = targetPath(id);
+  struct stat st{};
+  if (const int error = statNode(id, st)) {
+    return error;
+  }
+
+  // the target itself is the root of the upper dir
+  if (!path.empty()) {
+    switch (node.type) {
+    case LayerListing::EntryType::Directory:
+      removeWhiteout(path);
+      if (mkdirat(m_upperFd, path.c_str(), st.st_mode & 07777) != 0 &&
+          errno != EEXIST) {
+        return errno;
+      }
+      break;
+    case LayerListing::EntryType::Symlink: {
+      string target;
+      if (const int error = readLink(id, target)) {
+        return error;
+      }
+      if (symlinkat(target.c_str(), m_upperFd, path.c_str()) != 0) {
+        return errno;
+      }
+      break;
+    }
+    case LayerListing::EntryType::File:
+      if (const int error = copyFile(id, path, st)) {
+        return error;
+      }
+      break;
+    default:
+      return EPERM;
+    }
+  }
+
+  m_tree->setLayer(id, m_upperLayer);
+  return 0;
+}
+
+int FuseBackend::copyFile(NodeId id, const string& path, const struct stat& st)
+{
+  int source = -1;
+  if (const int error = openNode(id, O_RDONLY, source)) {
+    return error;
+  }
+
+  // copy to a temporary file first, so a failed copy does not hide the lower file
+  const string temporary = path + string(copyUpSuffix);
+  const int destination =
+      openat(m_upperFd, temporary.c_str(),
+             O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, st.st_mode & 07777);
+  if (destination < 0) {
+    const int error = errno;
+    close(source);
+    return error;
+  }
+
+  int error = copyData(source, destination, st.st_size);
+  close(source);
+
+  if (error == 0) {
+    const timespec times[2] = {st.st_atim, st.st_mtim};
+    futimens(destination, times);
+  }
+  if (close(destination) != 0 && error == 0) {
+    error = errno;
+  }
+  if (error == 0 &&
+      renameat(m_upperFd, temporary.c_str(), m_upperFd, path.c_str()) != 0) {
+    error = errno;
+  }
+
+  if (error != 0) {
+    unlinkat(m_upperFd, temporary.c_str(), 0);
+  }
+  return error;
+}
+
+bool FuseBackend::existsInLowerLayers(const string& path) const
+{
+  const string virtualPath = joinPath(m_target, path);
+
+  for (LayerId id = 0; id < m_layers.size(); ++id) {
+    const layer_t& layer = m_layers[id];
+    if (id == m_upperLayer || layer.fd < 0) {
+      continue;
+    }
+
+    if (layer.isFile) {
+      if (m_tree->layer(id).destination == virtualPath) {
+        return true;
+      }
+      continue;
+    }
+
+    struct stat st{};
+    if (fstatat(layer.fd, relative(path), &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        !isWhiteout(st)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+int FuseBackend::createWhiteout(const string& path)
+{
+  if (mknodat(m_upperFd, path.c_str(), S_IFCHR, makedev(0, 0)) == 0) {
+    return 0;
+  }
+  if (errno != EPERM) {
+    return errno;
+  }
+
+  // creating devices is not permitted, use a whiteout file instead
+  const size_t pos      = path.rfind('/');
+  const string name     = path.substr(pos == string::npos ? 0 : pos + 1);
+  const string whiteout = pos == string::npos
+                              ? string(whiteoutPrefix) + name
+                              : path.substr(0, pos + 1) + string(whiteoutPrefix) + name;
+
+  const int fd = openat(m_upperFd, whiteout.c_str(),
+                        O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return errno;
+  }
+  close(fd);
+  return 0;
+}
+
+bool FuseBackend::removeWhiteout(const string& path)
+{
+  bool removed = false;
+
+  struct stat st{};
+  if (fstatat(m_upperFd, path.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+      isWhiteout(st)) {
+    removed = unlinkat(m_upperFd, path.c_str(), 0) == 0;
+  }
+
+  const size_t pos      = path.rfind('/');
+  const string whiteout = pos == string::npos
+                              ? string(whiteoutPrefix) + path
+                              : path.substr(0, pos + 1) + string(whiteoutPrefix) +
+                                    path.substr(pos + 1);
+  if (unlinkat(m_upperFd, whiteout.c_str(), 0) == 0) {
+    removed = true;
+  }
+
+  return removed;
+}
+
+int FuseBackend::removeUpperDirectory(const string& path)
+{
+  const int fd =
+      openat(m_upperFd, path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return errno;
+  }
+
+  DIR* dir = fdopendir(fd);
+  if (dir == nullptr) {
+    const int error = errno;
+    close(fd);
+    return error;
+  }
+
+  // whiteout files and opaque markers are not part of the tree
+  vector<string> whiteouts;
+  int error = 0;
+  while (const dirent* entry = ::readdir(dir)) {
+    const string_view name = entry->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+
+    struct stat st{};
+    if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      continue;
+    }
+    if (!isWhiteout(st) && !(S_ISREG(st.st_mode) && name.starts_with(whiteoutPrefix))) {
+      error = ENOTEMPTY;
+      break;
+    }
+    whiteouts.emplace_back(name);
+  }
+
+  if (error == 0) {
+    for (const string& whiteout : whiteouts) {
+      unlinkat(dirfd(dir), whiteout.c_str(), 0);
+    }
+  }
+  closedir(dir);
+
+  if (error != 0) {
+    return error;
+  }
+  return unlinkat(m_upperFd, path.c_str(), AT_REMOVEDIR) != 0 ? errno : 0;
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "virtualfiletree.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct fuse_session;
+
+/**
+ * FUSE filesystem serving a single target from a merged file tree.
+ * Lookups are answered from the tree without probing the layers, changes are written
+ * to the upper dir. Files are copied to the upper dir before they are modified, like
+ * overlayfs does.
+ * If the kernel supports FUSE passthrough (Linux 6.9, requires CAP_SYS_ADMIN), reads
+ * and writes of regular files are passed directly to the backing files.
+ * Several backends can serve different targets of the same tree.
+ */
+class FuseBackend
+{
+public:
+  /**
+   * Merged file tree shared between the backends serving its targets
+   */
+  struct SharedTree
+  {
+    explicit SharedTree(std::unique_ptr<VirtualFileTree> tree) : tree(std::move(tree))
+    {}
+
+    std::unique_ptr<VirtualFileTree> tree;
+    std::shared_mutex mutex;
+  };
+
+  /**
+   * @brief Creates a backend that is not mounted yet. A backend that is still mounted
+   * when it is released is unmounted. If the target is busy, it is unmounted lazily and
+   * open files are served on a background thread until they are closed, so releasing
+   * never blocks.
+   * @param tree Tree holding the layers of the target
+   * @param target Absolute path to mount on
+   * @param upperDir Directory receiving all changes, must be a layer of the target
+   */
+  [[nodiscard]] static std::shared_ptr<FuseBackend>
+  create(std::unique_ptr<VirtualFileTree> tree, std::string target,
+         std::string upperDir);
+
+  /**
+   * @brief Creates a backend that is not mounted yet, see above
+   * @param tree Tree holding the layers of the target and possibly other targets,
+   * only layers of the target are opened
+   * @param target Absolute path to mount on
+   * @param upperDir Directory receiving all changes, must be a layer of the target
+   */
+  [[nodiscard]] static std::shared_ptr<FuseBackend>
+  create(std::shared_ptr<SharedTree> tree, std::string target, std::string upperDir);
+
+  FuseBackend(const FuseBackend&)            = delete;
+  FuseBackend& operator=(const FuseBackend&) = delete;
+
+  /**
+   * @brief Mounts the filesystem and starts serving requests on a background thread
+   * @param error Receives a description of the error if mounting failed
+   */
+  [[nodiscard]] bool mount(std::string& error);
+
+  /**
+   * @brief Unmounts the filesystem, fails if it is busy
+   * @param error Receives a description of the error if unmounting failed
+   */
+  [[nodiscard]] bool unmount(std::string& error);
+
+  [[nodiscard]] bool isMounted() const noexcept { return m_session != nullptr; }
+
+private:
+  using NodeId  = VirtualFileTree::NodeId;
+  using LayerId = VirtualFileTree::LayerId;
+
+  // implements the fuse operations, defined in the source file
+  struct Operations;
+
+  FuseBackend(std::shared_ptr<SharedTree> tree, std::string target,
+              std::string upperDir);
+  ~FuseBackend();
+
+  /**
+   * @brief Deleter of created backends, unmounts or detaches a mounted backend
+   */
+  static void release(FuseBackend* backend) noexcept;
+
+  struct layer_t
+  {
+    // O_PATH descriptor of the layer root, -1 for generated layers
+    int fd = -1;
+    // layers of single files are presented as symlinks to the file
+    bool isFile = false;
+  };
+
+  struct passthrough_t
+  {
+    int backingId;
+    // the kernel allows only one backing file per inode
+    dev_t device;
+    ino_t inode;
+    unsigned int openCount;
+  };
+
+  void closeLayers() noexcept;
+
+  [[nodiscard]] std::uint64_t toInode(NodeId id) const noexcept;
+  [[nodiscard]] NodeId toNode(std::uint64_t inode) const noexcept;
+
+  /**
+   * @brief Returns the path of a node relative to the root of the given layer
+   */
+  [[nodiscard]] std::string layerPath(NodeId id, LayerId layer) const;
+
+  /**
+   * @brief Returns the path of a node relative to the target, which is also the path
+   * relative to the upper dir
+   */
+  [[nodiscard]] std::string targetPath(NodeId id) const;
+
+  // the following functions return 0 on success or an errno value, the tree must be
+  // locked by the caller
+
+  [[nodiscard]] int statNode(NodeId id, struct stat& st) const;
+  [[nodiscard]] int readLink(NodeId id, std::string& target) const;
+  [[nodiscard]] int openNode(NodeId id, int flags, int& fd) const;
+
+  /**
+   * @brief Prepares the upper dir for a new entry below the given parent
+   * @param path Receives the path of the new entry relative to the upper dir
+   * @param replacedWhiteout Set if a whiteout file had to be removed
+   */
+  [[nodiscard]] int prepareEntry(NodeId parent, std::string_view name,
+                                 std::string& path, bool& replacedWhiteout);
+
+  /**
+   * @brief Copies a node and its parents to the upper dir
+   */
+  [[nodiscard]] int copyUp(NodeId id);
+  [[nodiscard]] int copyFile(NodeId id, const std::string& path, const struct stat& st);
+
+  /**
+   * @brief Checks if any layer below the upper dir provides the given path
+   */
+  [[nodiscard]] bool existsInLowerLayers(const std::string& path) const;
+
+  /**
+   * @brief Hides the given path in lower layers for the following sessions
+   */
+  [[nodiscard]] int createWhiteout(const std::string& path);
+
+  /**
+   * @brief Removes a whiteout file from the upper dir
+   * @return true if there was a whiteout file
+   */
+  bool removeWhiteout(const std::string& path);
+
+  /**
+   * @brief Removes a directory from the upper dir that only holds whiteout files
+   */
+  [[nodiscard]] int removeUpperDirectory(const std::string& path);
+
+  std::shared_ptr<SharedTree> m_sharedTree;
+  VirtualFileTree* m_tree;
+  std::shared_mutex& m_treeMutex;
+  std::string m_target;
+  std::string m_upperDir;
+  NodeId m_targetNode;
+  LayerId m_upperLayer = VirtualFileTree::noLayer;
+  std::vector<layer_t> m_layers;
+  // O_PATH descriptor of the upper dir
+  int m_upperFd = -1;
+  // owner and time of generated directories
+  struct stat m_generatedStat{};
+  // backing files of open nodes, if passthrough is enabled
+  std::atomic<bool> m_passthrough = false;
+  std::mutex m_passthroughMutex;
+  std::unordered_map<NodeId, passthrough_t> m_passthroughFiles;
+  fuse_session* m_session = nullptr;
+  std::thread m_thread;
+};
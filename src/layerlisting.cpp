@@ -0,0 +1,447 @@
+#include "layerlisting.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <string_view>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <unordered_set>
+
+using namespace std;
+
+// file marking a directory as opaque
+static inline constexpr string_view opaqueMarker = ".wh..wh..opq";
+
+// prefix of files that are used as whiteouts by fuse-overlayfs
+static inline constexpr string_view whiteoutPrefix = ".wh.";
+
+// FNV-1a
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
+{
+  const auto* bytes = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static int64_t modificationTime(const struct stat& st)
+{
+  return static_cast<int64_t>(st.st_mtim.tv_sec) * 1'000'000'000 + st.st_mtim.tv_nsec;
+}
+
+static string joinPath(const string& parent, string_view name)
+{
+  if (parent.empty()) {
+    return string(name);
+  }
+  string result;
+  result.reserve(parent.size() + 1 + name.size());
+  result += parent;
+  result += '/';
+  result += name;
+  return result;
+}
+
+shared_ptr<const LayerListing> LayerListing::scan(const string& root,
+                                                  const SkipRules& rules)
+{
+  shared_ptr<LayerListing> listing(new LayerListing());
+  listing->m_root  = root;
+  listing->m_rules = rules;
+
+  const int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return listing;
+  }
+
+  struct stat st{};
+  if (fstat(fd, &st) == 0) {
+    listing->addStamp({}, st);
+  }
+  listing->scanDirectory(fd, {});
+
+  return listing;
+}
+
+shared_ptr<const LayerListing> LayerListing::create(string root, vector<Entry> entries)
+{
+  shared_ptr<LayerListing> listing(new LayerListing());
+  listing->m_root    = std::move(root);
+  listing->m_entries = std::move(entries);
+  return listing;
+}
+
+shared_ptr<const LayerListing>
+LayerListing::createSkipLayer(span<const string> files, span<const string> directories)
+{
+  vector<Entry> entries;
+  unordered_set<string_view> createdDirectories;
+
+  // parent directories have to be listed before their children
+  const auto addParents = [&](const string& path) {
+    size_t pos = 0;
+    while ((pos = path.find('/', pos + 1)) != string::npos) {
+      const string_view parent(path.data(), pos);
+      if (createdDirectories.insert(parent).second) {
+        entries.emplace_back(string(parent), EntryType::Directory, 0);
+      }
+    }
+  };
+
+  for (const string& directory : directories) {
+    addParents(directory);
+    if (createdDirectories.insert(directory).second) {
+      entries.emplace_back(directory, EntryType::Directory, 0);
+    }
+    entries.emplace_back(directory, EntryType::OpaqueDirectory, 0);
+  }
+
+  for (const string& file : files) {
+    addParents(file);
+    entries.emplace_back(file, EntryType::Whiteout, 0);
+  }
+
+  return create({}, std::move(entries));
+}
+
+bool LayerListing::isCurrent() const
+{
+  return ranges::all_of(m_stamps, [this](const DirectoryStamp& stamp) {
+    return isCurrent(m_root, stamp);
+  });
+}
+
+bool LayerListing::isCurrent(const string& root, const DirectoryStamp& stamp)
+{
+  struct stat st{};
+  const string path = stamp.path.empty() ? root : root + '/' + stamp.path;
+  return stat(path.c_str(), &st) == 0 && st.st_ino == stamp.inode &&
+         modificationTime(st) == stamp.mtime;
+}
+
+uint64_t LayerListing::fileFingerprint() const
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const Entry& entry : m_entries) {
+    if (entry.type != EntryType::File) {
+      continue;
+    }
+
+    struct stat st{};
+    const string path = m_root + '/' + entry.path;
+    if (stat(path.c_str(), &st) != 0) {
+      st = {};
+    }
+    const int64_t mtime = modificationTime(st);
+    hash = hashBytes(hash, entry.path.data(), entry.path.size() + 1);
+    hash = hashBytes(hash, &st.st_ino, sizeof(st.st_ino));
+    hash = hashBytes(hash, &st.st_size, sizeof(st.st_size));
+    hash = hashBytes(hash, &mtime, sizeof(mtime));
+  }
+  return hash;
+}
+
+void LayerListing::scanDirectory(int fd, const string& relativePath)
+{
+  DIR* dir = fdopendir(fd);
+  if (dir == nullptr) {
+    close(fd);
+    return;
+  }
+
+  while (const dirent* entry = readdir(dir)) {
+    const string_view name = entry->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+
+    struct stat st{};
+    if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      continue;
+    }
+
+    string path = joinPath(relativePath, name);
+
+    if (S_ISDIR(st.st_mode)) {
+      if (ranges::find(m_rules.directories, name) != m_rules.directories.end()) {
+        m_skippedDirectories.push_back(std::move(path));
+        continue;
+      }
+
+      const int childFd = openat(dirfd(dir), entry->d_name,
+                                 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      addStamp(path, st);
+      m_entries.emplace_back(path, EntryType::Directory, 0);
+      if (childFd >= 0) {
+        scanDirectory(childFd, path);
+      }
+      continue;
+    }
+
+    if (ranges::any_of(m_rules.fileSuffixes, [&](const string& suffix) {
+          return name.ends_with(suffix);
+        })) {
+      m_skippedFiles.push_back(std::move(path));
+      continue;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+      if (name == opaqueMarker) {
+        m_entries.emplace_back(relativePath, EntryType::OpaqueDirectory, 0);
+      } else if (name.starts_with(whiteoutPrefix)) {
+        m_entries.emplace_back(joinPath(relativePath, name.substr(whiteoutPrefix.size())),
+                               EntryType::Whiteout, 0);
+      } else {
+        m_entries.emplace_back(std::move(path), EntryType::File,
+                               static_cast<uint64_t>(st.st_size));
+      }
+    } else if (S_ISLNK(st.st_mode)) {
+      m_entries.emplace_back(std::move(path), EntryType::Symlink, 0);
+    } else if (S_ISCHR(st.st_mode) && st.st_rdev == 0) {
+      m_entries.emplace_back(std::move(path), EntryType::Whiteout, 0);
+    } else {
+      m_entries.emplace_back(std::move(path), EntryType::Other, 0);
+    }
+  }
+
+  closedir(dir);
+}
+
+void LayerListing::addStamp(string path, const struct stat& st)
+{
+  const int64_t mtime = modificationTime(st);
+  if (m_stamps.empty()) {
+    m_fingerprint = 0xcbf29ce484222325ULL;
+  }
+  m_fingerprint = hashBytes(m_fingerprint, path.data(), path.size() + 1);
+  m_fingerprint = hashBytes(m_fingerprint, &st.st_ino, sizeof(st.st_ino));
+  m_fingerprint = hashBytes(m_fingerprint, &mtime, sizeof(mtime));
+  m_stamps.emplace_back(std::move(path), st.st_ino, mtime);
+}
+
+shared_ptr<const LayerListing> LayerCache::get(const string& root,
+                                               const SkipRules& rules)
+{
+  {
+    scoped_lock lock(m_mutex);
+    const auto it = m_listings.find(root);
+    if (it != m_listings.end() && it->second.listing->rules() == rules) {
+      entry_t& entry = it->second;
+      if (entry.generation == m_generation) {
+        return entry.listing;
+      }
+      if (entry.listing->isCurrent()) {
+        entry.generation = m_generation;
+        return entry.listing;
+      }
+    }
+  }
+
+  // scan without holding the lock, so different layers can be scanned in parallel
+  auto listing = LayerListing::scan(root, rules);
+
+  scoped_lock lock(m_mutex);
+  m_listings[root] = {listing, m_generation};
+  return listing;
+}
+
+void LayerCache::revalidate()
+{
+  scoped_lock lock(m_mutex);
+  ++m_generation;
+}
+
+void LayerCache::clear()
+{
+  scoped_lock lock(m_mutex);
+  m_listings.clear();
+}
+
+bool mergeLayers(span<const shared_ptr<const LayerListing>> layers,
+                 const MergeCallback& callback)
+{
+  // visible paths, mapped to whether they are a directory
+  unordered_map<string_view, bool> visible;
+  // paths hidden in lower layers including their contents
+  unordered_set<string_view> whiteouts;
+  // directories whose contents are hidden in lower layers
+  unordered_set<string_view> opaqueDirectories;
+
+  vector<string_view> newWhiteouts;
+  vector<string_view> newOpaqueDirectories;
+
+  const auto isHidden = [&](string_view path) {
+    if (whiteouts.contains(path)) {
+      return true;
+    }
+    // check all parent directories
+    size_t pos = 0;
+    while ((pos = path.find('/', pos + 1)) != string_view::npos) {
+      const string_view parent = path.substr(0, pos);
+      if (whiteouts.contains(parent) || opaqueDirectories.contains(parent)) {
+        return true;
+      }
+      // a file in a higher layer hides a directory with the same name
+      const auto it = visible.find(parent);
+      if (it != visible.end() && !it->second) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  for (size_t i = 0; i < layers.size(); ++i) {
+    for (const LayerListing::Entry& entry : layers[i]->entries()) {
+      if (isHidden(entry.path)) {
+        continue;
+      }
+
+      switch (entry.type) {
+      case LayerListing::EntryType::Whiteout:
+        newWhiteouts.push_back(entry.path);
+        break;
+      case LayerListing::EntryType::OpaqueDirectory:
+        newOpaqueDirectories.push_back(entry.path);
+        break;
+      default:
+        if (visible
+                .try_emplace(entry.path,
+                             entry.type == LayerListing::EntryType::Directory)
+                .second) {
+          if (!callback(entry, i)) {
+            return false;
+          }
+        }
+        break;
+      }
+    }
+
+    // markers only apply to lower layers
+    whiteouts.insert(newWhiteouts.begin(), newWhiteouts.end());
+    opaqueDirectories.insert(newOpaqueDirectories.begin(), newOpaqueDirectories.end());
+    newWhiteouts.clear();
+    newOpaqueDirectories.clear();
+  }
+
+  return true;
+}
+
+// clones a file on filesystems supporting reflinks, like btrfs and xfs
+static bool cloneFile(int sourceDir, const string& sourcePath, int destinationDir,
+                      const string& destinationPath)
+{
+  const int source = openat(sourceDir, sourcePath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (source < 0) {
+    return false;
+  }
+  const int destination =
+      openat(destinationDir, destinationPath.c_str(),
+             O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (destination < 0) {
+    close(source);
+    return false;
+  }
+
+  const bool cloned = ioctl(destination, FICLONE, source) == 0;
+  close(source);
+  close(destination);
+  if (!cloned) {
+    unlinkat(destinationDir, destinationPath.c_str(), 0);
+  }
+  return cloned;
+}
+
+bool materializeLayers(span<const shared_ptr<const LayerListing>> layers,
+                       const string& destination, string& error)
+{
+  for (const auto& layer : layers) {
+    const bool hidesFiles = ranges::any_of(layer->entries(), [](const auto& entry) {
+      return entry.type == LayerListing::EntryType::Whiteout ||
+             entry.type == LayerListing::EntryType::OpaqueDirectory;
+    });
+    if (hidesFiles) {
+      error = "layer '" + layer->root() + "' hides files of lower layers";
+      return false;
+    }
+  }
+
+  if (mkdir(destination.c_str(), 0755) != 0) {
+    error = "could not create '" + destination + "': " + strerror(errno);
+    return false;
+  }
+
+  vector<int> fds;
+  fds.reserve(layers.size() + 1);
+  const auto closeAll = [&] {
+    for (const int fd : fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  };
+
+  fds.push_back(open(destination.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+  for (const auto& layer : layers) {
+    fds.push_back(open(layer->root().c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+  }
+  if (fds.front() < 0) {
+    error = "could not open '" + destination + "': " + strerror(errno);
+    closeAll();
+    return false;
+  }
+
+  const int root = fds.front();
+  const bool complete =
+      mergeLayers(layers, [&](const LayerListing::Entry& entry, size_t index) {
+        const int layer   = fds[index + 1];
+        const char* path  = entry.path.c_str();
+        const auto failed = [&](const char* action) {
+          error = string(action) + " '" + entry.path + "' from '" +
+                  layers[index]->root() + "': " + strerror(errno);
+          return false;
+        };
+
+        switch (entry.type) {
+        case LayerListing::EntryType::Directory:
+          if (mkdirat(root, path, 0755) != 0 && errno != EEXIST) {
+            return failed("could not create");
+          }
+          return true;
+
+        case LayerListing::EntryType::File:
+          if (linkat(layer, path, root, path, 0) == 0 ||
+              cloneFile(layer, entry.path, root, entry.path)) {
+            return true;
+          }
+          return failed("could not link");
+
+        case LayerListing::EntryType::Symlink: {
+          char target[PATH_MAX];
+          const ssize_t size = readlinkat(layer, path, target, sizeof(target) - 1);
+          if (size < 0) {
+            return failed("could not read");
+          }
+          target[size] = '\0';
+          if (symlinkat(target, root, path) != 0) {
+            return failed("could not create");
+          }
+          return true;
+        }
+
+        default:
+          error = "'" + entry.path + "' in '" + layers[index]->root() +
+                  "' is not a regular file";
+          return false;
+        }
+      });
+
+  closeAll();
+  return complete;
+}
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/**
+ * Names of files and directories hidden from the overlay
+ */
+struct SkipRules
+{
+  // file name suffixes, not to be confused with file extensions
+  std::vector<std::string> fileSuffixes;
+  // directory names, not paths
+  std::vector<std::string> directories;
+
+  bool operator==(const SkipRules&) const = default;
+};
+
+/**
+ * Immutable recursive listing of a single layer directory
+ */
+class LayerListing
+{
+public:
+  enum class EntryType : std::uint8_t
+  {
+    File,
+    Directory,
+    Symlink,
+    Other,
+    // hides the same path in lower layers
+    Whiteout,
+    // hides the contents of the same directory in lower layers
+    OpaqueDirectory
+  };
+
+  struct Entry
+  {
+    // path relative to the layer root, separated by '/'
+    std::string path;
+    EntryType type;
+    // file size in bytes, 0 for everything else
+    std::uint64_t size;
+  };
+
+  struct DirectoryStamp
+  {
+    // path relative to the root, empty for the root itself
+    std::string path;
+    ino_t inode;
+    std::int64_t mtime;
+  };
+
+  /**
+   * @brief Recursively scans the given directory. Entries matching the skip rules are
+   * not listed but recorded in skippedFiles() and skippedDirectories().
+   * A directory that does not exist results in an empty listing.
+   */
+  [[nodiscard]] static std::shared_ptr<const LayerListing>
+  scan(const std::string& root, const SkipRules& rules);
+
+  /**
+   * @brief Creates a listing that is not backed by a directory, for example a layer
+   * that is generated during mounting
+   * @param entries Entries, parents must be listed before their children
+   */
+  [[nodiscard]] static std::shared_ptr<const LayerListing>
+  create(std::string root, std::vector<Entry> entries);
+
+  /**
+   * @brief Creates the listing of a skip layer holding whiteouts for the given files
+   * and opaque markers for the given directories
+   */
+  [[nodiscard]] static std::shared_ptr<const LayerListing>
+  createSkipLayer(std::span<const std::string> files,
+                  std::span<const std::string> directories);
+
+  /**
+   * @brief Checks if no directory of this layer changed since it was scanned by
+   * comparing inode numbers and modification times. File sizes are not checked.
+   */
+  [[nodiscard]] bool isCurrent() const;
+
+  [[nodiscard]] const std::string& root() const noexcept { return m_root; }
+  [[nodiscard]] const SkipRules& rules() const noexcept { return m_rules; }
+
+  /**
+   * @brief Entries in walk order, parents are always listed before their children
+   */
+  [[nodiscard]] const std::vector<Entry>& entries() const noexcept
+  {
+    return m_entries;
+  }
+
+  /**
+   * @brief Files matching a skipped file suffix, relative to the root
+   */
+  [[nodiscard]] const std::vector<std::string>& skippedFiles() const noexcept
+  {
+    return m_skippedFiles;
+  }
+
+  /**
+   * @brief Directories matching a skipped directory name, relative to the root.
+   * Their contents are not scanned.
+   */
+  [[nodiscard]] const std::vector<std::string>& skippedDirectories() const noexcept
+  {
+    return m_skippedDirectories;
+  }
+
+  /**
+   * @brief Inode numbers and modification times of all scanned directories, used to
+   * check if the listing is still current
+   */
+  [[nodiscard]] const std::vector<DirectoryStamp>& stamps() const noexcept
+  {
+    return m_stamps;
+  }
+
+  /**
+   * @brief Checks if the directory the stamp was taken from is unchanged
+   */
+  [[nodiscard]] static bool isCurrent(const std::string& root,
+                                      const DirectoryStamp& stamp);
+
+  /**
+   * @brief Hash over the inode numbers and modification times of all directories
+   */
+  [[nodiscard]] std::uint64_t fingerprint() const noexcept { return m_fingerprint; }
+
+  /**
+   * @brief Hash over the inode numbers, sizes and modification times of all listed
+   * files as they are on disk right now. Unlike fingerprint(), this notices files that
+   * were modified in place, but it checks every file on each call.
+   */
+  [[nodiscard]] std::uint64_t fileFingerprint() const;
+
+private:
+  LayerListing() = default;
+
+  void scanDirectory(int fd, const std::string& relativePath);
+  void addStamp(std::string path, const struct stat& st);
+
+  std::string m_root;
+  SkipRules m_rules;
+  std::vector<Entry> m_entries;
+  std::vector<std::string> m_skippedFiles;
+  std::vector<std::string> m_skippedDirectories;
+  std::vector<DirectoryStamp> m_stamps;
+  std::uint64_t m_fingerprint = 0;
+};
+
+/**
+ * Thread-safe cache of layer listings, listings are rescanned when they changed on
+ * disk or were scanned with different skip rules. Whether a listing changed on disk is
+ * only checked on the first lookup after revalidate(), so checking every directory of
+ * a layer happens once per plan instead of once per lookup.
+ */
+class LayerCache
+{
+public:
+  [[nodiscard]] std::shared_ptr<const LayerListing> get(const std::string& root,
+                                                        const SkipRules& rules);
+
+  /**
+   * @brief Makes the next lookup of every cached listing check whether it is still
+   * current.
+   */
+  void revalidate();
+
+  void clear();
+
+private:
+  struct entry_t
+  {
+    std::shared_ptr<const LayerListing> listing;
+    // generation the listing was last found to be current in
+    std::uint64_t generation;
+  };
+
+  std::mutex m_mutex;
+  std::unordered_map<std::string, entry_t> m_listings;
+  std::uint64_t m_generation = 0;
+};
+
+/**
+ * Receives a visible entry of a merged view and the index of the layer providing it,
+ * returning false stops the merge
+ */
+using MergeCallback =
+    std::function<bool(const LayerListing::Entry& entry, std::size_t layer)>;
+
+/**
+ * @brief Merges layers the same way an overlay filesystem does. Higher layers hide
+ * entries with the same path, whiteouts hide paths and opaque directories hide the
+ * contents of lower layers.
+ * @param layers Layers ordered from highest to lowest priority
+ * @return false if the callback stopped the merge
+ */
+bool mergeLayers(std::span<const std::shared_ptr<const LayerListing>> layers,
+                 const MergeCallback& callback);
+
+/**
+ * @brief Writes the merged view of the given layers to a new directory. Files are
+ * hardlinked or cloned from their layers, so the directory has to be on the same
+ * filesystem. Layers hiding files with whiteouts or opaque directories are rejected,
+ * they cannot be represented without hiding files of the layers below.
+ * @param layers Layers ordered from highest to lowest priority
+ * @param destination Directory to create, must not exist
+ * @param error Receives a description of the error if the directory is incomplete
+ */
+[[nodiscard]] bool
+materializeLayers(std::span<const std::shared_ptr<const LayerListing>> layers,
+                  const std::string& destination, std::string& error);
@@ -0,0 +1,473 @@
+#include "mergedindex.h"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// identifies index files
+static inline constexpr char indexMagic[8] = {'M', 'O', '2', 'O', 'F', 'S', 'I', 'X'};
+
+// stored as written, reads back differently on machines with another byte order
+static inline constexpr uint32_t byteOrderMark = 0x01020304;
+
+struct section_t
+{
+  // offset from the start of the file in bytes
+  uint64_t offset;
+  // number of elements
+  uint64_t count;
+};
+
+struct header_t
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint64_t key;
+  section_t strings;
+  section_t nodes;
+  section_t buckets;
+  section_t layers;
+  section_t stamps;
+};
+
+static_assert(sizeof(header_t) == 104);
+static_assert(sizeof(MergedIndex::node_t) == 40);
+static_assert(sizeof(MergedIndex::layer_t) == 16);
+static_assert(sizeof(MergedIndex::stamp_t) == 32);
+
+// FNV-1a over the parent id and the name
+static uint64_t hashChild(MergedIndex::NodeId parent, string_view name)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (int i = 0; i < 4; ++i) {
+    hash ^= (parent >> (i * 8)) & 0xff;
+    hash *= 0x100000001b3ULL;
+  }
+  for (const char c : name) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// appends a section to the buffer, aligned to 8 bytes
+template <typename T>
+static section_t appendSection(vector<char>& buffer, span<const T> elements)
+{
+  buffer.resize((buffer.size() + 7) & ~size_t(7));
+  const section_t section{buffer.size(), elements.size()};
+  const auto* data = reinterpret_cast<const char*>(elements.data());
+  buffer.insert(buffer.end(), data, data + elements.size_bytes());
+  return section;
+}
+
+// checks if a section lies within the file and is aligned for its elements
+template <typename T>
+static bool isValidSection(const section_t& section, size_t fileSize)
+{
+  return section.offset % alignof(T) == 0 && section.offset <= fileSize &&
+         section.count <= (fileSize - section.offset) / sizeof(T);
+}
+
+MergedIndex::~MergedIndex()
+{
+  if (m_data != nullptr) {
+    munmap(m_data, m_size);
+  }
+}
+
+bool MergedIndex::write(const string& path, const VirtualFileTree& tree,
+                        span<const shared_ptr<const LayerListing>> listings,
+                        uint64_t key, string& error)
+{
+  using Tree = VirtualFileTree;
+
+  // reachable nodes in breadth-first order, so parents get lower ids than their
+  // children and siblings are numbered consecutively
+  vector<NodeId> order{Tree::rootNode};
+  vector<NodeId> ids(tree.nodeCount(), Tree::invalidNode);
+  ids[Tree::rootNode] = 0;
+  for (size_t i = 0; i < order.size(); ++i) {
+    tree.forEachChild(order[i], [&](NodeId child) {
+      ids[child] = static_cast<NodeId>(order.size());
+      order.push_back(child);
+      return true;
+    });
+  }
+
+  const auto mapId = [&](NodeId id) {
+    return id == Tree::invalidNode ? Tree::invalidNode : ids[id];
+  };
+
+  // all strings are stored once, sorted
+  vector<string_view> strings;
+  for (const NodeId id : order) {
+    strings.push_back(tree.name(id));
+  }
+  for (LayerId id = 0; id < tree.layerCount(); ++id) {
+    strings.push_back(tree.layer(id).root);
+    strings.push_back(tree.layer(id).destination);
+  }
+  for (const auto& listing : listings) {
+    if (listing != nullptr) {
+      for (const LayerListing::DirectoryStamp& stamp : listing->stamps()) {
+        strings.push_back(stamp.path);
+      }
+    }
+  }
+  ranges::sort(strings);
+  strings.erase(ranges::unique(strings).begin(), strings.end());
+
+  vector<char> stringData;
+  unordered_map<string_view, stringRef_t> stringRefs;
+  for (const string_view value : strings) {
+    stringRefs.emplace(value, stringRef_t{static_cast<uint32_t>(stringData.size()),
+                                          static_cast<uint32_t>(value.size())});
+    stringData.insert(stringData.end(), value.begin(), value.end());
+    stringData.push_back('\0');
+  }
+  if (stringData.size() > numeric_limits<uint32_t>::max()) {
+    error = "string table is too large";
+    return false;
+  }
+
+  vector<node_t> nodes;
+  nodes.reserve(order.size());
+  for (const NodeId id : order) {
+    const Tree::Node& node = tree.node(id);
+    node_t& entry          = nodes.emplace_back();
+    entry.parent           = mapId(node.parent);
+    entry.firstChild       = mapId(node.firstChild);
+    entry.nextSibling      = mapId(node.nextSibling);
+    entry.layer            = node.layer;
+    entry.name             = stringRefs.at(tree.name(id));
+    entry.size             = node.size;
+    entry.type             = node.type;
+  }
+  // the root has no parent and no siblings
+  nodes[0].parent      = Tree::invalidNode;
+  nodes[0].nextSibling = Tree::invalidNode;
+
+  // at most half of the buckets are used, so probing sequences stay short
+  vector<NodeId> buckets(bit_ceil(max<size_t>(nodes.size() * 2, 2)), Tree::invalidNode);
+  const size_t mask = buckets.size() - 1;
+  for (NodeId id = 1; id < nodes.size(); ++id) {
+    size_t bucket = hashChild(nodes[id].parent, tree.name(order[id])) & mask;
+    while (buckets[bucket] != Tree::invalidNode) {
+      bucket = (bucket + 1) & mask;
+    }
+    buckets[bucket] = id;
+  }
+
+  vector<layer_t> layers;
+  for (LayerId id = 0; id < tree.layerCount(); ++id) {
+    const Tree::Layer& layer = tree.layer(id);
+    layers.push_back({stringRefs.at(layer.root), stringRefs.at(layer.destination)});
+  }
+
+  vector<stamp_t> stamps;
+  for (LayerId id = 0; id < listings.size(); ++id) {
+    if (listings[id] == nullptr) {
+      continue;
+    }
+    for (const LayerListing::DirectoryStamp& stamp : listings[id]->stamps()) {
+      stamps.push_back({id, stringRefs.at(stamp.path),
+                        static_cast<uint64_t>(stamp.inode), stamp.mtime});
+    }
+  }
+
+  header_t header{};
+  memcpy(header.magic, indexMagic, sizeof(indexMagic));
+  header.version   = version;
+  header.byteOrder = byteOrderMark;
+  header.key       = key;
+
+  vector<char> buffer(sizeof(header_t));
+  header.strings = appendSection(buffer, span<const char>(stringData));
+  header.nodes   = appendSection(buffer, span<const node_t>(nodes));
+  header.buckets = appendSection(buffer, span<const NodeId>(buckets));
+  header.layers  = appendSection(buffer, span<const layer_t>(layers));
+  header.stamps  = appendSection(buffer, span<const stamp_t>(stamps));
+  memcpy(buffer.data(), &header, sizeof(header));
+
+  // write to a temporary file first, so readers never see a partial index
+  const string temporary = path + ".tmp";
+  const int fd =
+      ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    error = "could not create '" + temporary + "': " + strerror(errno);
+    return false;
+  }
+
+  size_t written = 0;
+  while (written < buffer.size()) {
+    const ssize_t result =
+        ::write(fd, buffer.data() + written, buffer.size() - written);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error = "could not write '" + temporary + "': " + strerror(errno);
+      close(fd);
+      unlink(temporary.c_str());
+      return false;
+    }
+    written += static_cast<size_t>(result);
+  }
+
+  if (close(fd) != 0 || rename(temporary.c_str(), path.c_str()) != 0) {
+    error = "could not write '" + path + "': " + strerror(errno);
+    unlink(temporary.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+unique_ptr<MergedIndex> MergedIndex::open(const string& path, string& error)
+{
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    error = "could not open '" + path + "': " + strerror(errno);
+    return nullptr;
+  }
+
+  struct stat st{};
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(header_t)) {
+    error = "'" + path + "' is not an index file";
+    close(fd);
+    return nullptr;
+  }
+
+  const auto size = static_cast<size_t>(st.st_size);
+  void* data      = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    error = "could not map '" + path + "': " + strerror(errno);
+    return nullptr;
+  }
+
+  unique_ptr<MergedIndex> index(new MergedIndex());
+  index->m_data = data;
+  index->m_size = size;
+
+  const auto* bytes  = static_cast<const char*>(data);
+  const auto& header = *static_cast<const header_t*>(data);
+  if (memcmp(header.magic, indexMagic, sizeof(indexMagic)) != 0 ||
+      header.byteOrder != byteOrderMark) {
+    error = "'" + path + "' is not an index file";
+    return nullptr;
+  }
+  if (header.version != version) {
+    error = "'" + path + "' has unsupported version " + to_string(header.version);
+    return nullptr;
+  }
+
+  if (!isValidSection<char>(header.strings, size) ||
+      !isValidSection<node_t>(header.nodes, size) ||
+      !isValidSection<NodeId>(header.buckets, size) ||
+      !isValidSection<layer_t>(header.layers, size) ||
+      !isValidSection<stamp_t>(header.stamps, size)) {
+    error = "'" + path + "' is truncated";
+    return nullptr;
+  }
+
+  index->m_key     = header.key;
+  index->m_strings = {bytes + header.strings.offset, header.strings.count};
+  index->m_nodes   = {reinterpret_cast<const node_t*>(bytes + header.nodes.offset),
+                      header.nodes.count};
+  index->m_buckets = {reinterpret_cast<const NodeId*>(bytes + header.buckets.offset),
+                      header.buckets.count};
+  index->m_layers  = {reinterpret_cast<const layer_t*>(bytes + header.layers.offset),
+                      header.layers.count};
+  index->m_stamps  = {reinterpret_cast<const stamp_t*>(bytes + header.stamps.offset),
+                      header.stamps.count};
+
+  if (!index->validate()) {
+    error = "'" + path + "' is corrupted";
+    return nullptr;
+  }
+
+  return index;
+}
+
+bool MergedIndex::validate() const
+{
+  const auto isValidString = [&](stringRef_t ref) {
+    return ref.offset <= m_strings.size() && ref.size <= m_strings.size() - ref.offset;
+  };
+  // references to later nodes only, so following them always terminates
+  const auto isValidLink = [&](NodeId from, NodeId to) {
+    return to == VirtualFileTree::invalidNode || (to > from && to < m_nodes.size());
+  };
+
+  if (m_nodes.empty() || !has_single_bit(m_buckets.size())) {
+    return false;
+  }
+
+  for (NodeId id = 0; id < m_nodes.size(); ++id) {
+    const node_t& node = m_nodes[id];
+    if ((id != 0 && node.parent >= id) || !isValidLink(id, node.firstChild) ||
+        !isValidLink(id, node.nextSibling) || !isValidString(node.name) ||
+        (node.layer != VirtualFileTree::noLayer && node.layer >= m_layers.size())) {
+      return false;
+    }
+  }
+
+  const auto isValidBucket = [&](NodeId id) {
+    return id == VirtualFileTree::invalidNode || id < m_nodes.size();
+  };
+
+  return ranges::all_of(m_buckets, isValidBucket) &&
+         ranges::all_of(m_layers,
+                        [&](const layer_t& layer) {
+                          return isValidString(layer.root) &&
+                                 isValidString(layer.destination);
+                        }) &&
+         ranges::all_of(m_stamps, [&](const stamp_t& stamp) {
+           return stamp.layer < m_layers.size() && isValidString(stamp.path);
+         });
+}
+
+bool MergedIndex::isCurrent() const
+{
+  return ranges::all_of(m_stamps, [this](const stamp_t& stamp) {
+    const LayerListing::DirectoryStamp directory{string(view(stamp.path)),
+                                                 static_cast<ino_t>(stamp.inode),
+                                                 stamp.mtime};
+    return LayerListing::isCurrent(string(layerRoot(stamp.layer)), directory);
+  });
+}
+
+MergedIndex::NodeId MergedIndex::resolve(string_view path) const
+{
+  NodeId node = VirtualFileTree::rootNode;
+
+  size_t start = 0;
+  while (node != VirtualFileTree::invalidNode && start < path.size()) {
+    size_t end = path.find('/', start);
+    if (end == string_view::npos) {
+      end = path.size();
+    }
+    if (end > start) {
+      node = child(node, path.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+
+  return node;
+}
+
+MergedIndex::NodeId MergedIndex::child(NodeId parent, string_view name) const
+{
+  const size_t mask = m_buckets.size() - 1;
+  size_t bucket     = hashChild(parent, name) & mask;
+
+  for (size_t i = 0; i < m_buckets.size(); ++i) {
+    const NodeId id = m_buckets[bucket];
+    if (id == VirtualFileTree::invalidNode) {
+      return VirtualFileTree::invalidNode;
+    }
+    if (m_nodes[id].parent == parent && this->name(id) == name) {
+      return id;
+    }
+    bucket = (bucket + 1) & mask;
+  }
+  return VirtualFileTree::invalidNode;
+}
+
+void MergedIndex::forEachChild(NodeId parent,
+                               const function<bool(NodeId)>& callback) const
+{
+  for (NodeId id = m_nodes[parent].firstChild; id != VirtualFileTree::invalidNode;
+       id        = m_nodes[id].nextSibling) {
+    if (!callback(id)) {
+      return;
+    }
+  }
+}
+
+bool MergedIndex::walk(NodeId node,
+                       const function<bool(NodeId, const string&)>& callback) const
+{
+  struct Frame
+  {
+    NodeId next;
+    size_t pathSize;
+  };
+
+  string path = this->path(node);
+  vector<Frame> stack{{m_nodes[node].firstChild, path.size()}};
+
+  while (!stack.empty()) {
+    Frame& frame = stack.back();
+    if (frame.next == VirtualFileTree::invalidNode) {
+      stack.pop_back();
+      continue;
+    }
+
+    const NodeId id = frame.next;
+    frame.next      = m_nodes[id].nextSibling;
+
+    path.resize(frame.pathSize);
+    path += '/';
+    path += name(id);
+
+    if (!callback(id, path)) {
+      return false;
+    }
+
+    if (m_nodes[id].firstChild != VirtualFileTree::invalidNode) {
+      stack.emplace_back(m_nodes[id].firstChild, path.size());
+    }
+  }
+
+  return true;
+}
+
+string MergedIndex::path(NodeId id) const
+{
+  vector<string_view> components;
+  for (; id != VirtualFileTree::rootNode && id != VirtualFileTree::invalidNode;
+       id = m_nodes[id].parent) {
+    components.push_back(name(id));
+  }
+
+  string result;
+  for (auto it = components.rbegin(); it != components.rend(); ++it) {
+    result += '/';
+    result += *it;
+  }
+  return result;
+}
+
+string MergedIndex::sourcePath(NodeId id) const
+{
+  const LayerId layerId = m_nodes[id].layer;
+  if (layerId == VirtualFileTree::noLayer) {
+    // directories outside of all stacks are not overlaid
+    return path(id);
+  }
+
+  const string_view root = layerRoot(layerId);
+  if (root.empty()) {
+    return {};
+  }
+
+  const string virtualPath      = path(id);
+  const string_view destination = layerDestination(layerId);
+  if (virtualPath.size() <= destination.size()) {
+    return string(root);
+  }
+  return string(root) + virtualPath.substr(destination.size());
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include "virtualfiletree.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+
+/**
+ * Read-only merged file tree stored in a file, so it can be mapped into memory instead
+ * of being rebuilt from the source directories.
+ *
+ * The file starts with a header followed by these sections, all values are stored in
+ * native byte order, so index files are not portable between architectures:
+ *  - strings: sorted unique names, layer paths and directory paths, null terminated
+ *  - nodes: tree nodes, the root node first and parents before their children
+ *  - hash table: node ids keyed by parent id and name, using linear probing
+ *  - layers: root and destination of every layer
+ *  - stamps: inode numbers and modification times of all scanned directories
+ *
+ * Lookups are answered from the mapped file with the same functions VirtualFileTree
+ * provides, so loading an index does not allocate anything per node.
+ *
+ * The index is outdated as soon as one of the stamped directories changed, the same
+ * check LayerCache uses for rescanning.
+ */
+class MergedIndex
+{
+public:
+  using NodeId  = VirtualFileTree::NodeId;
+  using LayerId = VirtualFileTree::LayerId;
+
+  static constexpr std::uint32_t version = 1;
+
+  struct stringRef_t
+  {
+    std::uint32_t offset;
+    std::uint32_t size;
+  };
+
+  struct node_t
+  {
+    NodeId parent;
+    NodeId firstChild;
+    NodeId nextSibling;
+    LayerId layer;
+    stringRef_t name;
+    std::uint64_t size;
+    LayerListing::EntryType type;
+    std::uint8_t reserved[7];
+  };
+
+  struct layer_t
+  {
+    stringRef_t root;
+    stringRef_t destination;
+  };
+
+  struct stamp_t
+  {
+    LayerId layer;
+    stringRef_t path;
+    std::uint64_t inode;
+    std::int64_t mtime;
+  };
+
+  ~MergedIndex();
+
+  MergedIndex(const MergedIndex&)            = delete;
+  MergedIndex& operator=(const MergedIndex&) = delete;
+
+  /**
+   * @brief Writes a file tree to an index file, replacing the file atomically
+   * @param listings Listings of all layers of the tree, indexed by layer id
+   * @param key Identifies the configuration the tree was built from
+   * @param error Receives a description of the error if writing failed
+   */
+  [[nodiscard]] static bool
+  write(const std::string& path, const VirtualFileTree& tree,
+        std::span<const std::shared_ptr<const LayerListing>> listings,
+        std::uint64_t key, std::string& error);
+
+  /**
+   * @brief Maps an index file into memory and validates its structure
+   * @param error Receives a description of the error if the file cannot be used
+   * @return The index or nullptr on error
+   */
+  [[nodiscard]] static std::unique_ptr<MergedIndex> open(const std::string& path,
+                                                         std::string& error);
+
+  /**
+   * @brief Checks if none of the stamped directories changed since the index was
+   * written
+   */
+  [[nodiscard]] bool isCurrent() const;
+
+  [[nodiscard]] std::uint64_t key() const noexcept { return m_key; }
+
+  /**
+   * @brief Resolves an absolute path
+   * @return The node for the path or invalidNode if it does not exist
+   */
+  [[nodiscard]] NodeId resolve(std::string_view path) const;
+
+  /**
+   * @brief Looks up a direct child of a node
+   * @return The child node or invalidNode if it does not exist
+   */
+  [[nodiscard]] NodeId child(NodeId parent, std::string_view name) const;
+
+  /**
+   * @brief Calls the callback for all direct children of the given node, returning
+   * false from the callback stops the iteration
+   */
+  void forEachChild(NodeId parent, const std::function<bool(NodeId)>& callback) const;
+
+  /**
+   * @brief Walks all descendants of the given node depth-first, parents before their
+   * children. Returning false from the callback stops the walk.
+   * @return false if the walk was stopped
+   */
+  bool walk(NodeId node,
+            const std::function<bool(NodeId, const std::string& path)>& callback) const;
+
+  /**
+   * @brief Returns the absolute path of the given node
+   */
+  [[nodiscard]] std::string path(NodeId id) const;
+
+  /**
+   * @brief Returns the path of the file backing the given node, an empty string for
+   * generated nodes
+   */
+  [[nodiscard]] std::string sourcePath(NodeId id) const;
+
+  [[nodiscard]] const node_t& node(NodeId id) const { return m_nodes[id]; }
+  [[nodiscard]] std::string_view name(NodeId id) const
+  {
+    return view(m_nodes[id].name);
+  }
+  [[nodiscard]] std::string_view layerRoot(LayerId id) const
+  {
+    return view(m_layers[id].root);
+  }
+  [[nodiscard]] std::string_view layerDestination(LayerId id) const
+  {
+    return view(m_layers[id].destination);
+  }
+
+  [[nodiscard]] std::size_t nodeCount() const noexcept { return m_nodes.size(); }
+  [[nodiscard]] std::size_t layerCount() const noexcept { return m_layers.size(); }
+
+private:
+  MergedIndex() = default;
+
+  [[nodiscard]] std::string_view view(stringRef_t ref) const
+  {
+    return {m_strings.data() + ref.offset, ref.size};
+  }
+
+  /**
+   * @brief Checks that all references point into the mapped file and that the tree
+   * has no cycles
+   */
+  [[nodiscard]] bool validate() const;
+
+  void* m_data        = nullptr;
+  std::size_t m_size  = 0;
+  std::uint64_t m_key = 0;
+  std::span<const char> m_strings;
+  std::span<const node_t> m_nodes;
+  std::span<const NodeId> m_buckets;
+  std::span<const layer_t> m_layers;
+  std::span<const stamp_t> m_stamps;
+};
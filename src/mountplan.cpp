@@ -0,0 +1,229 @@
+#include "overlayfs/mountplan.h"
+#include "layerlisting.h"
+
+#include <QDir>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <algorithm>
+
+using namespace std;
+using namespace Qt::StringLiterals;
+
+static QString toString(MountPlan::Backend backend)
+{
+  return backend == MountPlan::Backend::Builtin ? u"builtin"_s : u"fuse-overlayfs"_s;
+}
+
+static optional<MountPlan::Backend> toBackend(const QString& name)
+{
+  if (name == "fuse-overlayfs"_L1) {
+    return MountPlan::Backend::FuseOverlayFs;
+  }
+  if (name == "builtin"_L1) {
+    return MountPlan::Backend::Builtin;
+  }
+  return nullopt;
+}
+
+static QString toString(MountPlan::Method method)
+{
+  switch (method) {
+  case MountPlan::Method::BindMount:
+    return u"bind mount"_s;
+  case MountPlan::Method::Symlink:
+    return u"symlink"_s;
+  default:
+    return u"overlay"_s;
+  }
+}
+
+static optional<MountPlan::Method> toMethod(const QString& name)
+{
+  if (name == "overlay"_L1) {
+    return MountPlan::Method::Overlay;
+  }
+  if (name == "bind mount"_L1) {
+    return MountPlan::Method::BindMount;
+  }
+  if (name == "symlink"_L1) {
+    return MountPlan::Method::Symlink;
+  }
+  return nullopt;
+}
+
+static QStringList toStringList(const QJsonValue& value)
+{
+  QStringList result;
+  for (const QJsonValue& entry : value.toArray()) {
+    result << entry.toString();
+  }
+  return result;
+}
+
+// skipped entries are created inside of the upper dir or skip layer of their target
+static bool isInsideLayer(const QString& path)
+{
+  if (path.isEmpty() || QDir::isAbsolutePath(path)) {
+    return false;
+  }
+  return !path.split(u'/').contains(".."_L1);
+}
+
+bool MountPlan::isCurrent() const
+{
+  return ranges::all_of(m_stamps, [](const stamp_t& stamp) {
+    const LayerListing::DirectoryStamp directory{{}, stamp.inode, stamp.mtime};
+    return LayerListing::isCurrent(stamp.path.toStdString(), directory);
+  });
+}
+
+QByteArray MountPlan::toJson() const
+{
+  QJsonArray targets;
+  for (const Target& target : m_targets) {
+    QJsonObject object;
+    object["method"_L1]     = toString(target.method);
+    object["target"_L1]     = target.target;
+    object["upperDir"_L1]   = target.upperDir;
+    object["lowerDirs"_L1]  = QJsonArray::fromStringList(target.lowerDirs);
+    object["sources"_L1]    = QJsonArray::fromStringList(target.sources);
+    object["prunedDirs"_L1] = QJsonArray::fromStringList(target.prunedDirs);
+    object["whiteouts"_L1]  = QJsonArray::fromStringList(target.whiteouts);
+    object["opaque"_L1]     = QJsonArray::fromStringList(target.opaque);
+    targets.append(object);
+  }
+
+  QJsonArray symlinks;
+  for (const auto& [source, destination] : m_symlinks) {
+    symlinks.append(
+        QJsonObject{{"source"_L1, source}, {"destination"_L1, destination}});
+  }
+
+  // inode numbers and modification times do not fit into a double
+  QJsonArray stamps;
+  for (const auto& [path, inode, mtime] : m_stamps) {
+    stamps.append(QJsonObject{{"path"_L1, path},
+                              {"inode"_L1, QString::number(inode)},
+                              {"mtime"_L1, QString::number(mtime)}});
+  }
+
+  QJsonObject plan;
+  plan["version"_L1]          = version;
+  plan["backend"_L1]          = toString(m_backend);
+  plan["targets"_L1]          = targets;
+  plan["symlinks"_L1]         = symlinks;
+  plan["skipFileSuffixes"_L1] = QJsonArray::fromStringList(m_skipFileSuffixes);
+  plan["skipDirectories"_L1]  = QJsonArray::fromStringList(m_skipDirectories);
+  plan["directories"_L1]      = stamps;
+  return QJsonDocument(plan).toJson(QJsonDocument::Compact);
+}
+
+optional<MountPlan> MountPlan::fromJson(const QByteArray& json, QString& error)
+{
+  QJsonParseError parseError;
+  const QJsonDocument document = QJsonDocument::fromJson(json, &parseError);
+  if (parseError.error != QJsonParseError::NoError) {
+    error = parseError.errorString();
+    return nullopt;
+  }
+
+  const QJsonObject object = document.object();
+  if (object["version"_L1].toInt() != version) {
+    error = u"unsupported version %1"_s.arg(object["version"_L1].toInt());
+    return nullopt;
+  }
+
+  MountPlan plan;
+  const auto backend = toBackend(object["backend"_L1].toString());
+  if (!backend.has_value()) {
+    error = u"unknown backend '%1'"_s.arg(object["backend"_L1].toString());
+    return nullopt;
+  }
+  plan.m_backend = *backend;
+
+  for (const QJsonValue& value : object["targets"_L1].toArray()) {
+    const QJsonObject entry = value.toObject();
+    const auto method       = toMethod(entry["method"_L1].toString());
+    if (!method.has_value()) {
+      error = u"unknown mount method '%1'"_s.arg(entry["method"_L1].toString());
+      return nullopt;
+    }
+
+    Target target;
+    target.method     = *method;
+    target.target     = entry["target"_L1].toString();
+    target.upperDir   = entry["upperDir"_L1].toString();
+    target.lowerDirs  = toStringList(entry["lowerDirs"_L1]);
+    target.sources    = toStringList(entry["sources"_L1]);
+    target.prunedDirs = toStringList(entry["prunedDirs"_L1]);
+    target.whiteouts  = toStringList(entry["whiteouts"_L1]);
+    target.opaque     = toStringList(entry["opaque"_L1]);
+    if (target.target.isEmpty() || target.upperDir.isEmpty()) {
+      error = u"target without a path or upper dir"_s;
+      return nullopt;
+    }
+    // direct mounts use their only source
+    if (target.method != Method::Overlay && target.sources.size() != 1) {
+      error = u"direct mount of '%1' without a single source"_s.arg(target.target);
+      return nullopt;
+    }
+    for (const QString& path : target.whiteouts + target.opaque) {
+      if (!isInsideLayer(path)) {
+        error = u"skipped entry '%1' of '%2' is outside of the target"_s.arg(
+            path, target.target);
+        return nullopt;
+      }
+    }
+    plan.m_targets.push_back(std::move(target));
+  }
+
+  for (const QJsonValue& value : object["symlinks"_L1].toArray()) {
+    const QJsonObject entry = value.toObject();
+    Symlink symlink{entry["source"_L1].toString(), entry["destination"_L1].toString()};
+    if (symlink.source.isEmpty() || symlink.destination.isEmpty()) {
+      error = u"symlink without a source or destination"_s;
+      return nullopt;
+    }
+    plan.m_symlinks.push_back(std::move(symlink));
+  }
+
+  plan.m_skipFileSuffixes = toStringList(object["skipFileSuffixes"_L1]);
+  plan.m_skipDirectories  = toStringList(object["skipDirectories"_L1]);
+
+  for (const QJsonValue& value : object["directories"_L1].toArray()) {
+    const QJsonObject entry = value.toObject();
+    plan.m_stamps.emplace_back(entry["path"_L1].toString(),
+                               entry["inode"_L1].toString().toULongLong(),
+                               entry["mtime"_L1].toString().toLongLong());
+  }
+
+  return plan;
+}
+
+bool MountPlan::save(const QString& file, QString& error) const
+{
+  QSaveFile saveFile(file);
+  if (!saveFile.open(QIODevice::WriteOnly)) {
+    error = saveFile.errorString();
+    return false;
+  }
+  saveFile.write(toJson());
+  if (!saveFile.commit()) {
+    error = saveFile.errorString();
+    return false;
+  }
+  return true;
+}
+
+optional<MountPlan> MountPlan::load(const QString& file, QString& error)
+{
+  QFile planFile(file);
+  if (!planFile.open(QIODevice::ReadOnly)) {
+    error = planFile.errorString();
+    return nullopt;
+  }
+  return fromJson(planFile.readAll(), error);
+}
@@ -1,20 +1,46 @@
 #include "overlayfs/overlayfsmanager.h"
-
+#include "layerlisting.h"
+#include "mergedindex.h"
+#ifdef OVERLAYFS_BUILTIN_BACKEND
+#include "fusebackend.h"
+#endif
+#include "parallel.h"
+#include "qtformatters.h"
+#include "tracer.h"
+#include "virtualfiletree.h"
+
+#include <QCryptographicHash>
 #include <QDirIterator>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QProcess>
+#include <QSaveFile>
+#include <chrono>
 #include <cstring>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <ranges>
 #include <set>
+#include <unordered_map>
 #include <spawn.h>
+#include <linux/capability.h>
+#include <sys/file.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/sysmacros.h>
 #include <unistd.h>
 #include <utility>
 #include <wait.h>
 
+#include <spdlog/async.h>
+#include <spdlog/details/periodic_worker.h>
 #include <spdlog/sinks/basic_file_sink.h>
+#include <spdlog/sinks/callback_sink.h>
 #include <spdlog/sinks/dist_sink.h>
 #include <spdlog/sinks/stdout_sinks.h>
 #include <spdlog/spdlog.h>
@@ -23,42 +49,237 @@ using namespace std;
 namespace fs = std::filesystem;
 using namespace Qt::StringLiterals;
 
-// process wait timeout in msec
-static inline constexpr int timeout = 10'000;
+// number of messages the asynchronous logger queues before callers are blocked
+static inline constexpr size_t asyncLogQueueSize = 8192;
+
+// interval the asynchronous logger writes its files in
+static inline constexpr chrono::seconds asyncLogFlushInterval(1);
 
 // file suffix that is added when renaming a file
 static inline constexpr auto renamedSuffix = ".mo-renamed"_L1;
 
+// number of skip layers to keep in the skip layer cache
+static inline constexpr qsizetype skipLayerCacheSize = 8;
+
+// number of base layers to keep in the base layer cache
+static inline constexpr qsizetype baseLayerCacheSize = 16;
+
+// number of file tree indices to keep in the index cache
+static inline constexpr qsizetype indexCacheSize = 16;
+
+// suffix of cached layers that are still being built
+static inline constexpr auto buildSuffix = "_tmp"_L1;
+
+// minimum number of lower dirs that are merged into a base layer
+static inline constexpr qsizetype minBaseLayerDirs = 2;
+
+// file marking a directory as opaque, hiding the contents of all lower layers
+static inline constexpr auto opaqueMarker = ".wh..wh..opq"_L1;
+
+// checks if the given path is a whiteout file (a character device with device number
+// 0/0) or an opaque directory marker
+static bool isWhiteoutFile(const QString& path)
+{
+  struct stat st{};
+  if (lstat(path.toStdString().c_str(), &st) != 0) {
+    return false;
+  }
+  if (S_ISREG(st.st_mode)) {
+    return st.st_size == 0 && path.endsWith(opaqueMarker);
+  }
+  return S_ISCHR(st.st_mode) && st.st_rdev == makedev(0, 0);
+}
+
+// creates a whiteout file, or an empty file if path is an opaque directory marker
+static bool createWhiteoutFile(const fs::path& path)
+{
+  if (path.filename() == opaqueMarker.data()) {
+    const int fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    close(fd);
+    return true;
+  }
+  // create a character device with device number 0/0
+  return mknod(path.c_str(), S_IFCHR, makedev(0, 0)) == 0;
+}
+
+static OverlayFsManager::DumpEntry::Type toDumpEntryType(LayerListing::EntryType type)
+{
+  switch (type) {
+  case LayerListing::EntryType::File:
+    return OverlayFsManager::DumpEntry::Type::File;
+  case LayerListing::EntryType::Directory:
+    return OverlayFsManager::DumpEntry::Type::Directory;
+  case LayerListing::EntryType::Symlink:
+    return OverlayFsManager::DumpEntry::Type::Symlink;
+  default:
+    return OverlayFsManager::DumpEntry::Type::Other;
+  }
+}
+
+// checks which layers provide no visible entries and hide nothing in lower layers,
+// leaving them out does not change the merged view
+static vector<bool> findUnusedLayers(span<const shared_ptr<const LayerListing>> layers)
+{
+  vector<bool> unused(layers.size());
+  for (size_t i = 0; i < layers.size(); ++i) {
+    unused[i] = ranges::none_of(layers[i]->entries(), [](const auto& entry) {
+      return entry.type == LayerListing::EntryType::Whiteout ||
+             entry.type == LayerListing::EntryType::OpaqueDirectory;
+    });
+  }
+
+  mergeLayers(layers, [&](const LayerListing::Entry&, size_t layer) {
+    unused[layer] = false;
+    return true;
+  });
+  return unused;
+}
+
+// checks if the process is allowed to create bind mounts
+static bool hasMountCapability()
+{
+  __user_cap_header_struct header{_LINUX_CAPABILITY_VERSION_3, 0};
+  __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3]{};
+  if (syscall(SYS_capget, &header, data) != 0) {
+    return false;
+  }
+  const auto index = CAP_TO_INDEX(CAP_SYS_ADMIN);
+  return (data[index].effective & CAP_TO_MASK(CAP_SYS_ADMIN)) != 0;
+}
+
+// locks the lock file next to a cached layer with the given flock() operation, managers
+// sharing a cache directory hold a shared lock on every layer they use and a layer is
+// only removed while holding an exclusive lock, returns null if the lock is not taken
+static shared_ptr<QFile> lockLayer(const QString& layerPath, int operation)
+{
+  for (;;) {
+    auto file = make_shared<QFile>(layerPath % ".lock"_L1);
+    if (!file->open(QIODevice::ReadWrite) || flock(file->handle(), operation) != 0) {
+      return nullptr;
+    }
+
+    // the lock file is removed together with its layer, a lock taken on a removed file
+    // does not protect anything and is retried on a new file
+    struct stat locked{};
+    struct stat current{};
+    if (fstat(file->handle(), &locked) == 0 &&
+        stat(file->fileName().toStdString().c_str(), &current) == 0 &&
+        locked.st_ino == current.st_ino) {
+      return file;
+    }
+  }
+}
+
+// adds the time from its construction to its destruction as a phase, and as an event
+// if tracing is enabled
+class PhaseTimer
+{
+public:
+  PhaseTimer(OverlayFsManager::Statistics& statistics, Tracer* tracer, QString name)
+      : m_statistics(statistics),
+        m_event(tracer, tracer != nullptr ? name.toStdString() : string(), "phase"),
+        m_name(std::move(name)), m_start(chrono::steady_clock::now())
+  {}
+
+  ~PhaseTimer()
+  {
+    m_statistics.phases.emplace_back(std::move(m_name),
+                                     chrono::steady_clock::now() - m_start);
+  }
+
+  PhaseTimer(const PhaseTimer&)            = delete;
+  PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+private:
+  OverlayFsManager::Statistics& m_statistics;
+  Tracer::Scope m_event;
+  QString m_name;
+  chrono::steady_clock::time_point m_start;
+};
+
+static QStringList toStringList(const QJsonValue& value)
+{
+  QStringList result;
+  for (const QJsonValue& entry : value.toArray()) {
+    result << entry.toString();
+  }
+  return result;
+}
+
 void OverlayFsManager::setLogLevel(spdlog::level::level_enum level) noexcept
 {
+  scoped_lock dataLock(m_dataMutex);
+
   m_logger->debug("setting log level to {}", spdlog::level::to_string_view(level));
   m_loglevel = level;
-  m_logger->set_level(level);
+  applyLogLevel();
+}
+
+void OverlayFsManager::applyLogLevel() noexcept
+{
+  // errors always reach the error sink, the other sinks filter by the level
+  for (const auto& sink : m_logger->sinks()) {
+    if (sink != m_errorSink) {
+      sink->set_level(m_loglevel);
+    }
+  }
+  m_logger->set_level(min(m_loglevel, spdlog::level::err));
 }
 
 bool OverlayFsManager::isMounted() noexcept
 {
-  // lock in case a mount operation is pending
-  scoped_lock mountLock(m_mountMutex);
-  return m_mounted;
+  return m_status.load()->mounted;
+}
+
+shared_ptr<const OverlayFsManager::Status> OverlayFsManager::status() const noexcept
+{
+  return m_status.load();
+}
+
+void OverlayFsManager::publishStatus() noexcept
+{
+  vector<Status::Target> targets;
+  targets.reserve(m_mounts.size());
+  for (const auto& mount : m_mounts) {
+    targets.emplace_back(mount.target, mount.mounted);
+  }
+
+  updateStatus([&](Status& status) {
+    status.mounted = m_mounted;
+    status.targets = targets;
+  });
+}
+
+void OverlayFsManager::updateStatus(const function<void(Status&)>& update) noexcept
+{
+  shared_ptr<const Status> current = m_status.load();
+  shared_ptr<const Status> next;
+  do {
+    auto status = make_shared<Status>(*current);
+    update(*status);
+    next = std::move(status);
+  } while (!m_status.compare_exchange_weak(current, next));
 }
 
 void OverlayFsManager::setWorkDir(const QString& directory, bool create) noexcept
 {
   scoped_lock dataLock(m_dataMutex);
 
-  m_logger->debug("setting work dir to '{}'", directory.toStdString());
+  m_logger->debug("setting work dir to '{}'", directory);
 
   QDir dir(directory);
   if (!dir.exists()) {
     if (create) {
       if (!dir.mkpath(u"."_s)) {
-        m_logger->error("Error creating directory {}", directory.toStdString());
+        m_logger->error("Error creating directory {}", directory);
         return;
       }
       m_workDir = directory;
     } else {
-      m_logger->error("Directory '{}' does not exist", directory.toStdString());
+      m_logger->error("Directory '{}' does not exist", directory);
     }
   } else {
     m_workDir = directory;
@@ -71,29 +292,34 @@ void OverlayFsManager::setUpperDir(const QString& directory, bool create) noexce
 
   QDir dir(directory);
 
-  m_logger->debug("setting upper dir to '{}'", directory.toStdString());
+  m_logger->debug("setting upper dir to '{}'", directory);
   if (!dir.exists()) {
     if (create) {
       if (!dir.mkpath(u"."_s)) {
-        m_logger->error("Error creating directory {}", directory.toStdString());
+        m_logger->error("Error creating directory {}", directory);
         return;
       }
       m_upperDir = directory;
     } else {
-      m_logger->error("Directory '{}' does not exist", directory.toStdString());
+      m_logger->error("Directory '{}' does not exist", directory);
     }
   } else {
     m_upperDir = directory;
   }
+  m_treeOutdated = true;
 }
 
 bool OverlayFsManager::addFile(const QString& source,
                                const QString& destination) noexcept
 {
   scoped_lock dataLock(m_dataMutex);
+  m_treeOutdated = true;
 
-  m_logger->debug("adding file '{}' with destination '{}'", source.toStdString(),
-                  destination.toStdString());
+  m_logger->debug("adding file '{}' with destination '{}'", source, destination);
+  Tracer::Scope event(m_tracer.get(), "add file", "mapping", [&] {
+    return Tracer::Args{{"source", source.toStdString()},
+                        {"destination", destination.toStdString()}};
+  });
 
   QFileInfo src(source);
   QFileInfo dst(destination);
@@ -123,9 +349,13 @@ bool OverlayFsManager::addDirectory(const QString& source,
                                     const QString& destination) noexcept
 {
   scoped_lock dataLock(m_dataMutex);
+  m_treeOutdated = true;
 
-  m_logger->debug("adding directory '{}' with destination '{}'", source.toStdString(),
-                  destination.toStdString());
+  m_logger->debug("adding directory '{}' with destination '{}'", source, destination);
+  Tracer::Scope event(m_tracer.get(), "add directory", "mapping", [&] {
+    return Tracer::Args{{"source", source.toStdString()},
+                        {"destination", destination.toStdString()}};
+  });
 
   QFileInfo src(source);
   QFileInfo dst(destination);
@@ -133,7 +363,7 @@ bool OverlayFsManager::addDirectory(const QString& source,
   if (!src.exists()) {
     // create the source if it does not exist
     if (!QDir(source).mkpath(u"."_s)) {
-      m_logger->error("error creating directory '{}'", source.toStdString());
+      m_logger->error("error creating directory '{}'", source);
       return false;
     }
   } else if (!src.isDir()) {
@@ -144,7 +374,7 @@ bool OverlayFsManager::addDirectory(const QString& source,
   if (!dst.exists()) {
     // create the destination if it does not exist
     if (!QDir(destination).mkpath(u"."_s)) {
-      m_logger->error("error creating directory '{}'", destination.toStdString());
+      m_logger->error("error creating directory '{}'", destination);
       return false;
     }
   } else if (!dst.isDir()) {
@@ -165,590 +395,2589 @@ bool OverlayFsManager::addDirectory(const QString& source,
 }
 
 QStringList OverlayFsManager::createOverlayFsDump() noexcept
+{
+  QStringList result;
+
+  createOverlayFsDump([&result](span<const DumpEntry> entries) {
+    for (const DumpEntry& entry : entries) {
+      result << entry.path;
+    }
+    return true;
+  });
+
+  result.squeeze();
+  return result;
+}
+
+bool OverlayFsManager::createOverlayFsDump(const DumpCallback& callback,
+                                           qsizetype chunkSize) noexcept
 {
   scoped_lock mountLock(m_mountMutex);
   scoped_lock dataLock(m_dataMutex);
 
-  m_logger->debug("creating overlayfs dump");
-  QStringList result;
-  result.reserve(1000);
-
-  bool wasMounted = m_mounted;
+  vector<DumpEntry> chunk;
+  chunk.reserve(static_cast<size_t>(max<qsizetype>(chunkSize, 1)));
 
-  if (!mountInternal()) {
+  const auto addEntry = [&](QString path, DumpEntry::Type type, qint64 size) {
+    chunk.emplace_back(std::move(path), type, size);
+    if (static_cast<qsizetype>(chunk.size()) < chunkSize) {
+      return true;
+    }
+    const bool result = callback(chunk);
+    chunk.clear();
     return result;
-  }
+  };
 
-  for (const auto& mount : m_mounts) {
-    QDirIterator iter(mount.target, QDirIterator::Subdirectories);
-    while (iter.hasNext()) {
-      result << iter.next();
-    }
+  bool completed = m_mounted ? dumpMounted(addEntry) : dumpOffline(addEntry);
+
+  if (completed && !chunk.empty()) {
+    completed = callback(chunk);
   }
 
-  if (!wasMounted) {
-    if (!umountInternal()) {
-      m_logger->error("error unmounting after overlayfs dump");
-    }
+  if (!completed) {
+    m_logger->debug("overlayfs dump stopped");
   }
 
-  result.squeeze();
-  return result;
+  return completed;
 }
 
-void OverlayFsManager::setLogFile(const QString& file) noexcept
+bool OverlayFsManager::dumpMounted(const DumpEntryCallback& addEntry) noexcept
 {
-  scoped_lock dataLock(m_dataMutex);
+  m_logger->debug("creating overlayfs dump from mounted targets");
 
-  m_logger->debug("setting log file to '{}'", file.toStdString());
-  m_logFile = file;
-  createLogger();
-}
+  for (const auto& mount : m_mounts) {
+    QDirIterator iter(mount.target,
+                      QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden |
+                          QDir::System,
+                      QDirIterator::Subdirectories);
+    while (iter.hasNext()) {
+      const QFileInfo info = iter.nextFileInfo();
+
+      DumpEntry::Type type = DumpEntry::Type::Other;
+      if (info.isSymLink()) {
+        type = DumpEntry::Type::Symlink;
+      } else if (info.isDir()) {
+        type = DumpEntry::Type::Directory;
+      } else if (info.isFile()) {
+        type = DumpEntry::Type::File;
+      }
 
-void OverlayFsManager::addSkipFileSuffix(const QString& fileSuffix) noexcept
-{
-  scoped_lock dataLock(m_dataMutex);
+      if (!addEntry(info.filePath(), type,
+                    type == DumpEntry::Type::File ? info.size() : 0)) {
+        return false;
+      }
+    }
+  }
 
-  m_logger->debug("added skip file suffix '{}'", fileSuffix.toStdString());
-  m_fileSuffixBlacklist.emplace_back(fileSuffix);
+  return true;
 }
 
-void OverlayFsManager::clearSkipFileSuffixes() noexcept
+template <class Callback>
+bool OverlayFsManager::withFileTree(Callback&& callback) noexcept
 {
-  scoped_lock dataLock(m_dataMutex);
-
-  m_logger->debug("clearing skip file suffixes");
-  m_fileSuffixBlacklist.clear();
+  if (!updateFileTree()) {
+    return false;
+  }
+  if (m_virtualFileTree != nullptr) {
+    callback(*m_virtualFileTree);
+  } else {
+    callback(*m_treeIndex);
+  }
+  return true;
 }
 
-void OverlayFsManager::addSkipDirectory(const QString& directory) noexcept
+bool OverlayFsManager::dumpOffline(const DumpEntryCallback& addEntry) noexcept
 {
-  scoped_lock dataLock(m_dataMutex);
+  m_logger->debug("creating overlayfs dump from layer listings");
 
-  m_logger->debug("added skip directory '{}'", directory.toStdString());
-  m_directoryBlacklist.emplace_back(directory);
-}
+  bool completed = true;
+  const bool found = withFileTree([&](const auto& tree) {
+    for (const QString& target : m_treeTargets) {
+      const auto targetNode = tree.resolve(target.toStdString());
+      if (targetNode == VirtualFileTree::invalidNode) {
+        continue;
+      }
 
-void OverlayFsManager::clearSkipDirectories() noexcept
-{
-  scoped_lock dataLock(m_dataMutex);
+      completed =
+          tree.walk(targetNode, [&](VirtualFileTree::NodeId id, const string& path) {
+            const auto& node = tree.node(id);
+            return addEntry(QString::fromStdString(path), toDumpEntryType(node.type),
+                            static_cast<qint64>(node.size));
+          });
 
-  m_logger->debug("clearing skip directories");
-  m_directoryBlacklist.clear();
+      if (!completed) {
+        return;
+      }
+    }
+  });
+
+  return found && completed;
 }
 
-void OverlayFsManager::forceLoadLibrary(const QString& processName,
-                                        const QString& libraryPath) noexcept
+QString OverlayFsManager::resolve(const QString& virtualPath) noexcept
 {
+  scoped_lock mountLock(m_mountMutex);
   scoped_lock dataLock(m_dataMutex);
 
-  m_logger->debug("adding forced library '{}' for process '{}'",
-                  libraryPath.toStdString(), processName.toStdString());
-  m_forceLoadLibraries.emplace_back(processName, libraryPath);
+  QString source;
+  (void)withFileTree([&](const auto& tree) {
+    const auto node = tree.resolve(QDir::cleanPath(virtualPath).toStdString());
+    if (node != VirtualFileTree::invalidNode) {
+      source = QString::fromStdString(tree.sourcePath(node));
+    }
+  });
+  return source;
 }
 
-void OverlayFsManager::clearLibraryForceLoads() noexcept
+vector<OverlayFsManager::DirectoryEntry>
+OverlayFsManager::listDirectory(const QString& virtualPath) noexcept
 {
+  scoped_lock mountLock(m_mountMutex);
   scoped_lock dataLock(m_dataMutex);
 
-  m_logger->debug("clearing forced libraries");
-  m_forceLoadLibraries.clear();
+  vector<DirectoryEntry> result;
+
+  (void)withFileTree([&](const auto& tree) {
+    const auto directory = tree.resolve(QDir::cleanPath(virtualPath).toStdString());
+    if (directory == VirtualFileTree::invalidNode) {
+      return;
+    }
+
+    tree.forEachChild(directory, [&](VirtualFileTree::NodeId id) {
+      const auto& node = tree.node(id);
+      const string_view name = tree.name(id);
+      result.emplace_back(
+          QString::fromUtf8(name.data(), static_cast<qsizetype>(name.size())),
+          toDumpEntryType(node.type), static_cast<qint64>(node.size),
+          QString::fromStdString(tree.sourcePath(id)));
+      return true;
+    });
+  });
+
+  return result;
 }
 
-void OverlayFsManager::clearMappings() noexcept
+OverlayFsManager::Statistics OverlayFsManager::lastRunStatistics() noexcept
 {
   scoped_lock dataLock(m_dataMutex);
 
-  m_map.clear();
-  m_fileMap.clear();
+  return m_lastRunStatistics;
 }
 
-void OverlayFsManager::dryrun() noexcept
+vector<OverlayFsManager::ConflictReport> OverlayFsManager::createConflictReport() noexcept
 {
-  m_logger->info("would mount");
-
-  if (m_map.empty()) {
-    m_logger->info("nothing");
-    return;
+  planInput_t input;
+  {
+    scoped_lock dataLock(m_dataMutex);
+    input = planInput();
   }
 
-  m_logger->info("");
+  // the source directories are scanned without blocking changes of the mappings
+  shared_lock loggingLock(m_loggingMutex);
 
-  if (!prepareMounts()) {
-    m_logger->error("error preparing mounts");
-    return;
+  m_logger->debug("creating conflict report");
+
+  vector<layerStack_t> stacks;
+  if (!createLayerStacks(input, stacks)) {
+    return {};
   }
 
-  int i = 0;
-  for (const auto& mount : m_mounts) {
-    QString lowerDirs;
+  const SkipRules rules = skipRules(input);
+  scanLayers(stacks, rules);
 
-    m_logger->info(" . {}", i++);
+  vector<ConflictReport> reports(stacks.size());
+  parallelFor(stacks.size(), [&](size_t index) {
+    const layerStack_t& stack = stacks[index];
+    ConflictReport& report    = reports[index];
+    report.destination        = stack.target;
 
-    for (const QString& lowerDir : mount.lowerDirs) {
-      m_logger->info("   . {} -> {}", lowerDir.toStdString(),
-                     mount.target.toStdString());
-      lowerDirs += lowerDir % ":"_L1;
+    // listings of all lower dirs in priority order, already cached by scanLayers()
+    vector<shared_ptr<const LayerListing>> listings;
+    for (const QString& lowerDir : stack.lowerDirs) {
+      listings.push_back(m_layerCache->get(lowerDir.toStdString(), rules));
+      report.sources.emplace_back(lowerDir);
     }
-    if (!mount.whiteout.empty()) {
-      m_logger->info("ignored files/directories:");
-      for (const auto& whiteout : mount.whiteout) {
-        m_logger->info("   . {}", whiteout.toStdString());
+
+    // indices of all lower dirs providing a file, from highest to lowest priority
+    unordered_map<string_view, vector<uint32_t>> providers;
+    for (size_t layer = 0; layer < listings.size(); ++layer) {
+      for (const LayerListing::Entry& entry : listings[layer]->entries()) {
+        if (entry.type == LayerListing::EntryType::File ||
+            entry.type == LayerListing::EntryType::Symlink) {
+          providers[entry.path].push_back(static_cast<uint32_t>(layer));
+        }
       }
     }
-    lowerDirs.chop(1);
-  }
-}
 
-bool OverlayFsManager::mount() noexcept
-{
-  scoped_lock mountLock(m_mountMutex);
-  scoped_lock dataLock(m_dataMutex);
+    for (const auto& [path, layers] : providers) {
+      if (layers.size() < 2) {
+        continue;
+      }
+
+      FileConflict& conflict = report.files.emplace_back();
+      conflict.path = QString::fromUtf8(path.data(), static_cast<qsizetype>(path.size()));
+      for (size_t i = 0; i < layers.size(); ++i) {
+        SourceConflicts& source = report.sources[layers[i]];
+        conflict.sources << source.source;
+        if (i == 0) {
+          ++source.overriding;
+        } else {
+          ++source.overridden;
+          if (i + 1 < layers.size()) {
+            ++source.overriding;
+          }
+        }
+      }
+    }
+
+    ranges::sort(report.files, [](const FileConflict& lhs, const FileConflict& rhs) {
+      return lhs.path < rhs.path;
+    });
+  });
 
-  return mountInternal();
+  return reports;
 }
 
-bool OverlayFsManager::umount() noexcept
+void OverlayFsManager::scanLayers(const vector<layerStack_t>& stacks,
+                                  const SkipRules& rules) noexcept
 {
-  scoped_lock mountLock(m_mountMutex);
-  scoped_lock dataLock(m_dataMutex);
+  set<QString> roots;
+  for (const auto& stack : stacks) {
+    // the upper dir is a source unless it is the target itself
+    roots.insert(stack.sources.begin(), stack.sources.end());
+  }
 
-  return umountInternal();
+  // the layers are checked for changes once here, later lookups use the same listings
+  m_layerCache->revalidate();
+
+  const vector<QString> rootList(roots.begin(), roots.end());
+  parallelFor(rootList.size(), [&](size_t i) {
+    const string root = rootList[i].toStdString();
+    Tracer::Scope event(m_tracer.get(), "scan", "scan", [&] {
+      return Tracer::Args{{"source", root}};
+    });
+    (void)m_layerCache->get(root, rules);
+  });
 }
 
-bool OverlayFsManager::createProcess(const QString& applicationName,
-                                     const QString& commandLine) noexcept
+bool OverlayFsManager::updateFileTree() noexcept
 {
-  scoped_lock dataLock(m_dataMutex);
-  scoped_lock mountLock(m_mountMutex);
-
-  m_logger->debug("creating process '{}' with commandline '{}'",
-                  applicationName.toStdString(), commandLine.toStdString());
-  if (!m_mounted) {
-    if (!mountInternal()) {
-      m_logger->error("Not starting process because mount failed");
+  // the targets cannot be scanned while they are mounted, use the last tree instead
+  if (m_mounted) {
+    if (m_virtualFileTree == nullptr && m_treeIndex == nullptr) {
+      m_logger->error("file tree is not available while mounted");
       return false;
     }
+    return true;
   }
 
-  // todo: implement handling of m_forceLoadLibraries
+  const planInput_t input = planInput();
+  vector<layerStack_t> stacks;
+  if (!createLayerStacks(input, stacks)) {
+    return false;
+  }
 
-  auto p = make_unique<QProcess>();
-  p->setProgram(applicationName);
-  p->setArguments(QProcess::splitCommand(commandLine));
-  p->start();
-  if (p->waitForStarted()) {
-    m_logger->debug("created process with pid {}", p->processId());
+  const uint64_t key = indexKey(stacks, input);
+  if (openIndex(stacks, key)) {
+    return true;
+  }
 
-    QObject::connect(p.get(), &QProcess::finished, [this] {
-      m_logger->debug("process finished, unmounting");
-      umount();
-    });
+  const SkipRules rules = skipRules(input);
+  scanLayers(stacks, rules);
+
+  const vector<MountPlan::Symlink> symlinks = fileSymlinks(input);
+  vector<pair<QString, vector<LayerSource>>> sources;
+  vector<shared_ptr<const LayerListing>> listings;
+  for (auto& stack : stacks) {
+    addSkippedEntries(stack, rules);
+    auto layers = layerSources(stack, symlinks, rules);
+    for (const auto& layer : layers) {
+      listings.push_back(layer.listing);
+    }
+    sources.emplace_back(stack.target, std::move(layers));
+  }
 
-    m_startedProcesses.emplace_back(std::move(p));
+  // listings of all layers in the order of the tree, for the index
+  const vector<shared_ptr<const LayerListing>> layerListings = listings;
+
+  // generated layers are recreated every time, so only the scanned ones are compared
+  const auto isScanned = [](const shared_ptr<const LayerListing>& listing) {
+    return listing->fingerprint() != 0;
+  };
+  erase_if(listings, [&](const auto& listing) {
+    return !isScanned(listing);
+  });
+
+  if (m_virtualFileTree != nullptr && !m_treeOutdated && listings == m_treeListings) {
     return true;
   }
 
-  m_logger->error("error creating process: {}", p->errorString().toStdString());
-  return false;
-}
-
-const char* OverlayFsManager::ofsVersionString() noexcept
-{
-  return "1.0.0";
-}
+  m_logger->debug("building file tree for {} targets", sources.size());
 
-void OverlayFsManager::setDebugMode(bool value) noexcept
-{
-  m_debuggingMode = value;
-}
+  auto tree = make_unique<VirtualFileTree>();
+  m_treeTargets.clear();
+  for (const auto& [target, layers] : sources) {
+    tree->addLayers(target.toStdString(), layers);
+    m_treeTargets << target;
+  }
 
-std::vector<pid_t> OverlayFsManager::getOverlayFsProcessList() const noexcept
-{
-  vector<pid_t> pids;
-  pids.reserve(m_startedProcesses.size());
+  m_logger->debug("file tree has {} nodes in {} layers", tree->nodeCount(),
+                  tree->layerCount());
 
-  for (const auto& p : m_startedProcesses) {
-    pids.push_back(static_cast<pid_t>(p->processId()));
+  m_treeIndex.reset();
+  if (!m_indexCacheDir.isEmpty()) {
+    const string path = indexPath(key);
+    string error;
+    if (MergedIndex::write(path, *tree, layerListings, key, error)) {
+      m_treeIndex = MergedIndex::open(path, error);
+    }
+    if (m_treeIndex == nullptr) {
+      m_logger->warn("error writing file tree index: {}", error);
+    }
+    trimIndexCache();
   }
 
-  return pids;
+  m_virtualFileTree = std::move(tree);
+  m_treeListings    = std::move(listings);
+  m_treeOutdated    = false;
+  return true;
 }
 
-OverlayFsManager::OverlayFsManager(QString file) noexcept
-    : m_loglevel(spdlog::level::warn), m_logFile(std::move(file))
+bool OverlayFsManager::openIndex(const vector<layerStack_t>& stacks,
+                                 uint64_t key) noexcept
 {
-  createLogger();
-}
+  if (m_indexCacheDir.isEmpty()) {
+    return false;
+  }
+
+  // the index stays open as long as it describes the current tree
+  if (m_treeIndex != nullptr && m_treeIndex->key() == key && m_treeIndex->isCurrent()) {
+    m_treeOutdated = false;
+    return true;
+  }
+  m_treeIndex.reset();
+
+  const string path = indexPath(key);
+  if (!fs::exists(path)) {
+    return false;
+  }
+
+  string error;
+  auto index = MergedIndex::open(path, error);
+  if (index == nullptr) {
+    m_logger->warn("ignoring file tree index: {}", error);
+    return false;
+  }
+  if (index->key() != key || !index->isCurrent()) {
+    m_logger->debug("file tree index '{}' is outdated", path);
+    return false;
+  }
+
+  // update the modification time to keep recently used indices in the cache
+  utimes(path.c_str(), nullptr);
+
+  // lookups are answered from the mapped file
+  m_virtualFileTree.reset();
+  m_treeIndex = std::move(index);
+  m_treeTargets.clear();
+  for (const auto& stack : stacks) {
+    m_treeTargets << stack.target;
+  }
+  // nothing was scanned, the next tree without an index is rebuilt
+  m_treeListings.clear();
+  m_treeOutdated = false;
+
+  m_logger->debug("opened file tree index with {} nodes from '{}'",
+                  m_treeIndex->nodeCount(), path);
+  return true;
+}
+
+uint64_t OverlayFsManager::indexKey(const vector<layerStack_t>& stacks,
+                                    const planInput_t& input) const
+{
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  const auto addString = [&](const QString& value) {
+    hash.addData(value.toUtf8());
+    hash.addData("\0"_ba);
+  };
+
+  for (const auto& stack : stacks) {
+    addString(stack.target);
+    addString(stack.upperDir);
+    for (const QString& lowerDir : stack.lowerDirs) {
+      addString(lowerDir);
+    }
+    for (const QString& source : stack.sources) {
+      addString(source);
+    }
+    hash.addData("\n"_ba);
+  }
+  for (const auto& [source, destination] : input.fileMap) {
+    addString(source.absoluteFilePath());
+    addString(destination.absoluteFilePath());
+  }
+  for (const QString& suffix : input.fileSuffixBlacklist) {
+    addString(suffix);
+  }
+  hash.addData("\n"_ba);
+  for (const QString& directory : input.directoryBlacklist) {
+    addString(directory);
+  }
+
+  uint64_t key = 0;
+  memcpy(&key, hash.result().constData(), sizeof(key));
+  return key;
+}
+
+string OverlayFsManager::indexPath(uint64_t key) const
+{
+  return (m_indexCacheDir % "/"_L1 % QString::number(key, 16).rightJustified(16, u'0') %
+          ".idx"_L1)
+      .toStdString();
+}
+
+void OverlayFsManager::trimIndexCache() noexcept
+{
+  const QString current =
+      m_treeIndex != nullptr
+          ? QFileInfo(QString::fromStdString(indexPath(m_treeIndex->key())))
+                .absoluteFilePath()
+          : QString();
+
+  // remove the least recently used indices, the open index is kept and removing an
+  // index mapped by another process does not affect its mapping
+  const QFileInfoList indices =
+      QDir(m_indexCacheDir).entryInfoList({u"*.idx"_s}, QDir::Files, QDir::Time);
+  for (qsizetype i = indexCacheSize; i < indices.size(); ++i) {
+    const QString path = indices[i].absoluteFilePath();
+    if (path == current) {
+      continue;
+    }
+    m_logger->debug("removing cached file tree index '{}'", path);
+    QFile::remove(path);
+  }
+}
+
+vector<LayerSource>
+OverlayFsManager::layerSources(const layerStack_t& stack,
+                               const vector<MountPlan::Symlink>& symlinks,
+                               const SkipRules& rules) noexcept
+{
+  const string target = stack.target.toStdString();
+
+  vector<LayerSource> layers;
+  vector<string> skippedFiles;
+  vector<string> skippedDirectories;
+  for (const QString& file : stack.whiteouts) {
+    skippedFiles.push_back(file.toStdString());
+  }
+  for (const QString& directory : stack.opaque) {
+    skippedDirectories.push_back(directory.toStdString());
+  }
+
+  // symlinks are created in the target before mounting, every symlink is a layer of
+  // its own so it resolves to its source file
+  vector<LayerSource> symlinkLayers;
+  const QString prefix = stack.target % "/"_L1;
+  for (const auto& [source, linkName] : symlinks) {
+    if (linkName.startsWith(prefix)) {
+      vector<LayerListing::Entry> entries;
+      entries.emplace_back(linkName.sliced(prefix.size()).toStdString(),
+                           LayerListing::EntryType::Symlink, 0);
+      symlinkLayers.emplace_back(
+          LayerListing::create(source.toStdString(), std::move(entries)),
+          linkName.toStdString());
+    }
+  }
+
+  // a target that is its own upper dir has the highest priority, like the upper dir of
+  // fuse-overlayfs, otherwise it is the lowest layer:
+  // upper dir, skip layer, lower dirs and the target including its symlinks
+  const bool targetIsUpper = stack.upperDir == stack.target;
+  if (targetIsUpper) {
+    ranges::move(symlinkLayers, back_inserter(layers));
+    layers.emplace_back(m_layerCache->get(target, {}), target);
+  } else {
+    layers.emplace_back(m_layerCache->get(stack.upperDir.toStdString(), rules), target);
+  }
+
+  if (!skippedFiles.empty() || !skippedDirectories.empty()) {
+    ranges::sort(skippedFiles);
+    skippedFiles.erase(ranges::unique(skippedFiles).begin(), skippedFiles.end());
+    ranges::sort(skippedDirectories);
+    skippedDirectories.erase(ranges::unique(skippedDirectories).begin(),
+                             skippedDirectories.end());
+    layers.emplace_back(LayerListing::createSkipLayer(skippedFiles, skippedDirectories),
+                        target);
+  }
+
+  for (const QString& lowerDir : stack.lowerDirs) {
+    layers.emplace_back(m_layerCache->get(lowerDir.toStdString(), rules), target);
+  }
+
+  if (!targetIsUpper) {
+    ranges::move(symlinkLayers, back_inserter(layers));
+    layers.emplace_back(m_layerCache->get(target, {}), target);
+  }
+
+  return layers;
+}
+
+void OverlayFsManager::setAsyncLogging(bool enabled) noexcept
+{
+  scoped_lock mountLock(m_mountMutex);
+  scoped_lock dataLock(m_dataMutex);
+  scoped_lock loggingLock(m_loggingMutex);
+
+  m_logger->debug("{} asynchronous logging", enabled ? "enabling" : "disabling");
+  if (enabled != m_asyncLogging) {
+    m_asyncLogging = enabled;
+    createLogger();
+  }
+}
+
+void OverlayFsManager::setTraceFile(const QString& file) noexcept
+{
+  scoped_lock mountLock(m_mountMutex);
+  scoped_lock dataLock(m_dataMutex);
+  scoped_lock loggingLock(m_loggingMutex);
+
+  m_logger->debug("setting trace file to '{}'", file);
+  m_traceFile = file;
+  if (file.isEmpty()) {
+    m_tracer.reset();
+  } else if (m_tracer == nullptr) {
+    m_tracer = make_shared<Tracer>();
+  }
+}
+
+void OverlayFsManager::writeTrace() noexcept
+{
+  // keeps the trace of the last session if nothing happened since
+  if (m_tracer == nullptr || m_tracer->empty()) {
+    return;
+  }
+
+  string error;
+  if (!m_tracer->write(m_traceFile.toStdString(), error)) {
+    m_logger->warn("error writing trace: {}", error);
+  }
+}
+
+void OverlayFsManager::setLogFile(const QString& file) noexcept
+{
+  scoped_lock mountLock(m_mountMutex);
+  scoped_lock dataLock(m_dataMutex);
+  scoped_lock loggingLock(m_loggingMutex);
+
+  m_logger->debug("setting log file to '{}'", file);
+  m_logFile = file;
+  createLogger();
+}
+
+void OverlayFsManager::addSkipFileSuffix(const QString& fileSuffix) noexcept
+{
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("added skip file suffix '{}'", fileSuffix);
+  m_fileSuffixBlacklist.emplace_back(fileSuffix);
+}
+
+void OverlayFsManager::clearSkipFileSuffixes() noexcept
+{
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("clearing skip file suffixes");
+  m_fileSuffixBlacklist.clear();
+}
+
+void OverlayFsManager::addSkipDirectory(const QString& directory) noexcept
+{
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("added skip directory '{}'", directory);
+  m_directoryBlacklist.emplace_back(directory);
+}
+
+void OverlayFsManager::clearSkipDirectories() noexcept
+{
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("clearing skip directories");
+  m_directoryBlacklist.clear();
+}
+
+void OverlayFsManager::forceLoadLibrary(const QString& processName,
+                                        const QString& libraryPath) noexcept
+{
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("adding forced library '{}' for process '{}'",
+                  libraryPath, processName);
+  m_forceLoadLibraries.emplace_back(processName, libraryPath);
+}
+
+void OverlayFsManager::clearLibraryForceLoads() noexcept
+{
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("clearing forced libraries");
+  m_forceLoadLibraries.clear();
+}
+
+void OverlayFsManager::clearMappings() noexcept
+{
+  scoped_lock dataLock(m_dataMutex);
+
+  m_map.clear();
+  m_fileMap.clear();
+  m_treeOutdated = true;
+}
+
+void OverlayFsManager::setPersistentArtifacts(const QString& stateFile) noexcept
+{
+  scoped_lock mountLock(m_mountMutex);
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("setting artifact state file to '{}'", stateFile);
+  m_artifactStateFile = stateFile;
+}
+
+void OverlayFsManager::clearPersistentArtifacts() noexcept
+{
+  scoped_lock mountLock(m_mountMutex);
+  scoped_lock dataLock(m_dataMutex);
+
+  if (m_mounted) {
+    m_logger->error("cannot clear persistent artifacts while mounted");
+    return;
+  }
+
+  if (m_artifactStateFile.isEmpty() || !QFileInfo::exists(m_artifactStateFile)) {
+    return;
+  }
+
+  m_logger->debug("clearing persistent artifacts");
+  if (!loadArtifactState()) {
+    return;
+  }
+
+  m_createdWhiteoutFiles << m_recordedWhiteoutFiles.values();
+  m_createdSymlinks << m_recordedSymlinks.values();
+  m_recordedWhiteoutFiles.clear();
+  m_recordedSymlinks.clear();
+  cleanup();
+
+  if (!QFile::remove(m_artifactStateFile)) {
+    m_logger->error("error removing artifact state file '{}'", m_artifactStateFile);
+  }
+}
+
+void OverlayFsManager::setWhiteoutLocation(WhiteoutLocation location) noexcept
+{
+  scoped_lock mountLock(m_mountMutex);
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("setting whiteout location to {}",
+                  location == WhiteoutLocation::UpperDir ? "upper dir" : "skip layer");
+  m_whiteoutLocation = location;
+}
+
+void OverlayFsManager::setSkipLayerCacheDir(const QString& directory,
+                                            bool create) noexcept
+{
+  scoped_lock mountLock(m_mountMutex);
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("setting skip layer cache dir to '{}'", directory);
+
+  QDir dir(directory);
+  if (!directory.isEmpty() && !dir.exists()) {
+    if (!create) {
+      m_logger->error("Directory '{}' does not exist", directory);
+      return;
+    }
+    if (!dir.mkpath(u"."_s)) {
+      m_logger->error("Error creating directory {}", directory);
+      return;
+    }
+  }
+  m_skipLayerCacheDir = directory;
+}
+
+void OverlayFsManager::setIndexCacheDir(const QString& directory, bool create) noexcept
+{
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("setting index cache dir to '{}'", directory);
+
+  QDir dir(directory);
+  if (!directory.isEmpty() && !dir.exists()) {
+    if (!create) {
+      m_logger->error("Directory '{}' does not exist", directory);
+      return;
+    }
+    if (!dir.mkpath(u"."_s)) {
+      m_logger->error("Error creating directory {}", directory);
+      return;
+    }
+  }
+  m_indexCacheDir = directory;
+  m_treeIndex.reset();
+}
+
+void OverlayFsManager::setBaseLayerCacheDir(const QString& directory,
+                                            bool create) noexcept
+{
+  scoped_lock mountLock(m_mountMutex);
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("setting base layer cache dir to '{}'", directory);
+
+  QDir dir(directory);
+  if (!directory.isEmpty() && !dir.exists()) {
+    if (!create) {
+      m_logger->error("Directory '{}' does not exist", directory);
+      return;
+    }
+    if (!dir.mkpath(u"."_s)) {
+      m_logger->error("Error creating directory {}", directory);
+      return;
+    }
+  }
+  m_baseLayerCacheDir = directory;
+}
+
+bool OverlayFsManager::setBackend(Backend backend) noexcept
+{
+  scoped_lock dataLock(m_dataMutex);
+
+  if (!isBackendAvailable(backend)) {
+    m_logger->error("backend is not available in this build");
+    return false;
+  }
+  if (m_status.load()->mounted) {
+    m_logger->error("cannot change the backend while mounted");
+    return false;
+  }
+
+  m_logger->debug("using {} backend",
+                  backend == Backend::Builtin ? "builtin" : "fuse-overlayfs");
+  m_backend = backend;
+  return true;
+}
+
+bool OverlayFsManager::isBackendAvailable(Backend backend) noexcept
+{
+#ifdef OVERLAYFS_BUILTIN_BACKEND
+  return backend == Backend::FuseOverlayFs || backend == Backend::Builtin;
+#else
+  return backend == Backend::FuseOverlayFs;
+#endif
+}
+
+void OverlayFsManager::setMountConsolidation(bool enabled) noexcept
+{
+  scoped_lock mountLock(m_mountMutex);
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("{} mount consolidation", enabled ? "enabling" : "disabling");
+  if (enabled && m_backend != Backend::Builtin) {
+    m_logger->warn("mount consolidation is only supported by the builtin backend");
+  }
+  m_consolidateMounts = enabled;
+}
+
+bool OverlayFsManager::setMaxLowerDirs(int count) noexcept
+{
+  scoped_lock mountLock(m_mountMutex);
+  scoped_lock dataLock(m_dataMutex);
+
+  // groups have to hold at least two lower dirs besides the target and skip layer
+  if (count < 0 || (count > 0 && count < 3)) {
+    m_logger->error("invalid maximum number of lower dirs {}", count);
+    return false;
+  }
+
+  m_logger->debug("setting maximum number of lower dirs to {}", count);
+  m_maxLowerDirs = count;
+  return true;
+}
+
+void OverlayFsManager::setDirectMounts(bool enabled) noexcept
+{
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("{} direct mounts", enabled ? "enabling" : "disabling");
+  m_directMounts = enabled;
+}
+
+void OverlayFsManager::setOverlayFsPrograms(const QString& overlayFs,
+                                            const QString& fusermount) noexcept
+{
+  scoped_lock mountLock(m_mountMutex);
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("using '{}' to mount and '{}' to unmount", overlayFs, fusermount);
+  m_overlayFsProgram  = overlayFs;
+  m_fusermountProgram = fusermount;
+}
+
+void OverlayFsManager::setProcessTimeout(chrono::milliseconds timeout) noexcept
+{
+  scoped_lock mountLock(m_mountMutex);
+  scoped_lock dataLock(m_dataMutex);
+
+  m_logger->debug("setting process timeout to {} ms", timeout.count());
+  m_processTimeout = timeout;
+}
+
+int OverlayFsManager::processTimeout() const noexcept
+{
+  // QProcess waits indefinitely for negative values
+  if (m_processTimeout <= 0ms) {
+    return -1;
+  }
+  return static_cast<int>(min<chrono::milliseconds::rep>(m_processTimeout.count(),
+                                                         numeric_limits<int>::max()));
+}
+
+void OverlayFsManager::dryrun() noexcept
+{
+  planInput_t input;
+  int maxLowerDirs = 0;
+  {
+    scoped_lock dataLock(m_dataMutex);
+    input        = planInput();
+    maxLowerDirs = m_maxLowerDirs;
+  }
+
+  // the source directories are scanned without blocking changes of the mappings
+  shared_lock loggingLock(m_loggingMutex);
+
+  m_logger->info("would mount");
+
+  if (input.map.empty()) {
+    m_logger->info("nothing");
+    return;
+  }
+
+  m_logger->info("");
+
+  Statistics statistics;
+  MountPlan plan;
+  const bool planned = planMounts(input, plan, statistics);
+  {
+    // a running mount keeps its own statistics
+    scoped_lock dataLock(m_dataMutex);
+    m_lastRunStatistics = statistics;
+  }
+  if (!planned) {
+    m_logger->error("error preparing mounts");
+    return;
+  }
+
+  int i = 0;
+  for (const auto& mount : plan.targets()) {
+    m_logger->info(" . {}", i++);
+
+    switch (mount.method) {
+    case MountMethod::Overlay:
+      break;
+    case MountMethod::BindMount:
+      m_logger->info("   bind mount of {}", mount.sources.front());
+      break;
+    case MountMethod::Symlink:
+      m_logger->info("   symlink to {}", mount.sources.front());
+      break;
+    }
+
+    for (const QString& lowerDir : mount.lowerDirs) {
+      m_logger->info("   . {} -> {}", lowerDir, mount.target);
+    }
+    if (!mount.prunedDirs.empty()) {
+      m_logger->info("pruned empty or shadowed directories:");
+      for (const auto& prunedDir : mount.prunedDirs) {
+        m_logger->info("   . {}", prunedDir);
+      }
+    }
+    if (!mount.whiteouts.empty() || !mount.opaque.empty()) {
+      m_logger->info("ignored files/directories:");
+      for (const auto& whiteout : mount.whiteouts) {
+        m_logger->info("   . {}", whiteout);
+      }
+      for (const auto& opaque : mount.opaque) {
+        m_logger->info("   . {}/", opaque);
+      }
+    }
+
+    // the target and the skip layer are lower dirs as well
+    if (plan.backend() == Backend::FuseOverlayFs && maxLowerDirs > 0 &&
+        mount.lowerDirs.size() + 2 > maxLowerDirs) {
+      m_logger->info("lower dirs are mounted in groups of at most {}", maxLowerDirs);
+    }
+  }
+
+  m_logger->info("statistics:");
+  for (const auto& [name, duration] : statistics.phases) {
+    m_logger->info("   . {}: {:.3f} ms", name,
+                   chrono::duration<double, milli>(duration).count());
+  }
+  m_logger->info("   . {} entries in source directories", statistics.layerEntries);
+}
+
+optional<MountPlan> OverlayFsManager::createMountPlan() noexcept
+{
+  planInput_t input;
+  {
+    scoped_lock dataLock(m_dataMutex);
+    input = planInput();
+  }
+
+  // the source directories are scanned without blocking changes of the mappings
+  shared_lock loggingLock(m_loggingMutex);
+
+  // planning on its own does not replace the statistics of the last mount
+  Statistics statistics;
+  MountPlan plan;
+  if (!planMounts(input, plan, statistics)) {
+    m_logger->error("error creating mount plan");
+    return nullopt;
+  }
+  return plan;
+}
+
+bool OverlayFsManager::mount() noexcept
+{
+  return mountAsync().get();
+}
+
+bool OverlayFsManager::mount(const MountPlan& plan) noexcept
+{
+  return mountAsync(plan).get();
+}
+
+bool OverlayFsManager::umount() noexcept
+{
+  return umountAsync().get();
+}
+
+shared_future<bool> OverlayFsManager::mountAsync() noexcept
+{
+  return enqueue(CommandType::Mount);
+}
+
+shared_future<bool> OverlayFsManager::mountAsync(MountPlan plan) noexcept
+{
+  return enqueue(CommandType::Mount, std::move(plan));
+}
+
+shared_future<bool> OverlayFsManager::umountAsync() noexcept
+{
+  return enqueue(CommandType::Umount);
+}
+
+shared_future<bool> OverlayFsManager::enqueue(CommandType type,
+                                              optional<MountPlan> plan) noexcept
+{
+  scoped_lock queueLock(m_queueMutex);
+
+  // the queued command did not start yet, so it has the same result
+  if (!m_commands.empty() && m_commands.back().type == type &&
+      !m_commands.back().plan.has_value() && !plan.has_value()) {
+    return m_commands.back().result;
+  }
+
+  command_t& command = m_commands.emplace_back(type, std::move(plan));
+  command.result     = command.completion.get_future().share();
+  m_queueCondition.notify_one();
+  return command.result;
+}
+
+void OverlayFsManager::processCommands(stop_token stop) noexcept
+{
+  unique_lock queueLock(m_queueMutex);
+  while (true) {
+    m_queueCondition.wait(queueLock, stop, [this] {
+      return !m_commands.empty();
+    });
+    if (m_commands.empty()) {
+      // stop requested
+      return;
+    }
+
+    command_t command = std::move(m_commands.front());
+    m_commands.pop_front();
+    queueLock.unlock();
+
+    bool result;
+    {
+      // the mappings and settings are only locked while they are copied, so they can
+      // be changed and queried while mounting
+      scoped_lock mountLock(m_mountMutex);
+
+      if (command.type == CommandType::Mount) {
+        result = mountInternal(command.plan.has_value() ? &*command.plan : nullptr);
+      } else {
+        result = umountInternal();
+      }
+      publishStatus();
+      writeTrace();
+
+      // the next session starts with an empty trace instead of rewriting this one
+      if (command.type == CommandType::Umount && m_tracer != nullptr) {
+        m_tracer->clear();
+      }
+
+      scoped_lock dataLock(m_dataMutex);
+      m_lastRunStatistics = m_statistics;
+    }
+    command.completion.set_value(result);
+
+    queueLock.lock();
+  }
+}
+
+bool OverlayFsManager::createProcess(const QString& applicationName,
+                                     const QString& commandLine) noexcept
+{
+  m_logger->debug("creating process '{}' with commandline '{}'",
+                  applicationName, commandLine);
+
+  // does nothing if already mounted
+  if (!mount()) {
+    m_logger->error("Not starting process because mount failed");
+    return false;
+  }
+
+  scoped_lock dataLock(m_dataMutex);
+
+  // todo: implement handling of m_forceLoadLibraries
+
+  auto p = make_unique<QProcess>();
+  p->setProgram(applicationName);
+  p->setArguments(QProcess::splitCommand(commandLine));
+
+  const auto started = Tracer::Clock::now();
+  p->start();
+  if (p->waitForStarted()) {
+    m_logger->debug("created process with pid {}", p->processId());
+
+    // the process is shown as a thread of its own, from spawning to exiting
+    const auto pid = static_cast<pid_t>(p->processId());
+    const auto onFinished = [this, process = p.get(), tracer = m_tracer, started, pid,
+                             program = applicationName.toStdString()](int exitCode) {
+      if (tracer != nullptr) {
+        tracer->record("process", "process", started, Tracer::Clock::now(),
+                       static_cast<uint64_t>(pid),
+                       {{"program", program},
+                        {"pid", to_string(pid)},
+                        {"exit code", to_string(exitCode)}});
+      }
+      updateStatus([pid](Status& status) {
+        erase(status.processes, pid);
+      });
+      {
+        // the process is still emitting this signal, so it is deleted later
+        scoped_lock dataLock(m_dataMutex);
+        const auto it =
+            ranges::find(m_startedProcesses, process, &unique_ptr<QProcess>::get);
+        if (it != m_startedProcesses.end()) {
+          it->release()->deleteLater();
+          m_startedProcesses.erase(it);
+        }
+      }
+      m_logger->debug("process finished, unmounting");
+      (void)umountAsync();
+    };
+    QObject::connect(p.get(), &QProcess::finished, onFinished);
+
+    m_startedProcesses.emplace_back(std::move(p));
+    updateStatus([pid](Status& status) {
+      status.processes.push_back(pid);
+    });
+    return true;
+  }
+
+  m_logger->error("error creating process: {}", p->errorString());
+  return false;
+}
+
+const char* OverlayFsManager::ofsVersionString() noexcept
+{
+  return "1.0.0";
+}
+
+void OverlayFsManager::setDebugMode(bool value) noexcept
+{
+  scoped_lock dataLock(m_dataMutex);
+
+  m_debuggingMode = value;
+}
+
+std::vector<pid_t> OverlayFsManager::getOverlayFsProcessList() const noexcept
+{
+  return m_status.load()->processes;
+}
+
+OverlayFsManager::OverlayFsManager(QString file) noexcept
+    : m_loglevel(spdlog::level::warn), m_layerCache(make_unique<LayerCache>()),
+      m_logFile(std::move(file))
+{
+  createLogger();
+  m_worker = jthread([this](stop_token stop) {
+    processCommands(stop);
+  });
+}
 
 OverlayFsManager::~OverlayFsManager() noexcept
 {
+  // processes still running are killed when they are destroyed, which must not run
+  // their finished handlers on a manager that is being destroyed
+  {
+    scoped_lock dataLock(m_dataMutex);
+    for (const auto& process : m_startedProcesses) {
+      process->disconnect();
+    }
+  }
+
+  if (m_mounted) {
+    if (!umount()) {
+      m_logger->error("OverlayFS Manager dtor could not call umount");
+    }
+  }
+  // finishes all queued commands
+  m_worker.request_stop();
+  m_worker.join();
+
+  releaseArtifacts();
+  writeTrace();
+
+  m_logFlusher.reset();
+  m_logger->flush();
+}
+
+void OverlayFsManager::createLogger() noexcept
+{
+  // the previous logger writes its queued messages before the file is reopened
+  m_logFlusher.reset();
+  if (m_logger != nullptr) {
+    m_logger->flush();
+  }
+
+  spdlog::sink_ptr stdoutSink = std::make_shared<spdlog::sinks::stdout_sink_mt>();
+  spdlog::sink_ptr fileSink;
+  std::string fileError;
+  try {
+    fileSink =
+        std::make_shared<spdlog::sinks::basic_file_sink_mt>(m_logFile.toStdString());
+  } catch (const spdlog::spdlog_ex& e) {
+    fileError = e.what();
+  }
+
+  // records errors in the status, whatever the log level is
+  m_errorSink = std::make_shared<spdlog::sinks::callback_sink_mt>(
+      [this](const spdlog::details::log_msg& message) {
+        const QString error =
+            QString::fromUtf8(message.payload.data(), ssize(message.payload));
+        updateStatus([&](Status& status) {
+          status.lastError = error;
+        });
+      });
+  m_errorSink->set_level(spdlog::level::err);
+
+  std::vector<spdlog::sink_ptr> sinks{stdoutSink, m_errorSink};
+  if (fileSink != nullptr) {
+    sinks.push_back(fileSink);
+  }
+
+  // loggers are not registered with spdlog, so the name does not have to be unique
+  if (m_asyncLogging) {
+    if (m_logThreadPool == nullptr) {
+      m_logThreadPool =
+          std::make_shared<spdlog::details::thread_pool>(asyncLogQueueSize, 1);
+    }
+    m_logger = std::make_shared<spdlog::async_logger>(
+        "overlayfs", sinks.begin(), sinks.end(), m_logThreadPool,
+        spdlog::async_overflow_policy::block);
+
+    // messages are written in the background, so flush regularly
+    m_logFlusher = std::make_unique<spdlog::details::periodic_worker>(
+        [logger = m_logger] {
+          logger->flush();
+        },
+        asyncLogFlushInterval);
+  } else {
+    m_logger =
+        std::make_shared<spdlog::logger>("overlayfs", sinks.begin(), sinks.end());
+  }
+
+  m_logger->set_pattern("%H:%M:%S.%e [%L] %v");
+  applyLogLevel();
+  m_logger->flush_on(spdlog::level::warn);
+
+  if (fileSink == nullptr) {
+    m_logger->error("error opening log file '{}': {}", m_logFile, fileError);
+  }
+}
+
+OverlayFsManager::planInput_t OverlayFsManager::planInput() const
+{
+  return {m_map,
+          m_fileMap,
+          m_upperDir,
+          m_fileSuffixBlacklist,
+          m_directoryBlacklist,
+          m_backend,
+          m_directMounts};
+}
+
+bool OverlayFsManager::planMounts(const planInput_t& input, MountPlan& plan,
+                                  Statistics& statistics) noexcept
+{
+  m_logger->debug("preparing mounts");
+  m_logger->debug(" . {} directories", input.map.size());
+  if (m_logger->should_log(spdlog::level::debug)) {
+    for (const auto& [source, destination] : input.map) {
+      m_logger->debug("  - '{}' -> '{}'", source.absoluteFilePath(),
+                      destination.absoluteFilePath());
+    }
+  }
+
+  PhaseTimer timer(statistics, m_tracer.get(), u"prepare mounts"_s);
+
+  vector<layerStack_t> stacks;
+  if (!createLayerStacks(input, stacks)) {
+    return false;
+  }
+
+  const SkipRules rules = skipRules(input);
+  {
+    PhaseTimer scanTimer(statistics, m_tracer.get(), u"scan layers"_s);
+    scanLayers(stacks, rules);
+  }
+
+  // the directories of every source are recorded once, even if it has several targets
+  set<QString> stampedSources;
+  for (const auto& stack : stacks) {
+    for (const QString& source : stack.sources) {
+      const auto listing = m_layerCache->get(source.toStdString(), rules);
+      statistics.layerEntries += static_cast<qint64>(listing->entries().size());
+
+      if (!stampedSources.insert(source).second) {
+        continue;
+      }
+      for (const auto& [path, inode, mtime] : listing->stamps()) {
+        QString directory = source;
+        if (!path.empty()) {
+          directory += "/"_L1 % QString::fromStdString(path);
+        }
+        plan.m_stamps.emplace_back(std::move(directory), inode, mtime);
+      }
+    }
+  }
+
+  QStringList targets;
+  for (const auto& stack : stacks) {
+    targets << stack.target;
+  }
+
+  for (auto& stack : stacks) {
+    MountPlan::Target data;
+    data.target    = std::move(stack.target);
+    data.upperDir  = std::move(stack.upperDir);
+    data.lowerDirs = std::move(stack.lowerDirs);
+    data.sources   = stack.sources;
+
+    // create whiteouts for skipped files, skipped directories are hidden with a
+    // single opaque marker
+    addSkippedEntries(stack, rules);
+    data.whiteouts = std::move(stack.whiteouts);
+    data.opaque    = std::move(stack.opaque);
+
+    // empty lower dirs and lower dirs shadowed by higher ones only cost lookups, the
+    // upper dir does not count since files can be deleted from it while mounted
+    vector<shared_ptr<const LayerListing>> listings;
+    for (const QString& lowerDir : data.lowerDirs) {
+      listings.push_back(m_layerCache->get(lowerDir.toStdString(), rules));
+    }
+    const vector<bool> unused = findUnusedLayers(listings);
+    QStringList lowerDirs;
+    for (qsizetype i = 0; i < data.lowerDirs.size(); ++i) {
+      (unused[i] ? data.prunedDirs : lowerDirs) << data.lowerDirs[i];
+    }
+    if (!data.prunedDirs.isEmpty()) {
+      m_logger->debug("pruned {} of {} lower dirs of '{}'", data.prunedDirs.size(),
+                      data.lowerDirs.size(), data.target);
+      data.lowerDirs = std::move(lowerDirs);
+    }
+
+    data.method = mountMethod(data, targets, input);
+    if (data.method != MountMethod::Overlay) {
+      m_logger->debug("mounting '{}' directly", data.target);
+    }
+
+    plan.m_targets.push_back(std::move(data));
+  }
+
+  plan.m_backend          = input.backend;
+  plan.m_symlinks         = fileSymlinks(input);
+  plan.m_skipFileSuffixes = input.fileSuffixBlacklist;
+  plan.m_skipDirectories  = input.directoryBlacklist;
+  return true;
+}
+
+void OverlayFsManager::prepareMounts(const MountPlan& plan) noexcept
+{
+  m_mounts.clear();
+  m_symlinks = plan.symlinks();
+
+  for (const MountPlan::Target& target : plan.targets()) {
+    overlayFsData_t& data = m_mounts.emplace_back();
+    data.method           = target.method;
+    data.target           = target.target;
+    data.upperDir         = target.upperDir;
+    data.lowerDirs        = target.lowerDirs;
+    data.sources          = target.sources;
+    data.whiteout         = target.whiteouts;
+    data.opaque           = target.opaque;
+    data.prunedDirs       = target.prunedDirs;
+
+    if (data.method != MountMethod::Overlay) {
+      continue;
+    }
+
+    // The workdir needs to be an empty directory on the same filesystem as upperDir,
+    // so we just create a QTemporaryDir on the upperDir parent path
+    data.workDir = QTemporaryDir(data.upperDir % "_tmp_XXXXXX"_L1);
+    m_logger->debug("created workdir '{}'", data.workDir.path());
+  }
+}
+
+vector<MountPlan::Symlink> OverlayFsManager::fileSymlinks(const planInput_t& input)
+{
+  vector<MountPlan::Symlink> symlinks;
+  symlinks.reserve(input.fileMap.size());
+  for (const auto& [source, destination] : input.fileMap) {
+    symlinks.emplace_back(source.absoluteFilePath(), destination.absoluteFilePath());
+  }
+  return symlinks;
+}
+
+OverlayFsManager::MountMethod
+OverlayFsManager::mountMethod(const MountPlan::Target& mount,
+                              const QStringList& targets,
+                              const planInput_t& input) const
+{
+  // anything written to the target would end up in the source
+  if (!input.directMounts || mount.sources.size() != 1 ||
+      mount.upperDir != mount.target || !mount.whiteouts.isEmpty() ||
+      !mount.opaque.isEmpty()) {
+    return MountMethod::Overlay;
+  }
+
+  // symlinks and other targets inside of the target would be created in the source
+  const QString prefix = mount.target % "/"_L1;
+  const bool hasLinks  = ranges::any_of(input.fileMap, [&](const map_t& entry) {
+    return entry.destination.absoluteFilePath().startsWith(prefix);
+  });
+  const bool hasTargets = ranges::any_of(targets, [&](const QString& target) {
+    return target.startsWith(prefix);
+  });
+  if (hasLinks || hasTargets) {
+    return MountMethod::Overlay;
+  }
+
+  // both a bind mount and a symlink would hide the files already in the target
+  const QDir dir(mount.target);
+  if (dir.exists() && !dir.isEmpty()) {
+    return MountMethod::Overlay;
+  }
+
+  if (hasMountCapability()) {
+    return MountMethod::BindMount;
+  }
+
+  // replacing a target inside of another one would create a whiteout in its upper dir
+  const bool isNested = ranges::any_of(targets, [&](const QString& target) {
+    return mount.target.startsWith(target % "/"_L1);
+  });
+  return isNested ? MountMethod::Overlay : MountMethod::Symlink;
+}
+
+bool OverlayFsManager::createLayerStacks(const planInput_t& input,
+                                         vector<layerStack_t>& stacks) const noexcept
+{
+  // create sets of unique sources and destinations
+  set<QString> directorySources;
+  set<QString> directoryDestinations;
+  for (const auto& [source, destination] : input.map) {
+    directorySources.emplace(source.absoluteFilePath());
+    directoryDestinations.emplace(destination.absoluteFilePath());
+  }
+  // check if a source is also a destination
+  for (const auto& source : directorySources) {
+    if (directoryDestinations.contains(source)) {
+      m_logger->error("source '{}' cannot simultaneously be a destination", source);
+      return false;
+    }
+  }
+
+  for (const auto& dstDir : directoryDestinations) {
+    layerStack_t stack;
+    stack.target = dstDir;
+
+    // add all sources with this destination
+    for (const auto& entry : input.map) {
+      const QString srcPath = entry.source.absoluteFilePath();
+
+      if (entry.destination.absoluteFilePath() == dstDir) {
+        // add as upper dir if no upper dir has been set and the directory name is
+        // "overwrite"
+        if (input.upperDir.isEmpty() && entry.source.fileName() == "overwrite"_L1) {
+          stack.upperDir = srcPath;
+        } else {
+          stack.lowerDirs << srcPath;
+        }
+        stack.sources << srcPath;
+      }
+    }
+
+    if (stack.upperDir.isEmpty()) {
+      stack.upperDir = stack.target;
+      m_logger->debug("using target dir '{}' as upper dir", stack.target);
+    }
+
+    // reverse order of lower dirs to get correct priorities
+    std::ranges::reverse(stack.lowerDirs);
+
+    stacks.push_back(std::move(stack));
+  }
+
+  return true;
+}
+
+static SkipRules toSkipRules(const QStringList& fileSuffixes,
+                             const QStringList& directories)
+{
+  SkipRules rules;
+  for (const QString& suffix : fileSuffixes) {
+    rules.fileSuffixes.push_back(suffix.toStdString());
+  }
+  for (const QString& directory : directories) {
+    rules.directories.push_back(directory.toStdString());
+  }
+  return rules;
+}
+
+SkipRules OverlayFsManager::skipRules(const planInput_t& input)
+{
+  return toSkipRules(input.fileSuffixBlacklist, input.directoryBlacklist);
+}
+
+SkipRules OverlayFsManager::skipRules(const MountPlan& plan)
+{
+  return toSkipRules(plan.skipFileSuffixes(), plan.skipDirectories());
+}
+
+void OverlayFsManager::addSkippedEntries(layerStack_t& stack,
+                                         const SkipRules& rules) noexcept
+{
+  for (const QString& source : stack.sources) {
+    const auto listing = m_layerCache->get(source.toStdString(), rules);
+    for (const string& file : listing->skippedFiles()) {
+      stack.whiteouts << QString::fromStdString(file);
+    }
+    for (const string& dir : listing->skippedDirectories()) {
+      stack.opaque << QString::fromStdString(dir);
+    }
+  }
+
+  // the same entry can be skipped in several sources
+  stack.whiteouts.removeDuplicates();
+  stack.opaque.removeDuplicates();
+}
+
+bool OverlayFsManager::createSymlinks() noexcept
+{
+  PhaseTimer timer(m_statistics, m_tracer.get(), u"create symlinks"_s);
+
+  m_logger->debug("creating {} symlinks", m_symlinks.size());
+  if (m_logger->should_log(spdlog::level::debug)) {
+    for (const auto& [source, destination] : m_symlinks) {
+      m_logger->debug("  - '{}' -> '{}'", source, destination);
+    }
+  }
+
+  // the file the symlink refers to and the actual symlink file
+  for (const auto& [linkTarget, linkName] : m_symlinks) {
+    // reuse the symlink of the previous session if it still points to the same file
+    if (m_recordedSymlinks.remove(linkName)) {
+      const QFileInfo link(linkName);
+      if (link.isSymLink() && link.symLinkTarget() == linkTarget) {
+        m_logger->debug("reusing symlink '{}'", linkName);
+        m_createdSymlinks << linkName;
+        continue;
+      }
+      if (link.isSymLink() && !QFile::remove(linkName)) {
+        m_logger->error("error removing outdated symlink '{}'", linkName);
+        return false;
+      }
+    }
+
+    // check if targets already exist
+    if (QFileInfo::exists(linkName)) {
+      const QString newName = linkName % renamedSuffix;
+      m_logger->debug("link name '{}' already exists, renaming it to '{}'",
+                      linkName, newName);
+      if (!QFile::rename(linkName, newName)) {
+        m_logger->error("error renaming '{}'", linkName);
+        return false;
+      }
+    }
+
+    QFile symlinkFile(linkTarget);
+    if (!symlinkFile.link(linkName)) {
+      m_logger->error("error creating symlink '{}': {}", linkTarget,
+                      symlinkFile.errorString());
+      return false;
+    }
+    m_logger->debug("created symlink '{}' -> '{}'", linkName, linkTarget);
+    m_createdSymlinks << linkName;
+    ++m_statistics.symlinks;
+  }
+
+  // remove symlinks of the previous session that are no longer needed
+  for (const QString& file : std::as_const(m_recordedSymlinks)) {
+    removeSymlink(file);
+  }
+  m_recordedSymlinks.clear();
+
+  return true;
+}
+
+bool OverlayFsManager::removeSymlink(const QString& file) noexcept
+{
+  m_logger->debug("removing symlink '{}'", file);
+  QFile symlinkFile(file);
+  if (!symlinkFile.remove()) {
+    m_logger->error("error removing symlink '{}': {}", file, symlinkFile.errorString());
+    return false;
+  }
+  // restore the original file if it was renamed
+  const QString renamedFilePath = file % renamedSuffix;
+  if (QFileInfo::exists(renamedFilePath)) {
+    QFile renamedFile(renamedFilePath);
+    if (!renamedFile.rename(file)) {
+      m_logger->error("error renaming file '{}' to original filename '{}': {}",
+                      renamedFilePath, file, renamedFile.errorString());
+    }
+  }
+  return true;
+}
+
+bool OverlayFsManager::createWhiteouts() noexcept
+{
+  PhaseTimer timer(m_statistics, m_tracer.get(), u"create whiteouts"_s);
+
+  for (auto& mount : m_mounts) {
+    if (mount.whiteout.empty() && mount.opaque.empty()) {
+      continue;
+    }
+
+    if (m_whiteoutLocation == WhiteoutLocation::SkipLayer) {
+      if (!createSkipLayer(mount)) {
+        return false;
+      }
+      continue;
+    }
+
+    if (mount.upperDir.isEmpty()) {
+      m_logger->warn("cannot create whiteout files without upper dir");
+      continue;
+    }
+
+    for (const auto& whiteout : mount.whiteout + opaqueMarkers(mount)) {
+      QString whiteoutPath = mount.upperDir % "/"_L1 % whiteout;
+
+      // reuse the whiteout file of the previous session
+      if (m_recordedWhiteoutFiles.remove(whiteoutPath) && isWhiteoutFile(whiteoutPath)) {
+        m_createdWhiteoutFiles << whiteoutPath;
+        continue;
+      }
+
+      fs::path whiteoutFile = whiteoutPath.toStdString();
+      if (!createDirectories(whiteoutFile.parent_path())) {
+        return false;
+      }
+      if (!createWhiteoutFile(whiteoutFile)) {
+        const int e = errno;
+        m_logger->error("could not create whiteout file {}: {}", whiteoutFile.string(),
+                        strerror(e));
+        return false;
+      }
+      m_createdWhiteoutFiles.emplace_back(whiteoutPath);
+      ++m_statistics.whiteouts;
+    }
+  }
+
+  removeRecordedWhiteouts();
+  return true;
+}
+
+void OverlayFsManager::removeRecordedWhiteouts() noexcept
+{
+  if (m_recordedWhiteoutFiles.empty()) {
+    return;
+  }
+
+  // remove whiteout files of the previous session that are no longer needed
+  for (const QString& whiteout : std::as_const(m_recordedWhiteoutFiles)) {
+    if (!isWhiteoutFile(whiteout)) {
+      continue;
+    }
+    m_logger->debug("removing outdated whiteout file '{}'", whiteout);
+    if (!QFile::remove(whiteout)) {
+      m_logger->error("could not remove whiteout file '{}'", whiteout);
+    }
+  }
+  m_recordedWhiteoutFiles.clear();
+
+  // remove directories that became empty, children before their parents
+  QStringList directories = m_createdDirectories;
+  ranges::sort(directories, [](const QString& lhs, const QString& rhs) {
+    return lhs.size() > rhs.size();
+  });
+  for (const QString& dir : directories) {
+    if (rmdir(dir.toStdString().c_str()) == 0) {
+      m_logger->debug("removed empty directory '{}'", dir);
+      m_createdDirectories.removeOne(dir);
+    }
+  }
+}
+
+bool OverlayFsManager::createSkipLayer(overlayFsData_t& mount) noexcept
+{
+  QStringList whiteouts = mount.whiteout + opaqueMarkers(mount);
+  whiteouts.sort();
+  whiteouts.removeDuplicates();
+
+  // layers with identical whiteouts are identical, so they are keyed by their content
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  for (const QString& whiteout : whiteouts) {
+    hash.addData(whiteout.toUtf8());
+    hash.addData("\0"_ba);
+  }
+  const QString key = QString::fromLatin1(hash.result().toHex());
+
+  QString layerPath;
+  shared_ptr<QFile> lock;
+  if (m_skipLayerCacheDir.isEmpty()) {
+    QTemporaryDir& tmpDir = mount.tmpDirs.emplace_back();
+    if (!tmpDir.isValid()) {
+      m_logger->error("error creating skip layer: {}", tmpDir.errorString());
+      return false;
+    }
+    layerPath = tmpDir.path();
+  } else {
+    layerPath = m_skipLayerCacheDir % "/"_L1 % key;
+    lock      = lockLayer(layerPath, LOCK_SH);
+    if (lock == nullptr) {
+      m_logger->error("error locking skip layer '{}'", layerPath);
+      return false;
+    }
+    if (QFileInfo::exists(layerPath)) {
+      m_logger->debug("reusing cached skip layer '{}'", layerPath);
+      // update the modification time to keep recently used layers in the cache
+      utimes(layerPath.toStdString().c_str(), nullptr);
+      mount.skipLayer = layerPath;
+      mount.lowerDirs.prepend(layerPath);
+      mount.layerLocks.push_back(std::move(lock));
+      return true;
+    }
+  }
+
+  // cached layers are built in a temporary directory and renamed once complete, a
+  // leftover of an interrupted build is discarded
+  const bool cached = !m_skipLayerCacheDir.isEmpty();
+  const QString buildPath = cached ? layerPath % buildSuffix : layerPath;
+  if (cached) {
+    QDir(buildPath).removeRecursively();
+  }
+
+  m_logger->debug("creating skip layer '{}' with {} whiteout files",
+                  layerPath, whiteouts.size());
+  for (const QString& whiteout : whiteouts) {
+    const fs::path whiteoutFile = (buildPath % "/"_L1 % whiteout).toStdString();
+    error_code ec;
+    fs::create_directories(whiteoutFile.parent_path(), ec);
+    if (ec) {
+      m_logger->error("error creating directory '{}', {}",
+                      whiteoutFile.parent_path().string(), ec.message());
+      if (cached) {
+        QDir(buildPath).removeRecursively();
+      }
+      return false;
+    }
+    if (!createWhiteoutFile(whiteoutFile)) {
+      const int e = errno;
+      m_logger->error("could not create whiteout file {}: {}", whiteoutFile.string(),
+                      strerror(e));
+      if (cached) {
+        QDir(buildPath).removeRecursively();
+      }
+      return false;
+    }
+    ++m_statistics.whiteouts;
+  }
+
+  if (cached &&
+      rename(buildPath.toStdString().c_str(), layerPath.toStdString().c_str()) != 0) {
+    const int e = errno;
+    m_logger->error("error renaming skip layer '{}': {}", buildPath, strerror(e));
+    QDir(buildPath).removeRecursively();
+    return false;
+  }
+
+  mount.skipLayer = layerPath;
+  mount.lowerDirs.prepend(layerPath);
+  if (lock != nullptr) {
+    mount.layerLocks.push_back(std::move(lock));
+  }
+  return true;
+}
+
+void OverlayFsManager::trimLayerCaches() noexcept
+{
+  QSet<QString> used;
+  for (const auto& mount : m_mounts) {
+    for (const QString& layer : {mount.skipLayer, mount.baseLayer}) {
+      if (!layer.isEmpty()) {
+        used.insert(QFileInfo(layer).absoluteFilePath());
+      }
+    }
+  }
+
+  // remove the least recently used layers, layers of the current mounts are kept and
+  // so are layers locked by other managers sharing the cache directory
+  const auto trim = [&](const QString& cacheDir, qsizetype size) {
+    if (cacheDir.isEmpty()) {
+      return;
+    }
+    const QFileInfoList layers = QDir(cacheDir).entryInfoList(
+        QDir::Dirs | QDir::NoDotAndDotDot, QDir::Time);
+    for (qsizetype i = size; i < layers.size(); ++i) {
+      const QString path = layers[i].absoluteFilePath();
+      if (used.contains(path)) {
+        continue;
+      }
+
+      // a layer that is being built shares the lock of the finished layer
+      QString layer = path;
+      if (layer.endsWith(buildSuffix)) {
+        layer.chop(buildSuffix.size());
+      }
+      const auto lock = lockLayer(layer, LOCK_EX | LOCK_NB);
+      if (lock == nullptr) {
+        m_logger->debug("keeping cached layer '{}', it is in use", path);
+        continue;
+      }
+
+      m_logger->debug("removing cached layer '{}'", path);
+      QDir(path).removeRecursively();
+      if (!QFileInfo::exists(layer) && !QFileInfo::exists(layer % buildSuffix)) {
+        // removed while still locked, see lockLayer()
+        unlink(lock->fileName().toStdString().c_str());
+      }
+    }
+  };
+
+  trim(m_skipLayerCacheDir, skipLayerCacheSize);
+  trim(m_baseLayerCacheDir, baseLayerCacheSize);
+}
+
+void OverlayFsManager::cleanup() noexcept
+{
+  PhaseTimer timer(m_statistics, m_tracer.get(), u"cleanup"_s);
+
+  for (const auto& file : m_createdWhiteoutFiles) {
+    QFile f(file);
+    // check file size
+    qint64 size = f.size();
+    if (size != 0) {
+      m_logger->error("error removing whiteout file '{}', size should be 0, but is {}",
+                      file, size);
+      continue;
+    }
+    f.remove();
+  }
+  m_createdWhiteoutFiles.clear();
+
+  // reverse directory list
+  // required because it is created in the order a -> a/b -> a/b/c
+  ranges::reverse(m_createdDirectories);
+
+  // remove previously created directories
+  for (const auto& dir : m_createdDirectories) {
+    string dirString = dir.toStdString();
+    m_logger->debug("deleting directory '{}'", dirString);
+    error_code ec;
+    // remove only removes empty directories
+    fs::remove(dirString, ec);
+    if (ec) {
+      m_logger->warn("error removing directory '{}', {}", dirString, ec.message());
+    }
+  }
+  m_createdDirectories.clear();
+
+  // remove symlinks
+  for (const auto& file : m_createdSymlinks) {
+    removeSymlink(file);
+  }
+  m_createdSymlinks.clear();
+}
+
+void OverlayFsManager::releaseArtifacts() noexcept
+{
+  if (m_artifactStateFile.isEmpty()) {
+    cleanup();
+    return;
+  }
+
+  if (!saveArtifactState()) {
+    m_logger->error("error saving artifact state, removing artifacts");
+    cleanup();
+    return;
+  }
+
+  m_logger->debug("keeping {} whiteout files and {} symlinks for the next session",
+                  m_createdWhiteoutFiles.size(), m_createdSymlinks.size());
+  m_createdWhiteoutFiles.clear();
+  m_createdDirectories.clear();
+  m_createdSymlinks.clear();
+}
+
+bool OverlayFsManager::loadArtifactState() noexcept
+{
+  m_recordedWhiteoutFiles.clear();
+  m_recordedSymlinks.clear();
+
+  QFile file(m_artifactStateFile);
+  if (!file.exists()) {
+    return true;
+  }
+
+  if (!file.open(QIODevice::ReadOnly)) {
+    m_logger->error("error opening artifact state file '{}': {}",
+                    m_artifactStateFile, file.errorString());
+    return false;
+  }
+
+  QJsonParseError parseError;
+  const QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &parseError);
+  if (parseError.error != QJsonParseError::NoError) {
+    m_logger->error("error parsing artifact state file '{}': {}", m_artifactStateFile,
+                    parseError.errorString());
+    return false;
+  }
+
+  const QJsonObject state = document.object();
+  for (const QString& whiteout : toStringList(state["whiteouts"_L1])) {
+    m_recordedWhiteoutFiles.insert(whiteout);
+  }
+  for (const QString& symlink : toStringList(state["symlinks"_L1])) {
+    m_recordedSymlinks.insert(symlink);
+  }
+  for (const QString& dir : toStringList(state["directories"_L1])) {
+    if (!m_createdDirectories.contains(dir)) {
+      m_createdDirectories << dir;
+    }
+  }
+
+  m_logger->debug("loaded {} whiteout files and {} symlinks of the previous session",
+                  m_recordedWhiteoutFiles.size(), m_recordedSymlinks.size());
+  return true;
+}
+
+bool OverlayFsManager::saveArtifactState() noexcept
+{
+  QJsonObject state;
+  state["whiteouts"_L1]   = QJsonArray::fromStringList(m_createdWhiteoutFiles);
+  state["directories"_L1] = QJsonArray::fromStringList(m_createdDirectories);
+  state["symlinks"_L1]    = QJsonArray::fromStringList(m_createdSymlinks);
+
+  QSaveFile file(m_artifactStateFile);
+  if (!file.open(QIODevice::WriteOnly)) {
+    m_logger->error("error opening artifact state file '{}': {}",
+                    m_artifactStateFile, file.errorString());
+    return false;
+  }
+  file.write(QJsonDocument(state).toJson(QJsonDocument::Compact));
+  if (!file.commit()) {
+    m_logger->error("error writing artifact state file '{}': {}",
+                    m_artifactStateFile, file.errorString());
+    return false;
+  }
+  return true;
+}
+
+bool OverlayFsManager::mountInternal(const MountPlan* plan)
+{
+  m_logger->debug("mounting");
   if (m_mounted) {
-    if (!umount()) {
-      m_logger->error("OverlayFS Manager dtor could not call umount");
+    m_logger->debug("already mounted");
+    return true;
+  }
+
+  if (isAnythingMounted()) {
+    m_logger->warn("partial mount detected, not mounting");
+    return false;
+  }
+
+  m_statistics = {};
+  if (plan == nullptr) {
+    planInput_t input;
+    {
+      scoped_lock dataLock(m_dataMutex);
+      input = planInput();
+    }
+
+    MountPlan mappingPlan;
+    if (!planMounts(input, mappingPlan, m_statistics)) {
+      m_logger->error("error processing mount info");
+      return false;
     }
+    m_mountPlan = std::move(mappingPlan);
+  } else if (!isBackendAvailable(plan->backend())) {
+    m_logger->error("cannot mount, the backend of the mount plan is not available");
+    return false;
+  } else {
+    // the layers may have changed since the plan was created
+    m_layerCache->revalidate();
+    // everything is mounted as planned, regardless of the current mappings and settings
+    m_mountPlan = *plan;
   }
-  cleanup();
+  prepareMounts(m_mountPlan);
+
+  if (!createMounts(m_mountPlan.backend())) {
+    rollbackMounts();
+    return false;
+  }
+
+  // layers are only removed once no target is left to mount on them
+  trimLayerCaches();
+
+  // record the artifacts right away so they are not lost if the process crashes
+  if (!m_artifactStateFile.isEmpty() && !saveArtifactState()) {
+    m_logger->warn("error saving artifact state");
+  }
+
+  m_mounted = true;
+  return true;
 }
 
-void OverlayFsManager::createLogger() noexcept
+bool OverlayFsManager::createMounts(Backend backend) noexcept
+{
+  if (!m_artifactStateFile.isEmpty() && !loadArtifactState()) {
+    m_logger->warn("ignoring artifacts of the previous session");
+  }
+
+  if (!createSymlinks()) {
+    m_logger->error("error creating symlinks");
+    return false;
+  }
+
+  // the builtin backend hides skipped files without whiteout files
+  if (backend == Backend::Builtin) {
+    removeRecordedWhiteouts();
+  } else if (!createWhiteouts()) {
+    m_logger->error("error creating whiteout files");
+    return false;
+  }
+
+  if (backend == Backend::Builtin) {
+    if (!mountBuiltin()) {
+      return false;
+    }
+  } else {
+    for (auto& mount : m_mounts) {
+      if (mount.method != MountMethod::Overlay) {
+        continue;
+      }
+      Tracer::Scope event(m_tracer.get(), "mount", "mount", [&] {
+        return Tracer::Args{{"target", mount.target.toStdString()}};
+      });
+      if (!mountOverlayFs(mount)) {
+        return false;
+      }
+      mount.mounted = true;
+    }
+  }
+
+  // direct mounts can be inside of overlays, so they are mounted last
+  for (auto& mount : m_mounts) {
+    if (mount.method == MountMethod::Overlay) {
+      continue;
+    }
+    Tracer::Scope event(m_tracer.get(), "mount", "mount", [&] {
+      return Tracer::Args{{"target", mount.target.toStdString()}};
+    });
+    if (!mountDirect(mount)) {
+      return false;
+    }
+    mount.mounted = true;
+  }
+
+  return true;
+}
+
+void OverlayFsManager::rollbackMounts() noexcept
 {
-  auto stdoutSink = std::make_shared<spdlog::sinks::stdout_sink_mt>();
-  auto fileSink =
-      std::make_shared<spdlog::sinks::basic_file_sink_mt>(m_logFile.toStdString());
+  m_logger->debug("rolling back the partial mount");
+
+  // direct mounts can be inside of overlays, so they are unmounted first
+  const auto unmount = [this](overlayFsData_t& mount) {
+    bool unmounted = true;
+    if (mount.mounted) {
+      if (mount.method != MountMethod::Overlay) {
+        unmounted = umountDirect(mount);
+      } else if (mount.fuseBackend != nullptr) {
+        unmounted = umountBuiltin(mount);
+      } else {
+        unmounted = runFusermount(mount.target);
+      }
+    }
+    if (!unmounted) {
+      m_logger->error("could not unmount '{}'", mount.target);
+    }
+    mount.mounted = false;
+    umountIntermediate(mount);
+  };
+  for (auto& mount : m_mounts) {
+    if (mount.method != MountMethod::Overlay) {
+      unmount(mount);
+    }
+  }
+  for (auto& mount : m_mounts) {
+    if (mount.method == MountMethod::Overlay) {
+      unmount(mount);
+    }
+  }
 
-  spdlog::sinks_init_list sink_list = {stdoutSink, fileSink};
+  // artifacts of the previous session are removed as well, so the state file would
+  // only list files that are gone
+  m_createdWhiteoutFiles << m_recordedWhiteoutFiles.values();
+  m_createdSymlinks << m_recordedSymlinks.values();
+  m_recordedWhiteoutFiles.clear();
+  m_recordedSymlinks.clear();
+  cleanup();
+  if (!m_artifactStateFile.isEmpty() && QFileInfo::exists(m_artifactStateFile) &&
+      !QFile::remove(m_artifactStateFile)) {
+    m_logger->error("error removing artifact state file '{}'", m_artifactStateFile);
+  }
 
-  m_logger = spdlog::create<spdlog::sinks::dist_sink_mt>("multi_sink", sink_list);
-  m_logger->set_pattern("%H:%M:%S.%e [%L] %v");
-  m_logger->set_level(spdlog::level::debug);
+  // removes the workdirs and skip layers that are not cached
+  m_mounts.clear();
+  m_symlinks.clear();
 }
 
-bool OverlayFsManager::prepareMounts() noexcept
+bool OverlayFsManager::umountInternal()
 {
-  m_logger->debug("preparing mounts");
-  m_logger->debug(" . {} directories", m_map.size());
-  for (const auto& [source, destination] : m_map) {
-    m_logger->debug("  - '{}' -> '{}'", source.absoluteFilePath().toStdString(),
-                    destination.absoluteFilePath().toStdString());
+  m_logger->debug("unmounting");
+  PhaseTimer timer(m_statistics, m_tracer.get(), u"unmount"_s);
+
+  if (!m_mounted || !isAnythingMounted()) {
+    m_logger->debug("not mounted");
+    return true;
   }
 
-  // create sets of unique sources and destinations
-  set<QString> directorySources;
-  set<QString> directoryDestinations;
-  for (const auto& [source, destination] : m_map) {
-    directorySources.emplace(source.absoluteFilePath());
-    directoryDestinations.emplace(destination.absoluteFilePath());
+  if (m_mounts.empty()) {
+    m_logger->debug("m_mounts is empty");
+    return true;
   }
-  // check if a source is also a destination
-  for (const auto& source : directorySources) {
-    if (directoryDestinations.contains(source)) {
-      m_logger->error("source '{}' cannot simultaneously be a destination",
-                      source.toStdString());
-      return false;
+
+  // direct mounts can be inside of overlays
+  for (overlayFsData_t& entry : m_mounts) {
+    if (entry.mounted && entry.method != MountMethod::Overlay) {
+      Tracer::Scope event(m_tracer.get(), "unmount", "mount", [&] {
+        return Tracer::Args{{"target", entry.target.toStdString()}};
+      });
+      if (!umountDirect(entry)) {
+        return false;
+      }
+      entry.mounted = false;
     }
   }
 
-  for (const auto& dstDir : directoryDestinations) {
-    overlayFsData_t data;
-    data.target = dstDir;
+  for (overlayFsData_t& entry : m_mounts) {
+    // can be false on partial mounts
+    if (!entry.mounted) {
+      continue;
+    }
 
-    // add all sources with this destination
-    for (const auto& entry : m_map) {
-      const QString srcPath = entry.source.absoluteFilePath();
+    Tracer::Scope event(m_tracer.get(), "unmount", "mount", [&] {
+      return Tracer::Args{{"target", entry.target.toStdString()}};
+    });
+    if (entry.fuseBackend != nullptr) {
+      if (!umountBuiltin(entry)) {
+        return false;
+      }
+      entry.mounted = false;
+      continue;
+    }
 
-      if (entry.destination.filePath() == dstDir) {
-        // add as upper dir if m_upperDir has not been set and the directory name is
-        // "overwrite"
-        if (m_upperDir.isEmpty() && entry.source.fileName() == "overwrite"_L1) {
-          data.upperDir = srcPath;
-        } else {
-          data.lowerDirs << srcPath;
-        }
+    if (!runFusermount(entry.target)) {
+      return false;
+    }
+    entry.mounted = false;
+    umountIntermediate(entry);
 
-        // create whiteouts
-        QDirIterator iter(srcPath, QDirIterator::Subdirectories);
-        while (iter.hasNext()) {
-          QFileInfo info = iter.nextFileInfo();
-
-          // check directory blacklist
-          if (info.isDir()) {
-            QString directoryName = info.dir().dirName();
-            if (m_directoryBlacklist.contains(directoryName)) {
-              data.whiteout << info.dir().relativeFilePath(srcPath);
-            }
-          } else {
-            // check file suffix blacklist
-            QString fileName = info.fileName();
-            for (const QString& suffix : m_fileSuffixBlacklist) {
-              if (fileName.endsWith(suffix)) {
-                data.whiteout << info.dir().relativeFilePath(srcPath);
-              }
-            }
-          }
-        }
-      }
+    // whiteout files are kept for the next session or not in the upper dir at all
+    if (!m_artifactStateFile.isEmpty() || !entry.skipLayer.isEmpty()) {
+      continue;
     }
 
-    if (data.upperDir.isEmpty()) {
-      data.upperDir = data.target;
-      m_logger->debug("using target dir '{}' as upper dir", data.target.toStdString());
+    // delete whiteout files
+    for (const QString& whiteout : entry.whiteout + opaqueMarkers(entry)) {
+      QString whiteoutLocation(entry.upperDir % "/"_L1 % whiteout);
+      QFile whiteoutFile(whiteoutLocation);
+
+      // check if the file is actually empty
+      auto size = whiteoutFile.size();
+      if (size != 0) {
+        m_logger->error("[umount] whiteout file '{}' size should be 0, but is {}",
+                        whiteoutLocation, size);
+        continue;
+      }
+      if (!whiteoutFile.remove()) {
+        m_logger->error("[umount] could not remove whiteout file '{}': {}",
+                        whiteoutLocation, whiteoutFile.errorString());
+      } else {
+        m_logger->debug("[umount] deleted whiteout file '{}'", whiteoutLocation);
+      }
     }
+  }
+  m_mounts.clear();
+  m_symlinks.clear();
 
-    // reverse order of lower dirs to get correct priorities
-    std::ranges::reverse(data.lowerDirs);
+  releaseArtifacts();
 
-    // The workdir needs to be an empty directory on the same filesystem as upperDir,
-    // so we just create a QTemporaryDir on the upperDir parent path
-    data.workDir = QTemporaryDir(data.upperDir % "_tmp_XXXXXX"_L1);
-    m_logger->debug("created workdir '{}'", data.workDir.path().toStdString());
+  m_mounted = false;
+  return true;
+}
+
+bool OverlayFsManager::mountOverlayFs(overlayFsData_t& mount) noexcept
+{
+  QStringList stackedDirs = mount.lowerDirs;
+
+  // the skip layer hides files of all lower dirs, so it cannot be part of a group
+  if (!mount.skipLayer.isEmpty()) {
+    stackedDirs.removeOne(mount.skipLayer);
+  }
+  if (!m_baseLayerCacheDir.isEmpty()) {
+    useBaseLayer(mount, stackedDirs);
+  }
+  if (!stackLowerDirs(mount, stackedDirs)) {
+    umountIntermediate(mount);
+    return false;
+  }
+  if (!mount.skipLayer.isEmpty()) {
+    stackedDirs.prepend(mount.skipLayer);
+  }
 
-    m_mounts.push_back(std::move(data));
+  // create lowerDirs string
+  QString lowerDirs;
+  for (const QString& dir : stackedDirs) {
+    lowerDirs += dir % ":"_L1;
+  }
+  // add destination to lowerDirs
+  lowerDirs += mount.target;
+
+  // create arguments
+  QStringList args;
+  args << u"--debug"_s;
+  // the upper dir can be empty for read-only
+  if (!mount.upperDir.isEmpty()) {
+    args << u"-o"_s << u"upperdir=%1"_s.arg(mount.upperDir);
+    args << u"-o"_s << u"workdir=%1"_s.arg(mount.workDir.path());
   }
+  args << u"-o"_s << u"lowerdir=%1"_s.arg(lowerDirs);
+  args << mount.target;
 
+  if (!runOverlayFs(args)) {
+    umountIntermediate(mount);
+    return false;
+  }
   return true;
 }
 
-bool OverlayFsManager::createSymlinks() noexcept
+bool OverlayFsManager::stackLowerDirs(overlayFsData_t& mount,
+                                      QStringList& lowerDirs) noexcept
 {
-  m_logger->debug("creating {} symlinks", m_fileMap.size());
-  for (const auto& [source, destination] : m_fileMap) {
-    m_logger->debug("  - '{}' -> '{}'", source.absoluteFilePath().toStdString(),
-                    destination.absoluteFilePath().toStdString());
+  if (m_maxLowerDirs <= 0) {
+    return true;
   }
 
-  for (const auto& [source, destination] : m_fileMap) {
-    // the file the symlink refers to
-    const QString linkTarget = source.absoluteFilePath();
-    // the actual symlink file
-    const QString linkName = destination.absoluteFilePath();
+  // the target and the skip layer are lower dirs as well
+  const qsizetype groupSize = m_maxLowerDirs;
+  while (lowerDirs.size() + 2 > groupSize) {
+    m_logger->debug("stacking {} lower dirs of '{}' in groups of {}", lowerDirs.size(),
+                    mount.target, groupSize);
+
+    // groups keep the priority order, so the stacked mounts do as well
+    QStringList stacked;
+    for (qsizetype i = 0; i < lowerDirs.size(); i += groupSize) {
+      const QStringList group = lowerDirs.mid(i, groupSize);
+      if (group.size() == 1) {
+        stacked << group.front();
+        continue;
+      }
 
-    // check if targets already exist
-    if (destination.exists()) {
-      const QString newName = linkName % renamedSuffix;
-      m_logger->debug("link name '{}' already exists, renaming it to '{}'",
-                      linkName.toStdString(), newName.toStdString());
-      if (!QFile::rename(linkName, newName)) {
-        m_logger->error("error renaming '{}'", linkName.toStdString());
+      QTemporaryDir& mountPoint = mount.tmpDirs.emplace_back();
+      if (!mountPoint.isValid()) {
+        m_logger->error("error creating mount point: {}", mountPoint.errorString());
         return false;
       }
-    }
 
-    QFile symlinkFile(linkTarget);
-    if (!symlinkFile.link(linkName)) {
-      m_logger->error("error creating symlink '{}': {}", linkTarget.toStdString(),
-                      symlinkFile.errorString().toStdString());
-      return false;
+      // without an upper dir the mount is read-only
+      const QStringList args{u"--debug"_s, u"-o"_s,
+                             u"lowerdir=%1"_s.arg(group.join(':')),
+                             mountPoint.path()};
+      if (!runOverlayFs(args)) {
+        return false;
+      }
+      mount.intermediateMounts << mountPoint.path();
+      stacked << mountPoint.path();
     }
-    m_logger->debug("created symlink '{}' -> '{}'", linkName.toStdString(),
-                    linkTarget.toStdString());
-    m_createdSymlinks << linkName;
+
+    lowerDirs = std::move(stacked);
   }
+
   return true;
 }
 
-void OverlayFsManager::cleanup() noexcept
+void OverlayFsManager::useBaseLayer(overlayFsData_t& mount,
+                                    QStringList& lowerDirs) noexcept
 {
-  for (const auto& file : m_createdWhiteoutFiles) {
-    QFile f(file);
-    // check file size
-    qint64 size = f.size();
-    if (size != 0) {
-      m_logger->error("error removing whiteout file '{}', size should be 0, but is {}",
-                      file.toStdString(), size);
-      continue;
+  const SkipRules rules = skipRules(m_mountPlan);
+
+  // fingerprints of the lower dirs from lowest to highest priority, compared to the
+  // previous session of this target. Files are checked as well, base layers hold
+  // clones of the files that do not follow changes made in place.
+  QStringList stamps;
+  for (auto it = lowerDirs.crbegin(); it != lowerDirs.crend(); ++it) {
+    const auto listing = m_layerCache->get(it->toStdString(), rules);
+    stamps << QString::number(listing->fingerprint(), 16) % " "_L1 %
+                  QString::number(listing->fileFingerprint(), 16) % " "_L1 % *it;
+  }
+
+  const auto hashOf = [](const QStringList& values) {
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    for (const QString& value : values) {
+      hash.addData(value.toUtf8());
+      hash.addData("\0"_ba);
+    }
+    return QString::fromLatin1(hash.result().toHex());
+  };
+
+  QSaveFile stateFile(m_baseLayerCacheDir % "/"_L1 % hashOf({mount.target}) %
+                      ".json"_L1);
+  QStringList previous;
+  {
+    QFile file(stateFile.fileName());
+    if (file.open(QIODevice::ReadOnly)) {
+      previous = toStringList(QJsonDocument::fromJson(file.readAll()).array());
     }
-    f.remove();
   }
-  m_createdWhiteoutFiles.clear();
 
-  // reverse directory list
-  // required because it is created in the order a -> a/b -> a/b/c
-  ranges::reverse(m_createdDirectories);
+  if (stateFile.open(QIODevice::WriteOnly)) {
+    stateFile.write(QJsonDocument(QJsonArray::fromStringList(stamps)).toJson());
+  }
+  if (!stateFile.commit()) {
+    m_logger->warn("error writing base layer state '{}': {}", stateFile.fileName(),
+                   stateFile.errorString());
+  }
 
-  // remove previously created directories
-  for (const auto& dir : m_createdDirectories) {
-    string dirString = dir.toStdString();
-    m_logger->debug("deleting directory '{}'", dirString);
-    error_code ec;
-    // remove only removes empty directories
-    fs::remove(dirString, ec);
-    if (ec) {
-      m_logger->warn("error removing directory '{}', {}", dirString, ec.message());
-    }
+  qsizetype stable = 0;
+  while (stable < stamps.size() && stable < previous.size() &&
+         stamps[stable] == previous[stable]) {
+    ++stable;
+  }
+  if (stable < minBaseLayerDirs) {
+    return;
   }
-  m_createdDirectories.clear();
 
-  // remove symlinks
-  for (const auto& file : m_createdSymlinks) {
-    m_logger->debug("removing symlink '{}'", file.toStdString());
-    QFile symlinkFile(file);
-    if (!symlinkFile.remove()) {
-      m_logger->error("error removing symlink '{}': {}", file.toStdString(),
-                      symlinkFile.errorString().toStdString());
-      continue;
+  QStringList key = stamps.first(stable);
+  key << m_mountPlan.skipFileSuffixes() << u"/"_s << m_mountPlan.skipDirectories();
+  const QString layerPath = m_baseLayerCacheDir % "/"_L1 % hashOf(key);
+  const QStringList merged = lowerDirs.last(stable);
+
+  auto lock = lockLayer(layerPath, LOCK_SH);
+  if (lock == nullptr) {
+    m_logger->warn("error locking base layer '{}'", layerPath);
+    return;
+  }
+
+  if (QFileInfo::exists(layerPath)) {
+    m_logger->debug("reusing base layer '{}' for {} lower dirs of '{}'",
+                    layerPath, stable, mount.target);
+    // update the modification time to keep recently used layers in the cache
+    utimes(layerPath.toStdString().c_str(), nullptr);
+  } else {
+    m_logger->debug("creating base layer '{}' from {} lower dirs of '{}'",
+                    layerPath, stable, mount.target);
+
+    vector<shared_ptr<const LayerListing>> listings;
+    for (const QString& lowerDir : merged) {
+      listings.push_back(m_layerCache->get(lowerDir.toStdString(), rules));
     }
-    // restore the original file if it was renamed
-    const QString renamedFilePath = file % renamedSuffix;
-    if (QFileInfo::exists(renamedFilePath)) {
-      QFile renamedFile(renamedFilePath);
-      if (!renamedFile.rename(file)) {
-        m_logger->error("error renaming file '{}' to original filename '{}': {}",
-                        renamedFilePath.toStdString(), file.toStdString(),
-                        renamedFile.errorString().toStdString());
-      }
+
+    // layers are built in a temporary directory and renamed once complete
+    const QString buildPath = layerPath % buildSuffix;
+    QDir(buildPath).removeRecursively();
+
+    string error;
+    if (!materializeLayers(listings, buildPath.toStdString(), error) ||
+        rename(buildPath.toStdString().c_str(), layerPath.toStdString().c_str()) != 0) {
+      m_logger->warn("error creating base layer for '{}': {}", mount.target,
+                     error.empty() ? strerror(errno) : error);
+      QDir(buildPath).removeRecursively();
+      return;
     }
   }
-  m_createdSymlinks.clear();
+
+  lowerDirs.resize(lowerDirs.size() - stable);
+  lowerDirs << layerPath;
+  mount.baseLayer = layerPath;
+  mount.layerLocks.push_back(std::move(lock));
 }
 
-bool OverlayFsManager::mountInternal()
+bool OverlayFsManager::runOverlayFs(const QStringList& args) noexcept
 {
-  m_logger->debug("mounting");
-  if (m_mounted) {
-    m_logger->debug("already mounted");
-    return true;
+  PhaseTimer timer(m_statistics, m_tracer.get(),
+                   u"fuse-overlayfs '%1'"_s.arg(args.last()));
+  ++m_statistics.processes;
+  for (const QString& arg : args) {
+    if (arg.startsWith("lowerdir="_L1)) {
+      m_statistics.lowerDirBytes += arg.toUtf8().size() - "lowerdir="_L1.size();
+    }
   }
 
-  if (isAnythingMounted()) {
-    m_logger->warn("partial mount detected, not mounting");
-    return false;
-  }
+  QProcess p;
+  p.setProgram(m_overlayFsProgram);
+  p.setProcessChannelMode(QProcess::MergedChannels);
+  p.setArguments(args);
 
-  if (!prepareMounts()) {
-    m_logger->error("error processing mount info");
-    return false;
-  }
+  m_logger->debug("mounting overlay fs with command: {} {}",
+                  p.program(), p.arguments().join(' '));
 
-  if (!createSymlinks()) {
-    m_logger->error("error creating symlinks");
+  p.start();
+  if (!p.waitForFinished(processTimeout())) {
+    m_logger->error("mount error: {}", p.errorString());
     return false;
   }
 
-  for (auto& mount : m_mounts) {
-    // create lowerDirs string
-    QString lowerDirs;
-    for (const QString& dir : mount.lowerDirs) {
-      lowerDirs += dir % ":"_L1;
-    }
-    // add destination to lowerDirs
-    lowerDirs += mount.target;
+  QString str       = p.readAll();
+  QStringList lines = str.split('\n');
 
-    if (mount.upperDir.isEmpty() && !mount.whiteout.empty()) {
-      m_logger->warn("cannot create whiteout files without upper dir");
-    } else {
-      // create whiteout files
-      for (const auto& whiteout : mount.whiteout) {
-        QString whiteoutPath  = mount.upperDir % "/"_L1 % whiteout;
-        fs::path whiteoutFile = whiteoutPath.toStdString();
-        if (!createDirectories(whiteoutFile.parent_path())) {
-          return false;
-        }
-        // create a character device with device number 0/0
-        int r = mknod(whiteoutFile.c_str(), S_IFCHR, makedev(0, 0));
-        if (r != 0) {
-          const int e = errno;
-          m_logger->error("could not create whiteout file {}: {}",
-                          whiteoutFile.string(), strerror(e));
-          return false;
-        }
-        m_createdWhiteoutFiles.emplace_back(whiteoutPath);
-      }
+  for (const auto& line : lines) {
+    if (!line.isEmpty()) {
+      m_logger->info(line);
     }
+  }
 
-    QProcess p;
-    p.setProgram(u"fuse-overlayfs"_s);
-    p.setProcessChannelMode(QProcess::MergedChannels);
-
-    // create arguments
-    QStringList args;
-    args << u"--debug"_s;
-    // the upper dir can be empty for read-only
-    if (!mount.upperDir.isEmpty()) {
-      args << u"-o"_s << u"upperdir=%1"_s.arg(mount.upperDir);
-      args << u"-o"_s << u"workdir=%1"_s.arg(mount.workDir.path());
-    }
-    args << u"-o"_s << u"lowerdir=%1"_s.arg(lowerDirs);
-    args << mount.target;
+  if (p.exitCode() != 0) {
+    const int e = errno;
+    m_logger->error("mount failed with exit code {}: {}, errno: {}", p.exitCode(),
+                    p.errorString(), strerror(e));
+    return false;
+  }
 
-    p.setArguments(args);
+  return true;
+}
 
-    m_logger->debug("mounting overlay fs with command: {} {}",
-                    p.program().toStdString(), p.arguments().join(' ').toStdString());
+bool OverlayFsManager::runFusermount(const QString& target) noexcept
+{
+  m_logger->debug("running \"{} -u {}\"", m_fusermountProgram, target);
+  Tracer::Scope event(m_tracer.get(), "fusermount", "process", [&] {
+    return Tracer::Args{{"target", target.toStdString()}};
+  });
 
-    p.start();
-    if (!p.waitForFinished(timeout)) {
-      m_logger->error("mount error: {}", p.errorString().toStdString());
-      return false;
-    }
+  QProcess p;
+  p.setProgram(m_fusermountProgram);
+  p.setArguments({u"-u"_s, target});
+  p.start();
+  bool result = p.waitForFinished(processTimeout());
 
-    QString str       = p.readAll();
-    QStringList lines = str.split('\n');
+  if (!result || p.exitCode() != 0) {
+    m_logger->error("fusermount returned {}", p.exitCode());
+    m_logger->error("stdout: {}", p.readAllStandardOutput());
+    m_logger->error("stderr: {}", p.readAllStandardError());
+    return false;
+  }
+  return true;
+}
 
-    for (const auto& line : lines) {
-      if (!line.isEmpty()) {
-        m_logger->info(line.toStdString());
-      }
+void OverlayFsManager::umountIntermediate(overlayFsData_t& mount) noexcept
+{
+  // later mounts can use earlier ones as lower dirs
+  while (!mount.intermediateMounts.isEmpty()) {
+    const QString mountPoint = mount.intermediateMounts.takeLast();
+    if (!runFusermount(mountPoint)) {
+      m_logger->error("could not unmount '{}'", mountPoint);
     }
+  }
+}
 
-    if (p.exitCode() != 0) {
+bool OverlayFsManager::mountDirect(overlayFsData_t& mount) noexcept
+{
+  const string source = mount.sources.front().toStdString();
+  const string target = mount.target.toStdString();
+
+  if (mount.method == MountMethod::BindMount) {
+    m_logger->debug("bind mounting '{}' on '{}'", source, target);
+    if (::mount(source.c_str(), target.c_str(), nullptr, MS_BIND, nullptr) != 0) {
       const int e = errno;
-      m_logger->error("mount failed with exit code {}: {}, errno: {}", p.exitCode(),
-                      p.errorString().toStdString(), strerror(e));
+      m_logger->error("error bind mounting '{}': {}", target, strerror(e));
       return false;
     }
+    return true;
+  }
 
-    mount.mounted = true;
+  // an empty target directory is recreated when unmounting
+  if (QFileInfo(mount.target).isDir()) {
+    if (!QDir().rmdir(mount.target)) {
+      m_logger->error("error removing empty directory '{}'", target);
+      return false;
+    }
+    mount.replacedTarget = true;
   }
 
-  m_mounted = true;
+  m_logger->debug("creating symlink '{}' -> '{}'", target, source);
+  if (symlink(source.c_str(), target.c_str()) != 0) {
+    const int e = errno;
+    m_logger->error("error creating symlink '{}': {}", target, strerror(e));
+    return false;
+  }
   return true;
 }
 
-bool OverlayFsManager::umountInternal()
+bool OverlayFsManager::umountDirect(overlayFsData_t& mount) noexcept
 {
-  m_logger->debug("unmounting");
+  const string target = mount.target.toStdString();
 
-  if (!m_mounted || !isAnythingMounted()) {
-    m_logger->debug("not mounted");
+  if (mount.method == MountMethod::BindMount) {
+    m_logger->debug("unmounting bind mount '{}'", target);
+    if (umount2(target.c_str(), 0) != 0) {
+      const int e = errno;
+      m_logger->error("error unmounting '{}': {}", target, strerror(e));
+      return false;
+    }
     return true;
   }
 
-  if (m_mounts.empty()) {
-    m_logger->debug("m_mounts is empty");
-    return true;
+  m_logger->debug("removing symlink '{}'", target);
+  if (!QFileInfo(mount.target).isSymLink() || !QFile::remove(mount.target)) {
+    m_logger->error("error removing symlink '{}'", target);
+    return false;
+  }
+  if (mount.replacedTarget && !QDir().mkdir(mount.target)) {
+    m_logger->error("error restoring directory '{}'", target);
+    return false;
   }
+  return true;
+}
 
-  for (overlayFsData_t& entry : m_mounts) {
-    // can be false on partial mounts
-    if (!entry.mounted) {
-      continue;
+bool OverlayFsManager::mountBuiltin() noexcept
+{
+#ifdef OVERLAYFS_BUILTIN_BACKEND
+  // the trees are built after the symlinks were created, so they are part of the
+  // targets, and skip the entries of the plan instead of the current ones
+  const SkipRules rules = skipRules(m_mountPlan);
+  const auto layersOf  = [&](const overlayFsData_t& mount) {
+    return layerSources(layerStack_t{mount.target, mount.upperDir, mount.lowerDirs,
+                                     mount.sources, mount.whiteout, mount.opaque},
+                        m_symlinks, rules);
+  };
+
+  auto overlays = m_mounts | views::filter([](const overlayFsData_t& mount) {
+    return mount.method == MountMethod::Overlay;
+  });
+
+  shared_ptr<FuseBackend::SharedTree> sharedTree;
+  if (m_consolidateMounts) {
+    auto tree = make_unique<VirtualFileTree>();
+    for (const auto& mount : overlays) {
+      tree->addLayers(mount.target.toStdString(), layersOf(mount));
     }
 
-    m_logger->debug("running \"fusermount -u {}\"", entry.target.toStdString());
+    m_logger->debug("serving {} targets from a single tree, {} nodes in {} layers",
+                    ranges::distance(overlays), tree->nodeCount(), tree->layerCount());
+    sharedTree = make_shared<FuseBackend::SharedTree>(std::move(tree));
+  }
 
-    QProcess p;
-    p.setProgram(u"fusermount"_s);
-    p.setArguments({u"-u"_s, entry.target});
-    p.start();
-    bool result = p.waitForFinished(timeout);
+  for (auto& mount : overlays) {
+    shared_ptr<FuseBackend::SharedTree> tree = sharedTree;
+    if (tree == nullptr) {
+      auto targetTree = make_unique<VirtualFileTree>();
+      targetTree->addLayers(mount.target.toStdString(), layersOf(mount));
 
-    if (!result || p.exitCode() != 0) {
-      m_logger->error("fusermount returned {}", p.exitCode());
-      m_logger->error("stdout: {}", p.readAllStandardOutput().toStdString());
-      m_logger->error("stderr: {}", p.readAllStandardError().toStdString());
-      return false;
+      m_logger->debug("mounting '{}' with the builtin backend, {} nodes in {} layers",
+                      mount.target, targetTree->nodeCount(), targetTree->layerCount());
+      tree = make_shared<FuseBackend::SharedTree>(std::move(targetTree));
+    } else {
+      m_logger->debug("mounting '{}' with the builtin backend", mount.target);
     }
-    entry.mounted = false;
 
-    // delete whiteout files
-    for (const QString& whiteout : entry.whiteout) {
-      QString whiteoutLocation(entry.upperDir % "/"_L1 % whiteout);
-      QFile whiteoutFile(whiteoutLocation);
-
-      // check if the file is actually empty
-      auto size = whiteoutFile.size();
-      if (size != 0) {
-        m_logger->error("[umount] whiteout file '{}' size should be 0, but is {}",
-                        whiteoutLocation.toStdString(), size);
-        continue;
-      }
-      if (!whiteoutFile.remove()) {
-        m_logger->error("[umount] could not remove whiteout file '{}': {}",
-                        whiteoutLocation.toStdString(),
-                        whiteoutFile.errorString().toStdString());
-      } else {
-        m_logger->debug("[umount] deleted whiteout file '{}'",
-                        whiteoutLocation.toStdString());
-      }
+    PhaseTimer timer(m_statistics, m_tracer.get(), u"mount '%1'"_s.arg(mount.target));
+    Tracer::Scope event(m_tracer.get(), "mount", "mount", [&] {
+      return Tracer::Args{{"target", mount.target.toStdString()}};
+    });
+    auto backend = FuseBackend::create(std::move(tree), mount.target.toStdString(),
+                                       mount.upperDir.toStdString());
+    string error;
+    if (!backend->mount(error)) {
+      m_logger->error("mount failed: {}", error);
+      return false;
     }
+
+    mount.fuseBackend = std::move(backend);
+    mount.mounted     = true;
   }
-  m_mounts.clear();
 
-  cleanup();
+  return true;
+#else
+  m_logger->error("cannot mount, the builtin backend is not available");
+  return false;
+#endif
+}
 
-  m_mounted = false;
+bool OverlayFsManager::umountBuiltin(overlayFsData_t& mount) noexcept
+{
+#ifdef OVERLAYFS_BUILTIN_BACKEND
+  m_logger->debug("unmounting '{}'", mount.target);
+
+  string error;
+  if (!mount.fuseBackend->unmount(error)) {
+    m_logger->error("unmount failed: {}", error);
+    return false;
+  }
+  mount.fuseBackend.reset();
+  return true;
+#else
+  mount.fuseBackend.reset();
   return true;
+#endif
+}
+
+QStringList OverlayFsManager::opaqueMarkers(const overlayFsData_t& mount)
+{
+  QStringList markers;
+  markers.reserve(mount.opaque.size());
+  for (const QString& dir : mount.opaque) {
+    markers << dir % "/"_L1 % opaqueMarker;
+  }
+  return markers;
 }
 
 bool OverlayFsManager::isAnythingMounted() const noexcept
@@ -765,11 +2994,11 @@ bool OverlayFsManager::createDirectories(const QString& directory) noexcept
 
 bool OverlayFsManager::createDirectories(const std::string& directory) noexcept
 {
-  // iterate over path segments
-  size_t i = 0;
-  size_t pos;
+  // iterate over path segments, including the last one
+  size_t pos = 0;
 
-  while ((pos = directory.find_first_of('/', i)) != string::npos) {
+  while (pos != string::npos) {
+    pos        = directory.find_first_of('/', pos + 1);
     string dir = directory.substr(0, pos);
     if (!filesystem::exists(dir)) {
       // directory does not exist, create it
@@ -785,7 +3014,6 @@ bool OverlayFsManager::createDirectories(const std::string& directory) noexcept
       // store path for later deletion
       m_createdDirectories << QString::fromStdString(dir);
     }
-    i = pos + 1;
   }
 
   return true;
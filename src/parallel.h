@@ -0,0 +1,39 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Calls function(i) for every i in [0, count), distributed over up to one thread
+ * per core. The calling thread takes part in the work, returns when all calls are done.
+ */
+template <typename Function>
+void parallelFor(std::size_t count, Function&& function)
+{
+  const std::size_t threadCount =
+      std::min<std::size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+
+  if (threadCount <= 1) {
+    for (std::size_t i = 0; i < count; ++i) {
+      function(i);
+    }
+    return;
+  }
+
+  std::atomic<std::size_t> next = 0;
+  const auto worker = [&] {
+    for (std::size_t i = next++; i < count; i = next++) {
+      function(i);
+    }
+  };
+
+  std::vector<std::jthread> threads;
+  threads.reserve(threadCount - 1);
+  for (std::size_t i = 1; i < threadCount; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+}
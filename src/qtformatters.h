@@ -0,0 +1,40 @@
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <string_view>
+
+#include <spdlog/fmt/fmt.h>
+
+// formatters for Qt strings, so log arguments are only converted to UTF-8 if the
+// message is actually logged
+
+#ifdef SPDLOG_USE_STD_FORMAT
+#define OVERLAYFS_FORMAT_NAMESPACE std
+#else
+#define OVERLAYFS_FORMAT_NAMESPACE fmt
+#endif
+
+template <>
+struct OVERLAYFS_FORMAT_NAMESPACE::formatter<QByteArray>
+    : OVERLAYFS_FORMAT_NAMESPACE::formatter<std::string_view>
+{
+  auto format(const QByteArray& value, auto& context) const
+  {
+    return formatter<std::string_view>::format(
+        std::string_view(value.constData(), static_cast<size_t>(value.size())),
+        context);
+  }
+};
+
+template <>
+struct OVERLAYFS_FORMAT_NAMESPACE::formatter<QString>
+    : OVERLAYFS_FORMAT_NAMESPACE::formatter<QByteArray>
+{
+  auto format(const QString& value, auto& context) const
+  {
+    return formatter<QByteArray>::format(value.toUtf8(), context);
+  }
+};
+
+#undef OVERLAYFS_FORMAT_NAMESPACE
@@ -0,0 +1,142 @@
+#include "tracer.h"
+
+#include <cstdio>
+#include <fstream>
+#include <unistd.h>
+
+using namespace std;
+
+// appends a JSON string literal
+static void appendString(string& out, string_view value)
+{
+  out += '"';
+  for (const char c : value) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        out += escaped;
+      } else {
+        out += c;
+      }
+      break;
+    }
+  }
+  out += '"';
+}
+
+Tracer::Scope::Scope(Tracer* tracer, string name, string category, Args args)
+    : m_tracer(tracer)
+{
+  if (m_tracer != nullptr) {
+    m_name     = std::move(name);
+    m_category = std::move(category);
+    m_args     = std::move(args);
+    m_start    = Clock::now();
+  }
+}
+
+Tracer::Scope::~Scope()
+{
+  if (m_tracer != nullptr) {
+    m_tracer->record(std::move(m_name), std::move(m_category), m_start, Clock::now(),
+                     currentThread(), std::move(m_args));
+  }
+}
+
+void Tracer::record(string name, string category, Clock::time_point start,
+                    Clock::time_point end, uint64_t thread, Args args)
+{
+  using chrono::duration_cast;
+  using chrono::microseconds;
+
+  event_t event{std::move(name),
+                std::move(category),
+                std::move(args),
+                duration_cast<microseconds>(start - m_start).count(),
+                duration_cast<microseconds>(end - start).count(),
+                thread};
+
+  scoped_lock lock(m_mutex);
+  m_events.push_back(std::move(event));
+}
+
+bool Tracer::write(const string& path, string& error) const
+{
+  string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  {
+    scoped_lock lock(m_mutex);
+    const string pid = to_string(getpid());
+    for (size_t i = 0; i < m_events.size(); ++i) {
+      const event_t& event = m_events[i];
+      out += i == 0 ? "\n" : ",\n";
+      out += "{\"name\":";
+      appendString(out, event.name);
+      out += ",\"cat\":";
+      appendString(out, event.category);
+      out += ",\"ph\":\"X\",\"ts\":" + to_string(event.timestamp) +
+             ",\"dur\":" + to_string(event.duration) + ",\"pid\":" + pid +
+             ",\"tid\":" + to_string(event.thread);
+      if (!event.args.empty()) {
+        out += ",\"args\":{";
+        for (size_t j = 0; j < event.args.size(); ++j) {
+          if (j > 0) {
+            out += ',';
+          }
+          appendString(out, event.args[j].first);
+          out += ':';
+          appendString(out, event.args[j].second);
+        }
+        out += '}';
+      }
+      out += '}';
+    }
+  }
+  out += "\n]}\n";
+
+  // write to a temporary file first, so viewers never see a partial trace
+  const string temporary = path + ".tmp";
+  {
+    ofstream file(temporary, ios::binary | ios::trunc);
+    if (!file || !file.write(out.data(), static_cast<streamsize>(out.size())) ||
+        !file.flush()) {
+      error = "could not write '" + temporary + "'";
+      return false;
+    }
+  }
+  if (rename(temporary.c_str(), path.c_str()) != 0) {
+    error = "could not replace '" + path + "'";
+    return false;
+  }
+  return true;
+}
+
+void Tracer::clear()
+{
+  scoped_lock lock(m_mutex);
+  m_events.clear();
+}
+
+bool Tracer::empty() const
+{
+  scoped_lock lock(m_mutex);
+  return m_events.empty();
+}
+
+uint64_t Tracer::currentThread() noexcept
+{
+  return static_cast<uint64_t>(gettid());
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <chrono>
+#include <concepts>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Thread-safe recorder of timed events, written in the Chrome trace event format that
+ * chrome://tracing and Perfetto can display
+ */
+class Tracer
+{
+public:
+  using Clock = std::chrono::steady_clock;
+  using Args  = std::vector<std::pair<std::string, std::string>>;
+
+  /**
+   * Records the time from its construction to its destruction as an event on the
+   * current thread, does nothing without a tracer
+   */
+  class Scope
+  {
+  public:
+    Scope(Tracer* tracer, std::string name, std::string category, Args args = {});
+
+    /**
+     * @param args Returns the arguments of the event, only called with a tracer so
+     * nothing is converted while tracing is disabled
+     */
+    template <std::invocable MakeArgs>
+    Scope(Tracer* tracer, std::string name, std::string category, MakeArgs&& args)
+        : Scope(tracer, std::move(name), std::move(category))
+    {
+      if (m_tracer != nullptr) {
+        m_args = std::forward<MakeArgs>(args)();
+      }
+    }
+
+    ~Scope();
+
+    Scope(const Scope&)            = delete;
+    Scope& operator=(const Scope&) = delete;
+
+  private:
+    Tracer* m_tracer;
+    std::string m_name;
+    std::string m_category;
+    Args m_args;
+    Clock::time_point m_start;
+  };
+
+  /**
+   * @brief Records an event that started and ended at the given times
+   * @param thread Id of the thread the event belongs to, see currentThread()
+   */
+  void record(std::string name, std::string category, Clock::time_point start,
+              Clock::time_point end, std::uint64_t thread, Args args = {});
+
+  /**
+   * @brief Writes all recorded events to a file, replacing it
+   * @param error Receives a description of the error if writing failed
+   */
+  [[nodiscard]] bool write(const std::string& path, std::string& error) const;
+
+  void clear();
+
+  [[nodiscard]] bool empty() const;
+
+  /**
+   * @brief Returns the id of the calling thread as shown by the system
+   */
+  [[nodiscard]] static std::uint64_t currentThread() noexcept;
+
+private:
+  struct event_t
+  {
+    std::string name;
+    std::string category;
+    Args args;
+    // microseconds since the tracer was created
+    std::int64_t timestamp;
+    std::int64_t duration;
+    std::uint64_t thread;
+  };
+
+  mutable std::mutex m_mutex;
+  std::vector<event_t> m_events;
+  const Clock::time_point m_start = Clock::now();
+};
@@ -0,0 +1,308 @@
+#include "virtualfiletree.h"
+
+using namespace std;
+
+VirtualFileTree::VirtualFileTree()
+{
+  m_nodes.emplace_back(invalidNode, intern({}), invalidNode, invalidNode, noLayer,
+                       LayerListing::EntryType::Directory, 0);
+}
+
+void VirtualFileTree::addLayers(const string& destination,
+                                span<const LayerSource> layers)
+{
+  const NodeId target = createDirectories(rootNode, destination, noLayer);
+  removeChildren(target);
+
+  const LayerId firstLayer = static_cast<LayerId>(m_layers.size());
+  vector<shared_ptr<const LayerListing>> listings;
+  listings.reserve(layers.size());
+  for (const LayerSource& source : layers) {
+    m_layers.emplace_back(source.listing->root(), source.destination);
+    listings.push_back(source.listing);
+  }
+
+  if (!layers.empty()) {
+    m_nodes[target].layer = firstLayer;
+  }
+
+  // nodes of visible directories, keyed by their path relative to the destination
+  unordered_map<string_view, NodeId> directories;
+
+  mergeLayers(listings, [&](const LayerListing::Entry& entry, size_t index) {
+    const LayerId layer = firstLayer + static_cast<LayerId>(index);
+
+    string_view name = entry.path;
+    NodeId parent    = target;
+
+    const size_t pos = entry.path.rfind('/');
+    if (pos != string::npos) {
+      const string_view parentPath(entry.path.data(), pos);
+      name = string_view(entry.path).substr(pos + 1);
+
+      const auto it = directories.find(parentPath);
+      if (it != directories.end()) {
+        parent = it->second;
+      } else {
+        // parents of single file layers are provided by lower layers
+        parent = createDirectories(target, parentPath, noLayer);
+      }
+    }
+
+    const NodeId node = addChild(parent, name, entry.type, entry.size, layer);
+    if (entry.type == LayerListing::EntryType::Directory) {
+      directories.emplace(entry.path, node);
+    }
+    return true;
+  });
+}
+
+VirtualFileTree::NodeId VirtualFileTree::insert(NodeId parent, string_view name,
+                                                LayerListing::EntryType type,
+                                                uint64_t size, LayerId layer)
+{
+  const NodeId existing = child(parent, name);
+  if (existing != invalidNode) {
+    m_nodes[existing].type  = type;
+    m_nodes[existing].size  = size;
+    m_nodes[existing].layer = layer;
+    return existing;
+  }
+  return addChild(parent, name, type, size, layer);
+}
+
+void VirtualFileTree::remove(NodeId id)
+{
+  removeChildren(id);
+  unlink(id);
+}
+
+void VirtualFileTree::move(NodeId id, NodeId newParent, string_view newName)
+{
+  unlink(id);
+
+  Node& node       = m_nodes[id];
+  node.parent      = newParent;
+  node.name        = intern(newName);
+  node.nextSibling = m_nodes[newParent].firstChild;
+  m_nodes[newParent].firstChild = id;
+  m_children[childKey(newParent, node.name)] = id;
+}
+
+VirtualFileTree::LayerId VirtualFileTree::addLayer(Layer layer)
+{
+  m_layers.push_back(std::move(layer));
+  return static_cast<LayerId>(m_layers.size() - 1);
+}
+
+VirtualFileTree::NodeId VirtualFileTree::resolve(string_view path) const
+{
+  NodeId node = rootNode;
+
+  size_t start = 0;
+  while (node != invalidNode && start < path.size()) {
+    size_t end = path.find('/', start);
+    if (end == string_view::npos) {
+      end = path.size();
+    }
+    if (end > start) {
+      node = child(node, path.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+
+  return node;
+}
+
+VirtualFileTree::NodeId VirtualFileTree::child(NodeId parent, string_view name) const
+{
+  const auto nameIt = m_nameIds.find(name);
+  if (nameIt == m_nameIds.end()) {
+    return invalidNode;
+  }
+
+  const auto it = m_children.find(childKey(parent, nameIt->second));
+  return it == m_children.end() ? invalidNode : it->second;
+}
+
+void VirtualFileTree::forEachChild(NodeId parent,
+                                   const function<bool(NodeId)>& callback) const
+{
+  for (NodeId id = m_nodes[parent].firstChild; id != invalidNode;
+       id        = m_nodes[id].nextSibling) {
+    if (!callback(id)) {
+      return;
+    }
+  }
+}
+
+bool VirtualFileTree::walk(NodeId node,
+                           const function<bool(NodeId, const string&)>& callback) const
+{
+  struct Frame
+  {
+    NodeId next;
+    size_t pathSize;
+  };
+
+  string path = this->path(node);
+  vector<Frame> stack{{m_nodes[node].firstChild, path.size()}};
+
+  while (!stack.empty()) {
+    Frame& frame = stack.back();
+    if (frame.next == invalidNode) {
+      stack.pop_back();
+      continue;
+    }
+
+    const NodeId id = frame.next;
+    frame.next      = m_nodes[id].nextSibling;
+
+    path.resize(frame.pathSize);
+    path += '/';
+    path += name(id);
+
+    if (!callback(id, path)) {
+      return false;
+    }
+
+    if (m_nodes[id].firstChild != invalidNode) {
+      stack.emplace_back(m_nodes[id].firstChild, path.size());
+    }
+  }
+
+  return true;
+}
+
+string VirtualFileTree::path(NodeId id) const
+{
+  vector<string_view> components;
+  for (; id != rootNode && id != invalidNode; id = m_nodes[id].parent) {
+    components.push_back(name(id));
+  }
+
+  string result;
+  for (auto it = components.rbegin(); it != components.rend(); ++it) {
+    result += '/';
+    result += *it;
+  }
+  return result;
+}
+
+string VirtualFileTree::sourcePath(NodeId id) const
+{
+  const LayerId layerId = m_nodes[id].layer;
+  if (layerId == noLayer) {
+    // directories outside of all stacks are not overlaid
+    return path(id);
+  }
+
+  const Layer& layer = m_layers[layerId];
+  if (layer.root.empty()) {
+    return {};
+  }
+
+  const string virtualPath = path(id);
+  if (virtualPath.size() <= layer.destination.size()) {
+    return layer.root;
+  }
+  return layer.root + virtualPath.substr(layer.destination.size());
+}
+
+uint32_t VirtualFileTree::intern(string_view name)
+{
+  const auto it = m_nameIds.find(name);
+  if (it != m_nameIds.end()) {
+    return it->second;
+  }
+
+  const auto id = static_cast<uint32_t>(m_names.size());
+  m_names.emplace_back(name);
+  m_nameIds.emplace(m_names.back(), id);
+  return id;
+}
+
+VirtualFileTree::NodeId VirtualFileTree::addChild(NodeId parent, string_view name,
+                                                  LayerListing::EntryType type,
+                                                  uint64_t size, LayerId layer)
+{
+  const uint32_t nameId = intern(name);
+  const auto [it, inserted] =
+      m_children.try_emplace(childKey(parent, nameId), static_cast<NodeId>(0));
+  if (!inserted) {
+    // directories created for the parents of single file layers
+    Node& existing = m_nodes[it->second];
+    if (existing.layer == noLayer || type != LayerListing::EntryType::Directory) {
+      existing.layer = layer;
+      existing.type  = type;
+      existing.size  = size;
+    }
+    return it->second;
+  }
+
+  const auto id = static_cast<NodeId>(m_nodes.size());
+  it->second    = id;
+  m_nodes.emplace_back(parent, nameId, invalidNode, m_nodes[parent].firstChild, layer,
+                       type, size);
+  m_nodes[parent].firstChild = id;
+  return id;
+}
+
+VirtualFileTree::NodeId VirtualFileTree::createDirectories(NodeId parent,
+                                                           string_view path,
+                                                           LayerId layer)
+{
+  size_t start = 0;
+  while (start < path.size()) {
+    size_t end = path.find('/', start);
+    if (end == string_view::npos) {
+      end = path.size();
+    }
+    if (end > start) {
+      const string_view name = path.substr(start, end - start);
+      const NodeId existing  = child(parent, name);
+      parent = existing != invalidNode
+                   ? existing
+                   : addChild(parent, name, LayerListing::EntryType::Directory, 0, layer);
+    }
+    start = end + 1;
+  }
+  return parent;
+}
+
+void VirtualFileTree::removeChildren(NodeId parent)
+{
+  vector<NodeId> stack;
+  for (NodeId id = m_nodes[parent].firstChild; id != invalidNode;
+       id        = m_nodes[id].nextSibling) {
+    stack.push_back(id);
+  }
+  m_nodes[parent].firstChild = invalidNode;
+
+  // removed nodes stay allocated but are no longer reachable
+  while (!stack.empty()) {
+    const NodeId id = stack.back();
+    stack.pop_back();
+    m_children.erase(childKey(m_nodes[id].parent, m_nodes[id].name));
+    for (NodeId child = m_nodes[id].firstChild; child != invalidNode;
+         child        = m_nodes[child].nextSibling) {
+      stack.push_back(child);
+    }
+  }
+}
+
+void VirtualFileTree::unlink(NodeId id)
+{
+  Node& node = m_nodes[id];
+  m_children.erase(childKey(node.parent, node.name));
+
+  // remove the node from the child list of its parent
+  NodeId* link = &m_nodes[node.parent].firstChild;
+  while (*link != invalidNode && *link != id) {
+    link = &m_nodes[*link].nextSibling;
+  }
+  if (*link == id) {
+    *link = node.nextSibling;
+  }
+  node.nextSibling = invalidNode;
+}
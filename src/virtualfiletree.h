@@ -0,0 +1,164 @@
+#pragma once
+
+#include "layerlisting.h"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Layer listing together with the path it is mapped to
+ */
+struct LayerSource
+{
+  std::shared_ptr<const LayerListing> listing;
+  // absolute path the root of the listing is mapped to
+  std::string destination;
+};
+
+/**
+ * Merged view of all layer stacks, built in memory from layer listings.
+ * Path components are interned and every node stores the layer providing it, so
+ * resolving a path takes one hash lookup per component.
+ */
+class VirtualFileTree
+{
+public:
+  using NodeId  = std::uint32_t;
+  using LayerId = std::uint32_t;
+
+  static constexpr NodeId rootNode    = 0;
+  static constexpr NodeId invalidNode = std::numeric_limits<NodeId>::max();
+  static constexpr LayerId noLayer    = std::numeric_limits<LayerId>::max();
+
+  struct Layer
+  {
+    // source directory or file, empty for layers generated during mounting
+    std::string root;
+    // absolute path the root is mapped to
+    std::string destination;
+  };
+
+  struct Node
+  {
+    NodeId parent;
+    std::uint32_t name;
+    NodeId firstChild;
+    NodeId nextSibling;
+    // layer providing this node, noLayer for directories outside of all stacks
+    LayerId layer;
+    LayerListing::EntryType type;
+    std::uint64_t size;
+  };
+
+  VirtualFileTree();
+
+  /**
+   * @brief Merges a layer stack into the tree. Everything that was below the
+   * destination before is hidden, like it is by a mount.
+   * @param destination Absolute path the layers are mounted on
+   * @param layers Layers ordered from highest to lowest priority, entry paths are
+   * relative to the destination
+   */
+  void addLayers(const std::string& destination, std::span<const LayerSource> layers);
+
+  /**
+   * @brief Resolves an absolute path
+   * @return The node for the path or invalidNode if it does not exist
+   */
+  [[nodiscard]] NodeId resolve(std::string_view path) const;
+
+  /**
+   * @brief Looks up a direct child of a node
+   * @return The child node or invalidNode if it does not exist
+   */
+  [[nodiscard]] NodeId child(NodeId parent, std::string_view name) const;
+
+  /**
+   * @brief Calls the callback for all direct children of the given node, returning
+   * false from the callback stops the iteration
+   */
+  void forEachChild(NodeId parent, const std::function<bool(NodeId)>& callback) const;
+
+  /**
+   * @brief Walks all descendants of the given node depth-first, parents before their
+   * children. Returning false from the callback stops the walk.
+   * @return false if the walk was stopped
+   */
+  bool walk(NodeId node,
+            const std::function<bool(NodeId, const std::string& path)>& callback) const;
+
+  /**
+   * @brief Adds a node below the given parent or updates the existing one
+   * @return The added or updated node
+   */
+  NodeId insert(NodeId parent, std::string_view name, LayerListing::EntryType type,
+                std::uint64_t size, LayerId layer);
+
+  /**
+   * @brief Removes a node including all of its descendants
+   */
+  void remove(NodeId id);
+
+  /**
+   * @brief Moves a node to a new parent and name, there must not be a node with the
+   * new name already
+   */
+  void move(NodeId id, NodeId newParent, std::string_view newName);
+
+  void setLayer(NodeId id, LayerId layer) { m_nodes[id].layer = layer; }
+
+  /**
+   * @brief Adds a layer without any entries, for trees that are not built from
+   * listings
+   */
+  LayerId addLayer(Layer layer);
+
+  [[nodiscard]] const Node& node(NodeId id) const { return m_nodes[id]; }
+  [[nodiscard]] std::string_view name(NodeId id) const
+  {
+    return m_names[m_nodes[id].name];
+  }
+  [[nodiscard]] const Layer& layer(LayerId id) const { return m_layers[id]; }
+
+  /**
+   * @brief Returns the absolute path of the given node
+   */
+  [[nodiscard]] std::string path(NodeId id) const;
+
+  /**
+   * @brief Returns the path of the file backing the given node, an empty string for
+   * generated nodes
+   */
+  [[nodiscard]] std::string sourcePath(NodeId id) const;
+
+  [[nodiscard]] std::size_t nodeCount() const noexcept { return m_nodes.size(); }
+  [[nodiscard]] std::size_t layerCount() const noexcept { return m_layers.size(); }
+
+private:
+  [[nodiscard]] static std::uint64_t childKey(NodeId parent, std::uint32_t name)
+  {
+    return (static_cast<std::uint64_t>(parent) << 32) | name;
+  }
+
+  std::uint32_t intern(std::string_view name);
+  NodeId addChild(NodeId parent, std::string_view name, LayerListing::EntryType type,
+                  std::uint64_t size, LayerId layer);
+  NodeId createDirectories(NodeId parent, std::string_view path, LayerId layer);
+  void removeChildren(NodeId parent);
+  void unlink(NodeId id);
+
+  std::vector<Node> m_nodes;
+  std::vector<Layer> m_layers;
+  // references into this deque stay valid when it grows
+  std::deque<std::string> m_names;
+  std::unordered_map<std::string_view, std::uint32_t> m_nameIds;
+  std::unordered_map<std::uint64_t, NodeId> m_children;
+};